@@ -4,6 +4,8 @@
 #include <cstdlib>
 #include <iostream>
 #include <string.h>
+#include <vector>
+#include <algorithm>
 
 #include "map/map.h"
 
@@ -96,17 +98,14 @@ int action_box(int argc, char ** argv)
 	const int32_t y0 = (int32_t)floor(y_min / scale);
 	const int32_t y1 = (int32_t)ceil(y_max / scale);
 
-	for (int32_t x = x0; x <= x1; x++)
-	{
-		map.set(MAP_CHANNEL_P, x, y0, 0, value);
-		map.set(MAP_CHANNEL_P, x, y1, 0, value);
-	}
-	
-	for (int32_t y = y0; y <= y1; y++)
-	{
-		map.set(MAP_CHANNEL_P, x0, y, 0, value);
-		map.set(MAP_CHANNEL_P, x1, y, 0, value);
-	}
+	// every edge is a one cell wide raster of the same value
+	const uint32_t width = x1 - x0 + 1, height = y1 - y0 + 1;
+	vector<map_data_t> edge(max(width, height), value);
+
+	map.setRegion(MAP_CHANNEL_P, x0, y0, 0, width, 1, &edge[0]);
+	map.setRegion(MAP_CHANNEL_P, x0, y1, 0, width, 1, &edge[0]);
+	map.setRegion(MAP_CHANNEL_P, x0, y0, 0, 1, height, &edge[0]);
+	map.setRegion(MAP_CHANNEL_P, x1, y0, 0, 1, height, &edge[0]);
 	
 	map.commit();
 	
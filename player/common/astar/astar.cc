@@ -1,6 +1,7 @@
 #include "astar.h"
 #include <map>
 #include <queue>
+#include <algorithm>
 #include <limits>
 #include <unordered_map>
 
@@ -79,6 +80,18 @@ bool astar_search(Map *map,
 	const astar_pose2d_t init = {(int32_t)floor(begin.px / scale), (int32_t)floor(begin.py / scale)}; // start position node
 	const astar_pose2d_t goal = {(int32_t)floor(end.px / scale), (int32_t)floor(end.py / scale)}; // goal pose
 
+	// warm up the tiles in the corridor between start and goal
+	const map_info_t info = map->getInfo();
+	const int32_t tile_x_min = (int32_t)floor((double)std::min(init.x, goal.x) / (double)info.tile_width);
+	const int32_t tile_x_max = (int32_t)floor((double)std::max(init.x, goal.x) / (double)info.tile_width);
+	const int32_t tile_y_min = (int32_t)floor((double)std::min(init.y, goal.y) / (double)info.tile_height);
+	const int32_t tile_y_max = (int32_t)floor((double)std::max(init.y, goal.y) / (double)info.tile_height);
+	std::vector<map_tile_id_t> corridor;
+	for (int32_t y = tile_y_min - 1; y <= tile_y_max + 1; y++)
+		for (int32_t x = tile_x_min - 1; x <= tile_x_max + 1; x++)
+			corridor.push_back((map_tile_id_t){MAP_CHANNEL_P_CSPACE, x, y, 0});
+	map->prefetch(corridor);
+
 	// insert first node which is the start pose
 	costs[astar_pose2d_hash(init)] = 1.0;
 	queue.push((astar_node_t){init, 1.0 + hypot(goal.x - init.x, goal.y - init.y)});
@@ -0,0 +1,149 @@
+#include "beam.h"
+
+#include <math.h>
+#include <assert.h>
+#include <pthread.h>
+#include <map>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BEAM_X86
+#include <immintrin.h>
+#define BEAM_SSE2 __attribute__((target("sse2")))
+#define BEAM_AVX2 __attribute__((target("avx2")))
+#endif
+
+typedef struct beam_key
+{
+	float min_angle, resolution, pitch;
+	uint32_t count;
+
+	bool operator<(const beam_key &other) const
+	{
+		if (count != other.count) return count < other.count;
+		if (min_angle != other.min_angle) return min_angle < other.min_angle;
+		if (resolution != other.resolution) return resolution < other.resolution;
+		return pitch < other.pitch;
+	}
+} beam_key_t;
+
+typedef void (*beam_project_t)(const beam_table_t*, const float*, float, float, float*, float*, float*, uint32_t, uint32_t);
+
+// a robot only ever sees a handful of geometries, so tables are never dropped and pointers to them stay good
+static pthread_mutex_t tables_mutex = PTHREAD_MUTEX_INITIALIZER;
+static std::map<beam_key_t, beam_table_t*> tables;
+
+// picked on first use, every thread picks the same one
+static beam_project_t project_kernel = 0;
+
+const beam_table_t* beam_table(float min_angle, float resolution, uint32_t count, float pitch)
+{
+	const beam_key_t key = { min_angle, resolution, pitch, count };
+	beam_table_t *table = 0;
+
+	pthread_mutex_lock(&tables_mutex);
+	std::map<beam_key_t, beam_table_t*>::const_iterator i = tables.find(key);
+	if (i != tables.end())
+	{
+		table = i->second;
+		pthread_mutex_unlock(&tables_mutex);
+		return table;
+	}
+
+	table = new beam_table_t;
+	table->min_angle = min_angle;
+	table->resolution = resolution;
+	table->pitch = pitch;
+	table->count = count;
+	table->angles.resize(count);
+	table->x.resize(count);
+	table->y.resize(count);
+	table->z.resize(count);
+	table->planar.resize(count);
+
+	for (uint32_t j = 0; j < count; j++)
+	{
+		const double angle = (double)min_angle + (double)j * (double)resolution;
+
+		// a pitched laser sweeps a cone, negative pitch tilts the beams down
+		const double tilt = atan(tan((double)pitch) * cos(angle));
+
+		table->angles[j] = angle;
+		table->planar[j] = cos(tilt);
+		table->x[j] = cos(tilt) * cos(angle);
+		table->y[j] = cos(tilt) * sin(angle);
+		table->z[j] = sin(tilt);
+	}
+	tables[key] = table;
+	pthread_mutex_unlock(&tables_mutex);
+	return table;
+}
+
+static void project_scalar(const beam_table_t *table, const float *ranges, float c, float s, float *x, float *y, float *z, uint32_t begin, uint32_t end)
+{
+	for (uint32_t j = begin; j < end; j++)
+	{
+		x[j] = ranges[j] * (table->x[j] * c - table->y[j] * s);
+		y[j] = ranges[j] * (table->y[j] * c + table->x[j] * s);
+		if (z) z[j] = ranges[j] * table->z[j];
+	}
+}
+
+#ifdef BEAM_X86
+
+BEAM_SSE2 static void project_sse2(const beam_table_t *table, const float *ranges, float c, float s, float *x, float *y, float *z, uint32_t begin, uint32_t end)
+{
+	const __m128 cc = _mm_set1_ps(c), ss = _mm_set1_ps(s);
+	uint32_t j = begin;
+
+	for (; j + 4 <= end; j += 4)
+	{
+		const __m128 r = _mm_loadu_ps(ranges + j);
+		const __m128 ux = _mm_loadu_ps(&table->x[j]), uy = _mm_loadu_ps(&table->y[j]);
+		_mm_storeu_ps(x + j, _mm_mul_ps(r, _mm_sub_ps(_mm_mul_ps(ux, cc), _mm_mul_ps(uy, ss))));
+		_mm_storeu_ps(y + j, _mm_mul_ps(r, _mm_add_ps(_mm_mul_ps(uy, cc), _mm_mul_ps(ux, ss))));
+		if (z) _mm_storeu_ps(z + j, _mm_mul_ps(r, _mm_loadu_ps(&table->z[j])));
+	}
+	project_scalar(table, ranges, c, s, x, y, z, j, end);
+}
+
+BEAM_AVX2 static void project_avx2(const beam_table_t *table, const float *ranges, float c, float s, float *x, float *y, float *z, uint32_t begin, uint32_t end)
+{
+	const __m256 cc = _mm256_set1_ps(c), ss = _mm256_set1_ps(s);
+	uint32_t j = begin;
+
+	for (; j + 8 <= end; j += 8)
+	{
+		const __m256 r = _mm256_loadu_ps(ranges + j);
+		const __m256 ux = _mm256_loadu_ps(&table->x[j]), uy = _mm256_loadu_ps(&table->y[j]);
+		_mm256_storeu_ps(x + j, _mm256_mul_ps(r, _mm256_sub_ps(_mm256_mul_ps(ux, cc), _mm256_mul_ps(uy, ss))));
+		_mm256_storeu_ps(y + j, _mm256_mul_ps(r, _mm256_add_ps(_mm256_mul_ps(uy, cc), _mm256_mul_ps(ux, ss))));
+		if (z) _mm256_storeu_ps(z + j, _mm256_mul_ps(r, _mm256_loadu_ps(&table->z[j])));
+	}
+	project_scalar(table, ranges, c, s, x, y, z, j, end);
+}
+
+#endif // BEAM_X86
+
+static void select_kernels()
+{
+	beam_project_t project = &project_scalar;
+
+#ifdef BEAM_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		project = &project_avx2;
+	else if (__builtin_cpu_supports("sse2"))
+		project = &project_sse2;
+#endif
+
+	project_kernel = project;
+}
+
+void beam_project(const beam_table_t *table, const float *ranges, float heading, float *x, float *y, float *z)
+{
+	assert(table);
+	if (!project_kernel) select_kernels();
+
+	// the heading is turned once for the whole scan, not once per beam
+	project_kernel(table, ranges, (float)cos(heading), (float)sin(heading), x, y, z, 0, table->count);
+}
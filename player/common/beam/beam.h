@@ -0,0 +1,26 @@
+#ifndef AMOS_COMMON_BEAM_H
+#define AMOS_COMMON_BEAM_H
+
+#include <stdint.h>
+#include <vector>
+
+// the geometry of a laser scan, worked out once for every (min angle, resolution, count, pitch)
+// a laser reports, beams are numbered from the min angle counter clockwise
+typedef struct beam_table
+{
+	float min_angle, resolution, pitch;
+	uint32_t count;
+	std::vector<float> angles; // of every beam from the x axis of the laser
+	std::vector<float> x, y, z; // end of a beam of unit length, x and y along the ground, z up, cos, sin and zero unless pitched
+	std::vector<float> planar; // length of a beam of unit length along the ground, one unless pitched
+} beam_table_t;
+
+// the table for a scan, made on first use and kept for good, tables can be used from any thread
+const beam_table_t* beam_table(float min_angle, float resolution, uint32_t count, float pitch = 0.0f);
+
+// ends of the beams of a scan with the laser turned by heading, the table ends scaled by the ranges
+// and turned about z, z may be null, uses AVX2 or SSE2 when the cpu has it and gives exactly what
+// the scalar loop does otherwise
+void beam_project(const beam_table_t *table, const float *ranges, float heading, float *x, float *y, float *z);
+
+#endif // AMOS_COMMON_BEAM_H
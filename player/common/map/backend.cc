@@ -0,0 +1,25 @@
+#include "backend.h"
+
+using namespace amos;
+
+void MapBackend::fetch(const std::vector<map_tile_t*> &tiles)
+{
+	// backends without batching simply load one tile after another, a tile that did not load
+	// might as well have failed, so it stays stale and is checked again on access
+	for (std::vector<map_tile_t*>::const_iterator i = tiles.begin(); i != tiles.end(); ++i)
+	{
+		if (!load((*i)->id, (*i)->buffer, &(*i)->revision)) continue;
+		(*i)->data = (*i)->buffer;
+		(*i)->stale = false;
+	}
+}
+
+int MapBackend::patch(const map_tile_id_t &id, const map_data_t *data, uint32_t begin, uint32_t end, uint32_t *revision, uint64_t cas)
+{
+	return save(id, data, revision, cas);
+}
+
+int MapBackend::apply(const map_tile_id_t &id, const map_data_t *multiplication, const map_data_t *addition, uint32_t begin, uint32_t end, map_data_t *data, uint32_t *revision)
+{
+	return 1;
+}
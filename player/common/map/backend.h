@@ -0,0 +1,61 @@
+#ifndef AMOS_COMMON_MAP_BACKEND_H
+#define AMOS_COMMON_MAP_BACKEND_H
+
+#include <vector>
+#include <stdint.h>
+
+#include "type.h"
+
+namespace amos
+{
+	// where tiles are stored and shared with others, one instance must only be used by one thread
+	class MapBackend
+	{
+	public:
+		MapBackend() : bytes_loaded(0), bytes_saved(0), spins(0) {}
+		virtual ~MapBackend() {}
+
+		virtual bool isOpen() const = 0;
+		virtual map_info_t getInfo() const = 0;
+
+		// another connection to the same storage, for use by another thread
+		virtual MapBackend* clone() const = 0;
+
+		// copy the tile into data if the stored revision is newer than *revision
+		virtual bool load(const map_tile_id_t &id, map_data_t *data, uint32_t *revision) = 0;
+
+		// load many tiles into their buffers at once, tiles that are up to date are no longer stale
+		virtual void fetch(const std::vector<map_tile_t*> &tiles);
+
+		// like load, but also returns a token to save against, 0 if the tile does not exist
+		virtual bool checkout(const map_tile_id_t &id, map_data_t *data, uint32_t *revision, uint64_t *cas) = 0;
+
+		// store the tile only if nobody else has since checkout, 0 on success, 1 on conflict, -1 on error
+		virtual int save(const map_tile_id_t &id, const map_data_t *data, uint32_t *revision, uint64_t cas) = 0;
+
+		// like save, but only values from begin to end have changed since checkout,
+		// backends that cannot write part of a tile store all of it
+		virtual int patch(const map_tile_id_t &id, const map_data_t *data, uint32_t begin, uint32_t end, uint32_t *revision, uint64_t cas);
+
+		// hand pending changes from begin to end over to be applied where the tile is stored, data is the tile
+		// they were made on and receives the stored tile if someone else has changed it since *revision,
+		// 0 on success, -1 on error, 1 if the backend cannot apply changes, use checkout and save instead
+		virtual int apply(const map_tile_id_t &id, const map_data_t *multiplication, const map_data_t *addition, uint32_t begin, uint32_t end, map_data_t *data, uint32_t *revision);
+
+		// append tiles that have been added since the cursor and move it forward, a new cursor is 0
+		virtual void list(uint64_t *cursor, std::vector<map_tile_id_t> &list) = 0;
+
+		// tile data moved so far, in the size the backend stores it in
+		uint64_t getBytesLoaded() const { return bytes_loaded; }
+		uint64_t getBytesSaved() const { return bytes_saved; }
+		// times a tile was locked by someone else and had to be tried again
+		uint64_t getSpins() const { return spins; }
+
+	protected:
+		uint64_t bytes_loaded;
+		uint64_t bytes_saved;
+		uint64_t spins;
+	};
+}
+
+#endif // AMOS_COMMON_MAP_BACKEND_H
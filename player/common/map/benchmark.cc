@@ -0,0 +1,454 @@
+// micro benchmarks for amos::Map against the in-memory backend, so that no memcached server is needed
+//
+// usage: mapbenchmark [latency] [iterations]
+// [latency]: injected round trip time to the store in microseconds, defaults to 0
+// [iterations]: operations per single cell benchmark, defaults to 1000000
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <vector>
+
+#include "map.h"
+#include "mockbackend.h"
+#include "merge.h"
+#include "timer/timer.h"
+
+#define BENCHMARK_TILE_SIZE 256
+#define BENCHMARK_REGION 8 // width and height of the area being worked on, in tiles
+#define BENCHMARK_PAGES (3 * BENCHMARK_REGION * BENCHMARK_REGION) // room for the whole area, with pending changes
+#define BENCHMARK_COMMIT_INTERVAL 1000 // updates between commits in the writer benchmark
+#define BENCHMARK_RAY_LENGTH 8.0 // metres, about the range of a laser indoors
+
+using namespace amos;
+
+typedef struct benchmark_writer
+{
+	MockMapStore *store;
+	uint32_t latency;
+	uint32_t iterations;
+	uint32_t seed;
+	uint32_t commits;
+	uint32_t conflicts;
+	uint32_t retries;
+	uint32_t round_trips;
+} benchmark_writer_t;
+
+static void report(const char *name, uint64_t elapsed, uint32_t operations, uint32_t round_trips)
+{
+	printf("%-40s %12.1f ns/op %12.0f op/s %10u round trips\n",
+		name,
+		operations ? 1000.0 * elapsed / operations : 0.0,
+		elapsed ? 1000000.0 * operations / elapsed : 0.0,
+		round_trips);
+}
+
+static void benchmark_random_get(MockMapStore *store, uint32_t latency, uint32_t iterations)
+{
+	MockMapBackend *backend = new MockMapBackend(store, latency);
+	Map map(backend, BENCHMARK_REGION * BENCHMARK_REGION);
+	const int32_t size = BENCHMARK_REGION * BENCHMARK_TILE_SIZE;
+	struct timeval start;
+	volatile map_data_t sum = 0.0f;
+
+	srand(1);
+	Timer::getNow(start);
+	for (uint32_t i = 0; i < iterations; i++)
+		sum += map.get(MAP_CHANNEL_P, rand() % size, rand() % size, 0);
+	report("random get", Timer::getSince(start), iterations, backend->getRoundTrips());
+}
+
+static void benchmark_sequential_get(MockMapStore *store, uint32_t latency, uint32_t iterations)
+{
+	MockMapBackend *backend = new MockMapBackend(store, latency);
+	Map map(backend, BENCHMARK_REGION * BENCHMARK_REGION);
+	const int32_t size = BENCHMARK_REGION * BENCHMARK_TILE_SIZE;
+	struct timeval start;
+	volatile map_data_t sum = 0.0f;
+
+	Timer::getNow(start);
+	for (uint32_t i = 0; i < iterations; i++)
+		sum += map.get(MAP_CHANNEL_P, (int32_t)(i % size), (int32_t)(i / size % size), 0);
+	report("sequential get", Timer::getSince(start), iterations, backend->getRoundTrips());
+}
+
+static void benchmark_region_get(MockMapStore *store, uint32_t latency, uint32_t iterations, bool region)
+{
+	MockMapBackend *backend = new MockMapBackend(store, latency);
+	Map map(backend, BENCHMARK_REGION * BENCHMARK_REGION);
+	const int32_t size = (BENCHMARK_REGION - 1) * BENCHMARK_TILE_SIZE;
+	const uint32_t side = BENCHMARK_TILE_SIZE + BENCHMARK_TILE_SIZE / 2; // reaches into up to four tiles
+	const uint32_t rasters = iterations / (side * side) + 1;
+	std::vector<map_data_t> raster(side * side);
+	struct timeval start;
+
+	// a neighbourhood around a random cell, the way cspace reads the map
+	srand(7);
+	Timer::getNow(start);
+	for (uint32_t i = 0; i < rasters; i++)
+	{
+		const int32_t x = rand() % size, y = rand() % size;
+		if (region)
+		{
+			map.getRegion(MAP_CHANNEL_P, x, y, 0, side, side, &raster[0]);
+			continue;
+		}
+		for (uint32_t j = 0; j < side; j++)
+			for (uint32_t k = 0; k < side; k++)
+				raster[j * side + k] = map.get(MAP_CHANNEL_P, x + (int32_t)k, y + (int32_t)j, 0);
+	}
+	report(region ? "region get, raster" : "region get, cell by cell", Timer::getSince(start), rasters * side * side, backend->getRoundTrips());
+}
+
+static void benchmark_random_update(MockMapStore *store, uint32_t latency, uint32_t iterations)
+{
+	MockMapBackend *backend = new MockMapBackend(store, latency);
+	Map map(backend, BENCHMARK_PAGES);
+	const int32_t size = BENCHMARK_REGION * BENCHMARK_TILE_SIZE;
+	struct timeval start;
+
+	srand(2);
+	Timer::getNow(start);
+	for (uint32_t i = 0; i < iterations; i++)
+		map.update(MAP_CHANNEL_P, rand() % size, rand() % size, 0, 0.9f, 0.05f);
+	map.commit();
+	report("random update + commit", Timer::getSince(start), iterations, backend->getRoundTrips());
+}
+
+static void benchmark_ray_cells(void *context, const map_ray_span_t &span)
+{
+	std::vector<map_tile_id_t> *cells = (std::vector<map_tile_id_t>*)context;
+	for (uint32_t i = 0; i < span.count; i++)
+		cells->push_back((map_tile_id_t){ span.id.channel,
+			span.id.x * BENCHMARK_TILE_SIZE + (int32_t)(span.cells[i] % BENCHMARK_TILE_SIZE),
+			span.id.y * BENCHMARK_TILE_SIZE + (int32_t)(span.cells[i] / BENCHMARK_TILE_SIZE), 0 });
+}
+
+static void benchmark_ray_carve(void *context, const map_ray_span_t &span)
+{
+	for (uint32_t i = 0; i < span.count; i++)
+		map_cell_update(span.data, span.multiplication, span.addition, span.cells[i], 0.9f, 0.0f);
+}
+
+static void benchmark_ray(MockMapStore *store, uint32_t latency, uint32_t iterations, bool traced)
+{
+	MockMapBackend *backend = new MockMapBackend(store, latency);
+	Map map(backend, BENCHMARK_PAGES);
+	const double center = 0.5 * BENCHMARK_REGION * BENCHMARK_TILE_SIZE * map.getInfo().scale;
+	std::vector<map_tile_id_t> cells;
+	uint32_t count = 0;
+	struct timeval start;
+	uint64_t elapsed = 0;
+
+	// free space carving along the beams of a laser scan, from somewhere around the middle
+	srand(8);
+	for (uint32_t scan = 0; count < iterations; scan++)
+	{
+		const double x = center + (rand() % 1000) / 1000.0, y = center + (rand() % 1000) / 1000.0;
+		for (int beam = 0; beam < 361; beam++)
+		{
+			const double angle = M_PI * (beam * 0.5 - 90.0) / 180.0 + 0.01 * scan;
+			const double x1 = x + BENCHMARK_RAY_LENGTH * cos(angle), y1 = y + BENCHMARK_RAY_LENGTH * sin(angle);
+			if (traced)
+			{
+				Timer::getNow(start);
+				count += map.trace(MAP_CHANNEL_P, x, y, x1, y1, 0.0, true, &benchmark_ray_carve, 0);
+				elapsed += Timer::getSince(start);
+				continue;
+			}
+
+			// the same cells, one at a time
+			cells.clear();
+			map.trace(MAP_CHANNEL_P, x, y, x1, y1, 0.0, false, &benchmark_ray_cells, &cells);
+			Timer::getNow(start);
+			for (std::vector<map_tile_id_t>::const_iterator i = cells.begin(); i != cells.end(); ++i)
+				map.update(MAP_CHANNEL_P, i->x, i->y, 0, 0.9f, 0.0f);
+			elapsed += Timer::getSince(start);
+			count += cells.size();
+		}
+	}
+	map.commit();
+	report(traced ? "ray carving, traced" : "ray carving, cell by cell", elapsed, count, backend->getRoundTrips());
+}
+
+static void benchmark_tile_update(MockMapStore *store, uint32_t latency, uint32_t iterations)
+{
+	MockMapBackend *backend = new MockMapBackend(store, latency);
+	Map map(backend, BENCHMARK_PAGES);
+	std::vector<map_data_t> multiplication(map.getTileLength(), 0.9f);
+	std::vector<map_data_t> addition(map.getTileLength(), 0.05f);
+	const uint32_t tiles = iterations / 1000 + 1;
+	struct timeval start;
+
+	Timer::getNow(start);
+	for (uint32_t i = 0; i < tiles; i++)
+	{
+		map_tile_id_t id = { MAP_CHANNEL_P, (int32_t)(i % BENCHMARK_REGION), (int32_t)(i / BENCHMARK_REGION % BENCHMARK_REGION), 0 };
+		map.update(id, &multiplication[0], &addition[0]);
+	}
+	map.commit();
+	report("whole tile update + commit", Timer::getSince(start), tiles, backend->getRoundTrips());
+}
+
+static void benchmark_band_update(MockMapStore *store, uint32_t latency, uint32_t iterations)
+{
+	MockMapBackend *backend = new MockMapBackend(store, latency);
+	Map map(backend, BENCHMARK_PAGES);
+	const int32_t size = BENCHMARK_REGION * BENCHMARK_TILE_SIZE;
+	struct timeval start;
+
+	// a few rows of every tile, the way a laser sweep touches a tile, committed over and over
+	srand(5);
+	Timer::getNow(start);
+	for (uint32_t i = 0; i < iterations; i++)
+	{
+		map.update(MAP_CHANNEL_P, rand() % size, rand() % size / BENCHMARK_TILE_SIZE * BENCHMARK_TILE_SIZE + rand() % 8, 0, 0.9f, 0.05f);
+		if ((i + 1) % BENCHMARK_COMMIT_INTERVAL == 0) map.commit();
+	}
+	map.commit();
+	report("band update + commit", Timer::getSince(start), iterations, backend->getRoundTrips());
+	printf("%-40s %12.1f kB saved\n", "", backend->getBytesSaved() / 1024.0);
+}
+
+static void benchmark_elevation(MockMapStore *store, uint32_t latency, uint32_t iterations, bool grouped)
+{
+	MockMapBackend *backend = new MockMapBackend(store, latency);
+	Map map(backend, 2 * BENCHMARK_PAGES); // room for both channels, or the group, of the whole region
+	const int32_t size = BENCHMARK_REGION * BENCHMARK_TILE_SIZE;
+	const map_data_t multiplication[2] = { 0.9f, 0.9f };
+	const map_data_t addition[2] = { 0.05f, 0.01f };
+	struct timeval start;
+
+	// average and variance of the same cell, the way the mapper does it
+	srand(4);
+	Timer::getNow(start);
+	for (uint32_t i = 0; i < iterations; i++)
+	{
+		const int32_t x = rand() % size, y = rand() % size;
+		if (grouped)
+		{
+			map.updateGroup(MAP_CHANNEL_E, x, y, 0, multiplication, addition);
+		}
+		else
+		{
+			map.update(MAP_CHANNEL_E_AVG, x, y, 0, multiplication[0], addition[0]);
+			map.update(MAP_CHANNEL_E_VAR, x, y, 0, multiplication[1], addition[1]);
+		}
+	}
+	map.commit();
+	report(grouped ? "elevation update + commit, grouped" : "elevation update + commit", Timer::getSince(start), iterations, backend->getRoundTrips());
+}
+
+static void benchmark_refresh(MockMapStore *store, uint32_t latency, uint32_t iterations)
+{
+	MockMapBackend *backend = new MockMapBackend(store, latency);
+	Map reader(backend, BENCHMARK_REGION * BENCHMARK_REGION);
+	Map writer(new MockMapBackend(store, latency), BENCHMARK_PAGES);
+	const uint32_t cycles = iterations / 10000 + 1;
+	struct timeval start;
+	uint64_t elapsed = 0;
+	uint32_t round_trips = 0;
+
+	// reader has all tiles cached, every cycle somebody else changes one row of them
+	for (int32_t y = 0; y < BENCHMARK_REGION; y++)
+		for (int32_t x = 0; x < BENCHMARK_REGION; x++)
+			reader.get((map_tile_id_t){ MAP_CHANNEL_P, x, y, 0 }, 0u);
+	round_trips = backend->getRoundTrips();
+
+	for (uint32_t i = 0; i < cycles; i++)
+	{
+		for (int32_t x = 0; x < BENCHMARK_REGION; x++)
+			writer.update((map_tile_id_t){ MAP_CHANNEL_P, x, (int32_t)(i % BENCHMARK_REGION), 0 }, 0u, 0.9f, 0.05f);
+		writer.commit();
+
+		Timer::getNow(start);
+		reader.refresh();
+		for (int32_t y = 0; y < BENCHMARK_REGION; y++)
+			for (int32_t x = 0; x < BENCHMARK_REGION; x++)
+				reader.get((map_tile_id_t){ MAP_CHANNEL_P, x, y, 0 }, 0u);
+		elapsed += Timer::getSince(start);
+	}
+	report("refresh + get of 64 tiles, 8 changed", elapsed, cycles, backend->getRoundTrips() - round_trips);
+}
+
+static void benchmark_eviction(MockMapStore *store, uint32_t latency, uint32_t iterations, uint32_t pages)
+{
+	MockMapBackend *backend = new MockMapBackend(store, latency);
+	Map map(backend, pages);
+	const int32_t size = 2 * BENCHMARK_REGION * BENCHMARK_TILE_SIZE;
+	const uint32_t operations = iterations / 50;
+	struct timeval start;
+	char name[64];
+
+	// a region of 16x16 tiles, bigger than all but the largest cache, every other access dirties a tile
+	srand(3);
+	Timer::getNow(start);
+	for (uint32_t i = 0; i < operations; i++)
+	{
+		if (i & 1)
+			map.update(MAP_CHANNEL_P, rand() % size, rand() % size, 0, 0.9f, 0.05f);
+		else
+			map.get(MAP_CHANNEL_P, rand() % size, rand() % size, 0);
+	}
+	map.commit();
+	snprintf(name, sizeof(name), "eviction churn, %u pages", pages);
+	report(name, Timer::getSince(start), operations, backend->getRoundTrips());
+}
+
+static void benchmark_sweep(MockMapStore *store, uint32_t latency, uint32_t iterations)
+{
+	MockMapBackend *backend = new MockMapBackend(store, latency);
+	Map map(backend, BENCHMARK_REGION * BENCHMARK_REGION);
+	const int32_t size = (BENCHMARK_REGION - 2) * BENCHMARK_TILE_SIZE;
+	const uint32_t operations = iterations / 10;
+	uint32_t swept = 0;
+	struct timeval start;
+	volatile map_data_t sum = 0.0f;
+
+	// the working set around the robot takes half the cache, every so often somebody
+	// reads every tile of a region four times the size of the cache, only the round trips
+	// of the working set are counted
+	srand(6);
+	Timer::getNow(start);
+	for (uint32_t i = 0; i < operations; i++)
+	{
+		sum += map.get(MAP_CHANNEL_P, rand() % size, rand() % size, 0);
+		if ((i + 1) % BENCHMARK_COMMIT_INTERVAL == 0)
+		{
+			const uint32_t round_trips = backend->getRoundTrips();
+			for (int32_t y = 0; y < 2 * BENCHMARK_REGION; y++)
+				for (int32_t x = 0; x < 2 * BENCHMARK_REGION; x++)
+					map.get((map_tile_id_t){ MAP_CHANNEL_P, x + BENCHMARK_REGION, y, 0 }, 0u);
+			swept += backend->getRoundTrips() - round_trips;
+		}
+	}
+	report("working set get between sweeps", Timer::getSince(start), operations, backend->getRoundTrips() - swept);
+	const map_stats_t stats = map.stats();
+	printf("%-40s %12llu hits %10llu misses\n", "", (unsigned long long)stats.hits, (unsigned long long)stats.misses);
+}
+
+static void* benchmark_writer_main(void *object)
+{
+	benchmark_writer_t *writer = (benchmark_writer_t*)object;
+	MockMapBackend *backend = new MockMapBackend(writer->store, writer->latency);
+	Map map(backend, BENCHMARK_PAGES);
+	const int32_t size = BENCHMARK_REGION * BENCHMARK_TILE_SIZE;
+
+	for (uint32_t i = 0; i < writer->iterations; i++)
+	{
+		map.update(MAP_CHANNEL_P, rand_r(&writer->seed) % size, rand_r(&writer->seed) % size, 0, 0.9f, 0.05f);
+		if ((i + 1) % BENCHMARK_COMMIT_INTERVAL == 0)
+		{
+			map.commit();
+			writer->commits++;
+		}
+	}
+	map.commit();
+	writer->commits++;
+
+	writer->conflicts = map.getConflicts();
+	writer->retries = map.getRetries();
+	writer->round_trips = backend->getRoundTrips();
+	return 0;
+}
+
+static void benchmark_writers(MockMapStore *store, uint32_t latency, uint32_t iterations, uint32_t count)
+{
+	std::vector<benchmark_writer_t> writers(count);
+	std::vector<pthread_t> threads(count);
+	uint32_t commits = 0, conflicts = 0, retries = 0, round_trips = 0;
+	const uint32_t operations = iterations / 50;
+	struct timeval start;
+	char name[64];
+
+	// all writers hammer the same tiles, each with a map of its own
+	Timer::getNow(start);
+	for (uint32_t i = 0; i < count; i++)
+	{
+		writers[i].store = store;
+		writers[i].latency = latency;
+		writers[i].iterations = operations / count;
+		writers[i].seed = i + 1;
+		writers[i].commits = writers[i].conflicts = writers[i].retries = writers[i].round_trips = 0;
+		pthread_create(&threads[i], 0, &benchmark_writer_main, &writers[i]);
+	}
+
+	for (uint32_t i = 0; i < count; i++)
+	{
+		pthread_join(threads[i], 0);
+		commits += writers[i].commits;
+		conflicts += writers[i].conflicts;
+		retries += writers[i].retries;
+		round_trips += writers[i].round_trips;
+	}
+
+	snprintf(name, sizeof(name), "commit, %u writers", count);
+	report(name, Timer::getSince(start), commits, round_trips);
+	printf("%-40s %12u conflicts %10u retries\n", "", conflicts, retries);
+}
+
+int main(int argc, char **argv)
+{
+	map_info_t info = { 0.05, BENCHMARK_TILE_SIZE, BENCHMARK_TILE_SIZE, 1 };
+	uint32_t latency = argc > 1 ? atoi(argv[1]) : 0;
+	uint32_t iterations = argc > 2 ? atoi(argv[2]) : 1000000;
+
+	printf("tiles of %ux%u, %uus latency, %u iterations\n", info.tile_width, info.tile_height, latency, iterations);
+
+	// the get benchmarks read back what the update benchmark has written,
+	// everything else starts with an empty store
+	{
+		MockMapStore store(info);
+		benchmark_random_update(&store, latency, iterations);
+		benchmark_random_get(&store, latency, iterations);
+		benchmark_sequential_get(&store, latency, iterations);
+		benchmark_region_get(&store, latency, iterations, false);
+		benchmark_region_get(&store, latency, iterations, true);
+	}
+
+	{
+		MockMapStore store(info);
+		benchmark_tile_update(&store, latency, iterations);
+	}
+
+	for (int traced = 0; traced < 2; traced++)
+	{
+		MockMapStore store(info);
+		benchmark_ray(&store, latency, iterations, traced);
+	}
+
+	{
+		MockMapStore store(info);
+		benchmark_band_update(&store, latency, iterations);
+	}
+
+	for (int grouped = 0; grouped < 2; grouped++)
+	{
+		MockMapStore store(info);
+		benchmark_elevation(&store, latency, iterations, grouped);
+	}
+
+	{
+		MockMapStore store(info);
+		benchmark_refresh(&store, latency, iterations);
+	}
+
+	for (uint32_t pages = 4; pages <= 256; pages *= 4)
+	{
+		MockMapStore store(info);
+		benchmark_eviction(&store, latency, iterations, pages);
+	}
+
+	{
+		MockMapStore store(info);
+		benchmark_sweep(&store, latency, iterations);
+	}
+
+	for (uint32_t count = 1; count <= 8; count *= 2)
+	{
+		MockMapStore store(info);
+		benchmark_writers(&store, latency, iterations, count);
+	}
+
+	return 0;
+}
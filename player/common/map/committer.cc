@@ -0,0 +1,149 @@
+#include "committer.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+
+#define COMMITTER_RETRY_DELAY 0.1 // seconds before a failed commit is tried again, doubles up to a second
+#define COMMITTER_QUIT_RETRIES 4 // failed commits are only tried this many more times once quitting
+
+using namespace amos;
+
+MapCommitter::MapCommitter(Map *map, MapBackend *backend, uint32_t queue_length) :
+	Thread(), map(map), backend(0), current(0), quit(false)
+{
+	assert(map && backend && queue_length > 0);
+
+	// backends are not thread safe, so we need our own
+	this->backend = backend->clone();
+	assert(this->backend);
+
+	// jobs borrow their buffers from the map when they are filled, see Map::snapshot()
+	jobs.resize(queue_length);
+	for (uint32_t i = 0; i < queue_length; i++)
+	{
+		memset(&jobs[i], 0, sizeof(map_tile_t));
+		idle.push_back(&jobs[i]);
+	}
+}
+
+MapCommitter::~MapCommitter()
+{
+	finish();
+
+	if (backend)
+	{
+		delete backend;
+		backend = 0;
+	}
+}
+
+map_tile_t* MapCommitter::reserve()
+{
+	map_tile_t *job = 0;
+
+	mutex.lock();
+	while (idle.empty())
+		condition.wait(&mutex);
+	job = idle.back();
+	idle.pop_back();
+	mutex.unlock();
+
+	return job;
+}
+
+void MapCommitter::submit(map_tile_t *job)
+{
+	assert(job);
+
+	mutex.lock();
+	queue.push_back(job);
+	condition.broadcast();
+	mutex.unlock();
+}
+
+void MapCommitter::wait(const map_tile_id_t &id)
+{
+	mutex.lock();
+	for(;;)
+	{
+		bool pending = current && current->id == id;
+		for (std::deque<map_tile_t*>::const_iterator i = queue.begin(); !pending && i != queue.end(); ++i)
+			pending = (*i)->id == id;
+		if (!pending) break;
+		condition.wait(&mutex);
+	}
+	mutex.unlock();
+}
+
+void MapCommitter::flush()
+{
+	mutex.lock();
+	while (!queue.empty() || current)
+		condition.wait(&mutex);
+	mutex.unlock();
+}
+
+void MapCommitter::finish()
+{
+	// let the thread finish whatever is still in the queue
+	mutex.lock();
+	const bool running = !quit;
+	quit = true;
+	condition.broadcast();
+	mutex.unlock();
+	if (running) stop();
+}
+
+void MapCommitter::collect(std::vector<map_tile_t*> &done)
+{
+	// idle jobs are left alone by the thread, so the owner may take their buffers back
+	mutex.lock();
+	for (std::vector<map_tile_t*>::const_iterator i = idle.begin(); i != idle.end(); ++i)
+		if ((*i)->buffer) done.push_back(*i);
+	mutex.unlock();
+}
+
+void MapCommitter::run()
+{
+	for(;;)
+	{
+		mutex.lock();
+		while (queue.empty() && !quit)
+			condition.wait(&mutex);
+
+		// only quit once the queue is drained
+		if (queue.empty())
+		{
+			mutex.unlock();
+			break;
+		}
+		current = queue.front();
+		queue.pop_front();
+		mutex.unlock();
+
+		// lock, merge and save happen without holding up the owner, the changes were taken out
+		// of the tile when the job was queued, so a failed commit is tried again until it goes
+		// through, meanwhile the queue fills up and holds up the owner instead of losing changes
+		double delay = COMMITTER_RETRY_DELAY;
+		for (uint32_t failures = 0; !map->commit(current, backend); failures++)
+		{
+			mutex.lock();
+			if (quit && failures >= COMMITTER_QUIT_RETRIES)
+			{
+				mutex.unlock();
+				fprintf(stderr, "map: committer: giving up on tile (%i, %i, %i, %i), its changes are lost\n", current->id.channel, current->id.x, current->id.y, current->id.z);
+				break;
+			}
+			condition.wait(&mutex, delay);
+			mutex.unlock();
+			if (delay < 1.0) delay += delay;
+		}
+
+		mutex.lock();
+		idle.push_back(current);
+		current = 0;
+		condition.broadcast();
+		mutex.unlock();
+	}
+}
@@ -0,0 +1,47 @@
+#ifndef AMOS_COMMON_MAP_COMMITTER_H
+#define AMOS_COMMON_MAP_COMMITTER_H
+
+#include <deque>
+#include <vector>
+#include <stdint.h>
+#include "map.h"
+#include "thread/thread.h"
+#include "thread/mutex.h"
+#include "thread/condition.h"
+
+namespace amos
+{
+	// commits snapshots of dirty tiles in the background over its own connection,
+	// so that the owner of the map can keep updating it, a commit that fails is tried again
+	// rather than dropped
+	class MapCommitter : public Thread
+	{
+	public:
+		MapCommitter(Map *map, MapBackend *backend, uint32_t queue_length);
+		virtual ~MapCommitter();
+
+		virtual map_tile_t* reserve(); // blocks while the queue is full
+		virtual void submit(map_tile_t *job);
+		virtual void wait(const map_tile_id_t &id); // blocks while changes to the tile are pending
+		virtual void flush(); // blocks until everything submitted has been committed
+		virtual void finish(); // drains the queue, giving up on commits that keep failing, and stops
+		virtual void collect(std::vector<map_tile_t*> &done); // committed jobs still holding buffers of the map
+
+	protected:
+		virtual void run();
+
+		Map *map;
+		MapBackend *backend;
+
+		std::vector<map_tile_t> jobs;
+		std::vector<map_tile_t*> idle;
+		std::deque<map_tile_t*> queue;
+		map_tile_t *current; // job being committed right now
+		bool quit;
+
+		Mutex mutex;
+		Condition condition;
+	};
+}
+
+#endif // AMOS_COMMON_MAP_COMMITTER_H
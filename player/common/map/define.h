@@ -10,7 +10,42 @@
 #define MAP_CHANNEL_R				((uint32_t)4)
 #define MAP_CHANNEL_G				((uint32_t)5)
 #define MAP_CHANNEL_B				((uint32_t)6)
-#define MAP_CHANNEL_DEFAULTS		{ 0.5f, 0.5f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f }
+
+// channel groups keep the values of related channels interleaved in one tile, so that they are
+// loaded and committed together, a group tile covers the same cells as any other tile
+// but holds MAP_CHANNEL_WIDTHS[group] values per cell
+#define MAP_CHANNEL_E				((uint32_t)7) // elevation average and variance
+#define MAP_CHANNEL_RGB				((uint32_t)8) // red, green, blue and one unused value
+#define MAP_CHANNEL_E_MEMBER_AVG	0
+#define MAP_CHANNEL_E_MEMBER_VAR	1
+#define MAP_CHANNEL_RGB_MEMBER_R	0
+#define MAP_CHANNEL_RGB_MEMBER_G	1
+#define MAP_CHANNEL_RGB_MEMBER_B	2
+#define MAP_CHANNEL_COUNT			((uint32_t)9) // channels and groups, levels aside
+
+#define MAP_CHANNEL_DEFAULTS		{ 0.5f, 0.5f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f }
+#define MAP_CHANNEL_WIDTHS			{ 1, 1, 1, 1, 1, 1, 1, 2, 4 }
+#define MAP_CHANNEL_WIDTH_MAX		4
+
+// every channel has a pyramid of coarser levels, each level halves the resolution of the one below,
+// a level is stored as a channel of its own with the level number in the upper bits
+#define MAP_CHANNEL_LEVEL_SHIFT		16
+#define MAP_CHANNEL_LEVEL(channel, level)	((uint32_t)(channel) | ((uint32_t)(level) << MAP_CHANNEL_LEVEL_SHIFT))
+#define MAP_CHANNEL_BASE(channel)	((uint32_t)(channel) & ((1u << MAP_CHANNEL_LEVEL_SHIFT) - 1))
+#define MAP_CHANNEL_LEVEL_OF(channel)	((uint32_t)(channel) >> MAP_CHANNEL_LEVEL_SHIFT)
+#define MAP_LEVELS					5 // base level included
+
+// how a coarser cell is made out of the 2x2 cells below it
+#define MAP_REDUCTION_MAX			((uint8_t)0)
+#define MAP_REDUCTION_MEAN			((uint8_t)1)
+#define MAP_CHANNEL_REDUCTIONS		{ MAP_REDUCTION_MAX, MAP_REDUCTION_MAX, MAP_REDUCTION_MEAN, MAP_REDUCTION_MEAN, MAP_REDUCTION_MEAN, MAP_REDUCTION_MEAN, MAP_REDUCTION_MEAN, MAP_REDUCTION_MEAN, MAP_REDUCTION_MEAN }
+
+// how a channel is stored on the servers, tiles are always map_data_t in memory
+#define MAP_TYPE_FLOAT				((uint8_t)0)
+#define MAP_TYPE_UINT8				((uint8_t)1) // [0, 1] in steps of 1/255
+#define MAP_TYPE_LOGODDS16			((uint8_t)2) // probability as log-odds in steps of 1/MAP_LOGODDS_SCALE
+#define MAP_CHANNEL_TYPES			{ MAP_TYPE_LOGODDS16, MAP_TYPE_FLOAT, MAP_TYPE_FLOAT, MAP_TYPE_FLOAT, MAP_TYPE_UINT8, MAP_TYPE_UINT8, MAP_TYPE_UINT8, MAP_TYPE_FLOAT, MAP_TYPE_UINT8 }
+#define MAP_LOGODDS_SCALE			(1024.0f)
 
 #define MAP_P_MAX (1.0f)
 #define MAP_P_MIN (0.0f)
@@ -1,195 +1,242 @@
 #include "map.h"
 
 #include <string.h>
-#include <algorithm>
 #include <stdio.h>
 #include <assert.h>
 #include <limits>
+#include <algorithm>
+
+#include "memcachedbackend.h"
+#include "committer.h"
+#include "merge.h"
+#include "timer/timer.h"
+
+// how many times a tile commit is attempted when others keep committing the same tile
+#define MAP_COMMIT_ATTEMPTS 16
+
+// the second queue of the cache takes up to one in MAP_PROBATION_SHARE pages,
+// and tiles that drop out of it are remembered for one in MAP_GHOST_SHARE
+#define MAP_PROBATION_SHARE 4
+#define MAP_GHOST_SHARE 2
 
-#include "memcached.h"
+// cells of a coarser level are larger in x and y only
+#define MAP_LEVEL_SCALE(channel) (info.scale * (double)(1u << MAP_CHANNEL_LEVEL_OF(channel)))
 
 using namespace amos;
 
-Map::Map(const std::vector< std::pair<std::string, uint16_t> > &servers, uint32_t pages) : pages(pages), memc(0)
+// true if value is a power of two, and which one
+static bool map_log2(uint32_t value, uint32_t *shift)
 {
-	memcached_return mr = MEMCACHED_SUCCESS;
-	memcached_server_st *server_list = 0;
-	memcachedmap_key_t info_key;
-	size_t info_size = 0;
-	uint32_t info_flags = 0;
-	char *info_data = 0;
+	if (!value || (value & (value - 1))) return false;
+	for (*shift = 0; (1u << *shift) != value; (*shift)++);
+	return true;
+}
+
+Map::Map(const std::vector< std::pair<std::string, uint16_t> > &servers, uint32_t pages) : pages(pages), tile_pow2(false), tile_shift_x(0), tile_shift_y(0), tile_shift_z(0), head(0), tail(0), probation(0), size(0), probation_size(0), records(0), free_records(0), allocated(0), list_cursor(0), conflicts(0), retries(0), levels(0), committer(0), committing(0), backend(0)
+{
+	init(new MemcachedMapBackend(servers));
+}
 
-	memc = memcached_create(0);
-	assert(memc);
+Map::Map(MapBackend *backend, uint32_t pages) : pages(pages), tile_pow2(false), tile_shift_x(0), tile_shift_y(0), tile_shift_z(0), head(0), tail(0), probation(0), size(0), probation_size(0), records(0), free_records(0), allocated(0), list_cursor(0), conflicts(0), retries(0), levels(0), committer(0), committing(0), backend(0)
+{
+	init(backend);
+}
 
-	// create the list of server
-	for (std::vector< std::pair<std::string, uint16_t> >::const_iterator i = servers.begin(); i != servers.end(); i++)
+void Map::init(MapBackend *backend)
+{
+	// the map owns its backend, even if it cannot be used
+	memset(&statistics, 0, sizeof(map_stats_t));
+	reserve(pages);
+	if (!backend) return;
+	if (!backend->isOpen())
 	{
-		server_list = memcached_server_list_append(server_list, i->first.c_str(), i->second, &mr);
-		if (mr != MEMCACHED_SUCCESS)
-			goto error;
+		delete backend;
+		return;
 	}
+	this->backend = backend;
+	info = backend->getInfo();
 
-	// connect to all servers
-	mr = memcached_server_push(memc, server_list);
-	if (mr != MEMCACHED_SUCCESS)
-		goto error;
-	memcached_server_free(server_list);
-	server_list = 0;
-
-	// now find out if there is a map on the server
-	memset(&info_key, 0, sizeof(memcachedmap_key_t));
-	info_key.ns = MEMCACHEDMAP_KEY_NAMESPACE;
-	info_key.type = MEMCACHEDMAP_KEY_TYPE_INFO;
-	info_data = memcached_get(memc, (const char*)&info_key, MEMCACHEDMAP_KEY_SIZE, &info_size, &info_flags, &mr);
-	if (!info_data)
-		goto error;
-	if (info_size != sizeof(map_info_t))
-		goto error;
-	memcpy(&info, info_data, sizeof(map_info_t));
-	free(info_data);
-	info_data = 0;
+	// most maps have tiles of 2^n cells a side, maptool can make others
+	tile_pow2 = map_log2(info.tile_width, &tile_shift_x) && map_log2(info.tile_height, &tile_shift_y) && map_log2(info.tile_depth, &tile_shift_z);
+}
 
-	// a little sanity check
-	if (info.scale <= 0.0)
-		goto error;
+void Map::reserve(uint32_t pages)
+{
+	uint32_t bucket_count = 16;
 
-	return;
+	assert(!head);
+	this->pages = pages > 0 ? pages : 1;
 
-error:
-	if (mr != MEMCACHED_SUCCESS)
-	{
-		fprintf(stderr, "memcachedmap: error: %s\n", memcached_strerror(memc, mr));
-	}
+	// size the hash index so that the load factor stays below one half
+	while (bucket_count < this->pages + this->pages) bucket_count <<= 1;
+	buckets.assign(bucket_count, 0);
 
-	if (info_data)
+	// every tile takes at least one page, so there is never need for more records
+	if (records) delete [] records;
+	records = new map_tile_t[this->pages];
+	free_records = 0;
+	for (uint32_t i = 0; i < this->pages; i++)
 	{
-		free(info_data);
-		info_data = 0;
+		memset(&records[i], 0, sizeof(map_tile_t));
+		records[i].chain = free_records;
+		free_records = &records[i];
 	}
 
-	if (memc)
+	// give back whatever the new budget has no room for
+	for (std::map<uint32_t, std::vector<map_data_t*> >::iterator i = free_buffers.begin(); i != free_buffers.end(); ++i)
 	{
-		memcached_quit(memc);
-		memcached_free(memc);
-		memc = 0;
+		while (allocated > this->pages && !i->second.empty())
+		{
+			delete [] i->second.back();
+			i->second.pop_back();
+			allocated -= i->first / getTileLength();
+		}
 	}
 }
 
 Map::~Map()
 {
-	if (memc)
+	// wait for pending commits before tearing anything down
+	if (committer)
 	{
-		memcached_quit(memc);
-		memcached_free(memc);
-		memc = 0;
+		committer->finish();
+		reclaim();
+		delete committer;
+		committer = 0;
 	}
 
-	for (std::map<map_tile_id_t, map_data_t*>::iterator i = data.begin(); i != data.end(); ++i)
+	if (backend)
 	{
-		if (i->second)
-		{
-			delete [] i->second;
-			i->second = 0;
-		}
+		delete backend;
+		backend = 0;
 	}
-	for (std::map<map_tile_id_t, map_data_t*>::iterator i = addition.begin(); i != addition.end(); ++i)
+
+	for (map_tile_t *tile = head; tile; tile = tile->next)
 	{
-		if (i->second)
-		{
-			delete [] i->second;
-			i->second = 0;
-		}
+		delete [] tile->buffer;
+		delete [] tile->multiplication;
+		delete [] tile->addition;
 	}
-	for (std::map<map_tile_id_t, map_data_t*>::iterator i = multiplication.begin(); i != multiplication.end(); ++i)
-	{	
-		if (i->second)
-		{
-			delete [] i->second;
-			i->second = 0;
-		}
+
+	for (std::map<uint32_t, std::vector<map_data_t*> >::iterator i = free_buffers.begin(); i != free_buffers.end(); ++i)
+	{
+		for (std::vector<map_data_t*>::iterator j = i->second.begin(); j != i->second.end(); ++j)
+			delete [] *j;
 	}
+	free_buffers.clear();
+
+	if (records)
+	{
+		delete [] records;
+		records = 0;
+	}
+	head = tail = probation = free_records = 0;
+	size = probation_size = allocated = 0;
 }
 
 
 uint32_t Map::getTileLength() const
 {
-	static uint32_t tile_length = 0;
-	if (!tile_length) tile_length = info.tile_width * info.tile_height * info.tile_depth;
-	return tile_length;
+	// not cached in a static, there can be more than one map, on more than one thread
+	return info.tile_width * info.tile_height * info.tile_depth;
 }
 
 uint32_t Map::getTileSize() const
 {
-	static uint32_t tile_size = 0;
-	if (!tile_size) tile_size = sizeof(map_data_t) * getTileLength();
-	return tile_size;
+	return sizeof(map_data_t) * getTileLength();
+}
+
+uint32_t Map::getTileLength(uint32_t channel) const
+{
+	return getTileLength() * map_channel_width(channel);
+}
+
+uint32_t Map::getTileSize(uint32_t channel) const
+{
+	return getTileSize() * map_channel_width(channel);
 }
 
 map_data_t Map::get(uint32_t channel, double x, double y, double z)
 {
-	return get(channel, (int32_t)floor(x/info.scale), (int32_t)floor(y/info.scale), (int32_t)floor(z/info.scale));
+	const double scale = MAP_LEVEL_SCALE(channel);
+	return get(channel, (int32_t)floor(x/scale), (int32_t)floor(y/scale), (int32_t)floor(z/info.scale));
 }
 
 void Map::set(uint32_t channel, double x, double y, double z, map_data_t value)
 {
-	set(channel, (int32_t)floor(x/info.scale), (int32_t)floor(y/info.scale), (int32_t)floor(z/info.scale), value);
+	const double scale = MAP_LEVEL_SCALE(channel);
+	set(channel, (int32_t)floor(x/scale), (int32_t)floor(y/scale), (int32_t)floor(z/info.scale), value);
 }
 
 void Map::update(uint32_t channel, double x, double y, double z, map_data_t multiplication, map_data_t addition)
 {
-	update(channel, (int32_t)floor(x/info.scale), (int32_t)floor(y/info.scale), (int32_t)floor(z/info.scale), multiplication, addition);
+	const double scale = MAP_LEVEL_SCALE(channel);
+	update(channel, (int32_t)floor(x/scale), (int32_t)floor(y/scale), (int32_t)floor(z/info.scale), multiplication, addition);
 }
 
 map_data_t Map::get(uint32_t channel, int32_t x, int32_t y, int32_t z)
 {
-	return get(
-			(map_tile_id_t){channel,
-							(int32_t)floor((double)x / (double)info.tile_width),
-							(int32_t)floor((double)y / (double)info.tile_height),
-							(int32_t)floor((double)z / (double)info.tile_depth)},
-			(((z % info.tile_depth) + info.tile_depth) % info.tile_depth) * info.tile_height * info.tile_width +
-			(((y % info.tile_height) + info.tile_height) % info.tile_height) * info.tile_width +
-			(((x % info.tile_width) + info.tile_width)  % info.tile_width)
-	);
+	uint32_t index = 0;
+	const map_tile_id_t id = locate(channel, x, y, z, &index);
+	return get(id, index);
 }
 
 void Map::set(uint32_t channel, int32_t x, int32_t y, int32_t z, map_data_t value)
 {
-	return set(
-			(map_tile_id_t){channel,
-							(int32_t)floor((double)x / (double)info.tile_width),
-							(int32_t)floor((double)y / (double)info.tile_height),
-							(int32_t)floor((double)z / (double)info.tile_depth)},
-			(((z % info.tile_depth) + info.tile_depth) % info.tile_depth) * info.tile_height * info.tile_width +
-			(((y % info.tile_height) + info.tile_height) % info.tile_height) * info.tile_width +
-			(((x % info.tile_width) + info.tile_width)  % info.tile_width),
-			value
-	);
+	uint32_t index = 0;
+	const map_tile_id_t id = locate(channel, x, y, z, &index);
+	set(id, index, value);
 }
 
 void Map::update(uint32_t channel, int32_t x, int32_t y, int32_t z, map_data_t multiplication, map_data_t addition)
 {
-	return update(
-			(map_tile_id_t){channel,
-							(int32_t)floor((double)x / (double)info.tile_width),
-							(int32_t)floor((double)y / (double)info.tile_height),
-							(int32_t)floor((double)z / (double)info.tile_depth)},
-			(((z % info.tile_depth) + info.tile_depth) % info.tile_depth) * info.tile_height * info.tile_width +
-			(((y % info.tile_height) + info.tile_height) % info.tile_height) * info.tile_width +
-			(((x % info.tile_width) + info.tile_width)  % info.tile_width),
-			multiplication,
-			addition
-	);
+	uint32_t index = 0;
+	const map_tile_id_t id = locate(channel, x, y, z, &index);
+	update(id, index, multiplication, addition);
+}
+
+void Map::getGroup(uint32_t group, int32_t x, int32_t y, int32_t z, map_data_t *values)
+{
+	const uint32_t width = map_channel_width(group);
+	uint32_t index = 0;
+	const map_tile_id_t id = locate(group, x, y, z, &index);
+	map_tile_t *tile = access(id);
+
+	for (uint32_t i = 0; i < width; i++)
+		values[i] = tile->data ? tile->data[index + i] : ((map_data_t[])MAP_CHANNEL_DEFAULTS)[MAP_CHANNEL_BASE(group)];
+}
+
+void Map::setGroup(uint32_t group, int32_t x, int32_t y, int32_t z, const map_data_t *values)
+{
+	const uint32_t width = map_channel_width(group);
+	uint32_t index = 0;
+	const map_tile_id_t id = locate(group, x, y, z, &index);
+	map_tile_t *tile = modify(id, index, index + width);
+
+	for (uint32_t i = 0; i < width; i++)
+	{
+		tile->multiplication[index + i] = 0.0f;
+		tile->addition[index + i] = values[i];
+		tile->data[index + i] = values[i];
+	}
+}
+
+void Map::updateGroup(uint32_t group, int32_t x, int32_t y, int32_t z, const map_data_t *m, const map_data_t *a)
+{
+	uint32_t index = 0;
+	const map_tile_id_t id = locate(group, x, y, z, &index);
+	map_tile_t *tile = modify(id, index, index + map_channel_width(group));
+
+	map_tile_update(tile->data + index, tile->multiplication + index, tile->addition + index, m, a, map_channel_width(group));
 }
 
 
 map_data_t Map::get(const map_tile_id_t &id, uint32_t index)
 {
-	access(id);
-	if (!data[id])
-		return ((map_data_t[])MAP_CHANNEL_DEFAULTS)[id.channel];
-	return data[id][index];
+	map_tile_t *tile = access(id);
+	if (!tile->data)
+		return ((map_data_t[])MAP_CHANNEL_DEFAULTS)[MAP_CHANNEL_BASE(id.channel)];
+	return tile->data[index];
 }
 
 void Map::set(const map_tile_id_t &id, uint32_t index, map_data_t value)
@@ -199,575 +246,951 @@ void Map::set(const map_tile_id_t &id, uint32_t index, map_data_t value)
 
 void Map::update(const map_tile_id_t &id, uint32_t index, map_data_t m, map_data_t a)
 {
-	static const float inf = std::numeric_limits<float>::infinity();
-
-	assert(fabs(m) != inf);
-
-	access(id);	
-
-	if (!data[id])
-	{
-		data[id] = new map_data_t[getTileLength()];
-		for (int j = 0; j < (int)getTileLength(); j++)
-			data[id][j] = ((map_data_t[])MAP_CHANNEL_DEFAULTS)[id.channel];
-	}
-	
-	if (!multiplication[id])
-	{
-		multiplication[id] = new map_data_t[getTileLength()];
-		for (int j = 0; j < (int)getTileLength(); j++)
-			multiplication[id][j] = 1.0f;
-	}
-	
-	if (!addition[id])
-	{
-		addition[id] = new map_data_t[getTileLength()];
-		memset(addition[id], 0, getTileSize());
-	}
-
-	multiplication[id][index] *= m;
+	assert(fabs(m) != std::numeric_limits<float>::infinity());
 
-	if (m == 0.0f && fabs(addition[id][index]) == inf)
-		addition[id][index] = 0.0f;
-	else
-		addition[id][index] *= m;
-	addition[id][index] += a;
-	
-	if (m == 0.0f && fabs(data[id][index]) == inf)
-		data[id][index] = 0.0f;
-	else
-		data[id][index] *= m;
-	data[id][index] += a;
+	map_tile_t *tile = modify(id, index, index + 1);
+	map_cell_update(tile->data, tile->multiplication, tile->addition, index, m, a);
 }
 
 const map_data_t* Map::get(const map_tile_id_t& id, uint32_t *rev)
 {
-	access(id);
-	if (rev) *rev = revision[id];
-	return data[id];
+	map_tile_t *tile = access(id);
+	if (rev) *rev = tile->revision;
+	return tile->data;
 }
 
-void Map::set(const map_tile_id_t &id, const map_data_t* tile)
+void Map::set(const map_tile_id_t &id, const map_data_t* t)
 {
-	assert(tile);
+	assert(t);
 
-	access(id);
+	map_tile_t *tile = modify(id, 0, getTileLength(id.channel));
 
-	if (!data[id])
-		data[id] = new map_data_t[getTileLength()];
-	if (!multiplication[id])
-		multiplication[id] = new map_data_t[getTileLength()];
-	if (!addition[id])
-		addition[id] = new map_data_t[getTileLength()];
-	
-	memcpy(data[id], tile, getTileSize());
-	memset(multiplication[id], 0, getTileSize());
-	memcpy(data[id], tile, getTileSize());
+	// overwrite whatever is on the server when committing
+	memcpy(tile->data, t, getTileSize(id.channel));
+	memset(tile->multiplication, 0, getTileSize(id.channel));
+	memcpy(tile->addition, t, getTileSize(id.channel));
 }
 
 void Map::update(const map_tile_id_t &id, const map_data_t* m, const map_data_t* a)
 {
-	static const float inf = std::numeric_limits<float>::infinity();
+	update(id, m, a, 0, getTileLength(id.channel));
+}
 
+void Map::update(const map_tile_id_t &id, const map_data_t* m, const map_data_t* a, uint32_t begin, uint32_t end)
+{
 	assert(m && a);
+	assert(begin <= end && end <= getTileLength(id.channel));
 
-	access(id);
+	map_tile_t *tile = modify(id, begin, end);
+	map_tile_update(tile->data + begin, tile->multiplication + begin, tile->addition + begin, m + begin, a + begin, end - begin);
+}
 
-	if (!data[id])
-	{
-		data[id] = new map_data_t[getTileLength()];
-		for (int j = 0; j < (int)getTileLength(); j++)
-			data[id][j] = ((map_data_t[])MAP_CHANNEL_DEFAULTS)[id.channel];
-	}
-	
-	if (!multiplication[id])
-	{
-		multiplication[id] = new map_data_t[getTileLength()];
-		for (int j = 0; j < (int)getTileLength(); j++)
-			multiplication[id][j] = 1.0f;
-	}
-	
-	if (!addition[id])
-	{
-		addition[id] = new map_data_t[getTileLength()];
-		memset(addition[id], 0, getTileSize());
-	}
+void Map::getRegion(uint32_t channel, int32_t x, int32_t y, int32_t z, uint32_t width, uint32_t height, map_data_t *raster)
+{
+	const uint32_t stride = map_channel_width(channel);
+	const map_data_t value = ((map_data_t[])MAP_CHANNEL_DEFAULTS)[MAP_CHANNEL_BASE(channel)];
+	uint32_t index = 0, rows = 0, columns = 0;
+
+	assert(raster);
+	prefetchRegion(channel, x, y, z, width, height);
 
-	for (int j = 0; j < (int)getTileLength(); j++)
+	// one tile at a time, each of its rows in one go
+	for (uint32_t j = 0; j < height; j += rows)
 	{
-		assert(fabs(m[j]) != inf);
-	
-		multiplication[id][j] *= m[j];
-		
-		if (m[j] == 0.0f && fabs(addition[id][j]) == inf)
-			addition[id][j] = 0.0f;
-		else
-			addition[id][j] *= m[j];
-		addition[id][j] += a[j];
-		
-		if (m[j] == 0.0f && fabs(data[id][j]) == inf)
-			data[id][j] = 0.0f;
-		else
-			data[id][j] *= m[j];
-		data[id][j] += a[j];
+		for (uint32_t i = 0; i < width; i += columns)
+		{
+			const map_tile_id_t id = locate(channel, x + i, y + j, z, &index);
+			const map_tile_t *tile = access(id);
+			columns = std::min(width - i, info.tile_width - index / stride % info.tile_width);
+			rows = std::min(height - j, info.tile_height - index / stride / info.tile_width % info.tile_height);
+
+			for (uint32_t k = 0; k < rows; k++)
+			{
+				map_data_t *row = raster + ((size_t)(j + k) * width + i) * stride;
+				if (tile->data)
+					memcpy(row, tile->data + index + k * info.tile_width * stride, sizeof(map_data_t) * columns * stride);
+				else
+					std::fill(row, row + columns * stride, value);
+			}
+		}
 	}
 }
 
-std::set<map_tile_id_t> Map::list(bool refresh)
+void Map::setRegion(uint32_t channel, int32_t x, int32_t y, int32_t z, uint32_t width, uint32_t height, const map_data_t *raster)
 {
-	if (!refresh) return tiles;
-	tiles.clear();
-	list(tiles);
-	for(std::list<map_tile_id_t>::iterator i = lru.begin(); i != lru.end(); i++)
+	const uint32_t stride = map_channel_width(channel);
+	uint32_t index = 0, rows = 0, columns = 0;
+
+	assert(raster);
+	prefetchRegion(channel, x, y, z, width, height);
+
+	for (uint32_t j = 0; j < height; j += rows)
 	{
-		if (data[*i]) tiles.insert(*i);
+		for (uint32_t i = 0; i < width; i += columns)
+		{
+			const map_tile_id_t id = locate(channel, x + i, y + j, z, &index);
+			columns = std::min(width - i, info.tile_width - index / stride % info.tile_width);
+			rows = std::min(height - j, info.tile_height - index / stride / info.tile_width % info.tile_height);
+
+			// overwrite whatever is on the server, but only the part of the tile we cover
+			map_tile_t *tile = modify(id, index, index + ((rows - 1) * info.tile_width + columns) * stride);
+			for (uint32_t k = 0; k < rows; k++)
+			{
+				const map_data_t *row = raster + ((size_t)(j + k) * width + i) * stride;
+				const uint32_t offset = index + k * info.tile_width * stride;
+				memcpy(tile->data + offset, row, sizeof(map_data_t) * columns * stride);
+				memset(tile->multiplication + offset, 0, sizeof(map_data_t) * columns * stride);
+				memcpy(tile->addition + offset, row, sizeof(map_data_t) * columns * stride);
+			}
+		}
 	}
-	return tiles;
 }
 
-void Map::commit()
+void Map::updateRegion(uint32_t channel, int32_t x, int32_t y, int32_t z, uint32_t width, uint32_t height, const map_data_t *m, const map_data_t *a)
 {
-	static const float inf = std::numeric_limits<float>::infinity();
+	const uint32_t stride = map_channel_width(channel);
+	uint32_t index = 0, rows = 0, columns = 0;
 
-	for(std::list<map_tile_id_t>::iterator i = lru.begin(); i != lru.end(); ++i)
-	{
-		// save it if dirty
-		if (!((addition[*i] || multiplication[*i]) && data[*i])) continue;
+	assert(m && a);
+	prefetchRegion(channel, x, y, z, width, height);
 
-		// first lock tile up to make sure no one else is updating it
-		lock(*i);
-		
-		// load the newest tile if available
-		if (load(*i, &data[*i], &revision[*i]))
+	for (uint32_t j = 0; j < height; j += rows)
+	{
+		for (uint32_t i = 0; i < width; i += columns)
 		{
-			// if tile has new revision, apply update again
-			for (int j = 0; j < (int)getTileLength(); j++)
+			const map_tile_id_t id = locate(channel, x + i, y + j, z, &index);
+			columns = std::min(width - i, info.tile_width - index / stride % info.tile_width);
+			rows = std::min(height - j, info.tile_height - index / stride / info.tile_width % info.tile_height);
+
+			map_tile_t *tile = modify(id, index, index + ((rows - 1) * info.tile_width + columns) * stride);
+			for (uint32_t k = 0; k < rows; k++)
 			{
-				if (multiplication[*i])
-				{
-					if (multiplication[*i][j] == 0.0f && fabs(data[*i][j]) == inf)
-						data[*i][j] = 0.0f;
-					else
-						data[*i][j] *= multiplication[*i][j];
-				}
-				if (addition[*i])
-					data[*i][j] += addition[*i][j];
+				const size_t row = ((size_t)(j + k) * width + i) * stride;
+				const uint32_t offset = index + k * info.tile_width * stride;
+				map_tile_update(tile->data + offset, tile->multiplication + offset, tile->addition + offset, m + row, a + row, columns * stride);
 			}
 		}
+	}
+}
 
-		// save tile
-		save(*i, data[*i], &revision[*i]);
-		
-		// unlock tile to allow others to update
-		unlock(*i);
+uint32_t Map::trace(uint32_t channel, double x0, double y0, double x1, double y1, double z, bool write, map_ray_callback_t callback, void *context)
+{
+	const double scale = MAP_LEVEL_SCALE(channel);
+	const double inf = std::numeric_limits<double>::infinity();
+	const uint32_t stride = map_channel_width(channel);
+	const double fx = x0 / scale, fy = y0 / scale, dx = x1 / scale - fx, dy = y1 / scale - fy;
+	const int32_t sx = dx < 0.0 ? -1 : 1, sy = dy < 0.0 ? -1 : 1;
+	uint32_t index = 0;
+
+	assert(callback);
+
+	// cells left to cross in each direction, the ray ends in the cell of (x1, y1) no matter how it rounds
+	const int32_t cx = (int32_t)floor(fx), cy = (int32_t)floor(fy);
+	uint32_t rx = abs((int32_t)floor(x1 / scale) - cx), ry = abs((int32_t)floor(y1 / scale) - cy);
+	const uint32_t count = rx + ry + 1;
+
+	// how far along the ray the next cell border is, and how far apart the borders are
+	const double tdx = dx != 0.0 ? fabs(1.0 / dx) : inf, tdy = dy != 0.0 ? fabs(1.0 / dy) : inf;
+	double tx = dx != 0.0 ? (sx > 0 ? cx + 1 - fx : fx - cx) * tdx : inf;
+	double ty = dy != 0.0 ? (sy > 0 ? cy + 1 - fy : fy - cy) * tdy : inf;
+
+	// from here on the cell is tracked within its tile
+	map_ray_span_t span = { locate(channel, cx, cy, (int32_t)floor(z / info.scale), &index), 0, 0, 0, false, 0, 0, 0 };
+	const uint32_t layer = index / stride / (info.tile_width * info.tile_height);
+	int32_t lx = index / stride % info.tile_width, ly = index / stride / info.tile_width % info.tile_height;
+
+	ray.clear();
+	for (;;)
+	{
+		ray.push_back(stride * ((layer * info.tile_height + ly) * info.tile_width + lx));
+		if (!rx && !ry) break;
 
-		// clear dirty
-		if (multiplication[*i])
+		// cross into the next cell, and into the next tile if need be
+		if (ry == 0 || (rx > 0 && tx < ty))
 		{
-			delete [] multiplication[*i];
-			multiplication[*i] = 0;
+			tx += tdx;
+			rx--;
+			lx += sx;
+			if (lx >= 0 && lx < (int32_t)info.tile_width) continue;
+			traceSpan(&span, write, callback, context);
+			span.id.x += sx;
+			lx = sx > 0 ? 0 : info.tile_width - 1;
 		}
-		
-		if (addition[*i])
+		else
 		{
-			delete [] addition[*i];
-			addition[*i] = 0;
+			ty += tdy;
+			ry--;
+			ly += sy;
+			if (ly >= 0 && ly < (int32_t)info.tile_height) continue;
+			traceSpan(&span, write, callback, context);
+			span.id.y += sy;
+			ly = sy > 0 ? 0 : info.tile_height - 1;
 		}
-		multiplication.erase(*i);
-		addition.erase(*i);
-		stale[*i] = false;
 	}
+
+	span.last = true;
+	traceSpan(&span, write, callback, context);
+	return count;
 }
 
-void Map::refresh()
+void Map::traceSpan(map_ray_span_t *span, bool write, map_ray_callback_t callback, void *context)
 {
-	for(std::list<map_tile_id_t>::iterator i = lru.begin(); i != lru.end(); ++i)
+	map_tile_t *tile = 0;
+
+	// the tile is only looked up once for all of its cells, a writing ray needs the changes
+	// set up from the first to the last cell it touches
+	if (write)
+	{
+		const uint32_t begin = *std::min_element(ray.begin(), ray.end());
+		const uint32_t end = *std::max_element(ray.begin(), ray.end()) + map_channel_width(span->id.channel);
+		tile = modify(span->id, begin, end);
+	}
+	else
 	{
-		stale[*i] = true;
+		tile = access(span->id);
 	}
+
+	span->cells = &ray[0];
+	span->count = ray.size();
+	span->data = tile->data;
+	span->multiplication = tile->multiplication;
+	span->addition = tile->addition;
+	callback(context, *span);
+
+	span->first += span->count;
+	span->cells = 0;
+	span->count = 0;
+	ray.clear();
 }
 
-void Map::access(const map_tile_id_t &id)
+std::set<map_tile_id_t> Map::list(bool refresh)
 {
-	static const float inf = std::numeric_limits<float>::infinity();
+	if (!refresh) return tiles;
+	listNew();
 
-	std::list<map_tile_id_t>::iterator i = find(lru.begin(), lru.end(), id);
-	if (i == lru.end())
+	// tiles we have created ourselves count as well, even if they are not committed yet
+	std::set<map_tile_id_t> output = tiles;
+	for (map_tile_t *tile = head; tile; tile = tile->next)
 	{
-		// get rid of least recently used lru
-		while (lru.size() >= pages && lru.size() > 0)
-		{
-			map_tile_id_t least_used = lru.back();
+		if (tile->data) output.insert(tile->id);
+	}
+	return output;
+}
 
-			// save it
-			if ((addition[least_used] || multiplication[least_used]) && data[least_used])
-			{
-				// first lock tile up to make sure no one else is updating it
-				lock(least_used);
-				
-				// load the newest tile if available
-				if (load(least_used, &data[least_used], &revision[least_used]))
-				{
-					// if tile has new revision, apply update again
-					for (int j = 0; j < (int)getTileLength(); j++)
-					{
-						if (multiplication[least_used])
-						{
-							if (multiplication[least_used][j] == 0.0f && fabs(data[least_used][j]) == inf)
-								data[least_used][j] = 0.0f;
-							else
-								data[least_used][j] *= multiplication[least_used][j];
-						}
-						if (addition[least_used])
-							data[least_used][j] += addition[least_used][j];
-					}
-				}
+std::vector<map_tile_id_t> Map::listNew()
+{
+	std::vector<map_tile_id_t> added, output;
 
-				// save tile
-				save(least_used, data[least_used], &revision[least_used]);
-				
-				// unlock tile to allow others to update
-				unlock(least_used);
-			}
+	// only download the part of the list we have not seen yet
+	if (backend) backend->list(&list_cursor, added);
+	for (std::vector<map_tile_id_t>::const_iterator i = added.begin(); i != added.end(); ++i)
+	{
+		if (tiles.insert(*i).second) output.push_back(*i);
+	}
+	return output;
+}
 
-			// remove it
-			if (data[least_used])
-			{
-				delete [] data[least_used];
-				data[least_used] = 0;
-			}
-			if (multiplication[least_used])
+void Map::commit()
+{
+	// a coarser level changes only once the level below it is committed,
+	// so every round commits what is dirty and then moves one level up
+	for (;;)
+	{
+		for (map_tile_t *tile = head; tile; tile = tile->next)
+		{
+			// save it if dirty
+			if (!((tile->addition || tile->multiplication) && tile->data)) continue;
+
+			if (committer)
 			{
-				delete [] multiplication[least_used];
-				multiplication[least_used] = 0;
+				// hand the changes over to the committer and keep going
+				snapshot(tile);
 			}
-			
-			if (addition[least_used])
+			else
 			{
-				delete [] addition[least_used];
-				addition[least_used] = 0;
+				// keep the changes around for the next commit if this one failed
+				if (!commit(tile, backend)) continue;
 			}
-			data.erase(least_used);
-			multiplication.erase(least_used);
-			addition.erase(least_used);
-			stale.erase(least_used);
-			revision.erase(least_used);
-			lru.pop_back();
+			if (MAP_CHANNEL_LEVEL_OF(tile->id.channel) < levels) coarsen.insert(tile->id);
+
+			// clear dirty
+			releaseBuffer(tile->multiplication, getTileLength(tile->id.channel));
+			releaseBuffer(tile->addition, getTileLength(tile->id.channel));
+			tile->multiplication = tile->addition = 0;
+			tile->dirty_begin = tile->dirty_end = 0;
+			charge(tile, -2 * (int32_t)map_channel_width(tile->id.channel));
+			tile->stale = false;
 		}
 
-		load(id, &data[id], &revision[id]);
-		assert(!multiplication[id]);
-		assert(!addition[id]);
-
-		stale[id] = false;
-		lru.push_front(id);
+		if (coarsen.empty()) break;
+		downsample();
 	}
-	else
+}
+
+void Map::flush()
+{
+	if (committer) committer->flush();
+}
+
+void Map::setCommitter(uint32_t queue_length)
+{
+	if (committer)
 	{
-		if (stale[id])
-		{
-			if (load(id, &data[id], &revision[id]) && (multiplication[id] || addition[id]))
-			{
-				// if tile has new revision, apply update again
-				for (int i = 0; i < (int)getTileLength(); i++)
-				{
-					if (multiplication[id])
-					{
-						if (multiplication[id][i] == 0.0f && fabs(data[id][i]) == inf)
-							data[id][i] = 0.0f;
-						else
-							data[id][i] *= multiplication[id][i];
-					}
-					if (addition[id])
-						data[id][i] += addition[id][i];
-				}
-			}
-			stale[id] = false;
-		}
-		
-		// update LRU
-		if (i != lru.begin())
-		{
-			lru.erase(i);
-			lru.push_front(id);
-		}
+		committer->finish();
+		reclaim();
+		delete committer;
+		committer = 0;
 	}
+
+	if (!queue_length || !isOpen()) return;
+
+	committer = new MapCommitter(this, backend, queue_length);
+	committer->start();
 }
 
+void Map::setLevels(uint32_t levels)
+{
+	// a coarser cell is made of exactly 2x2 cells of the level below
+	if (levels && (info.tile_width % 2 || info.tile_height % 2))
+	{
+		fprintf(stderr, "map: setLevels: tiles of %ux%u cannot be halved\n", info.tile_width, info.tile_height);
+		levels = 0;
+	}
+	this->levels = levels < MAP_LEVELS ? levels : MAP_LEVELS - 1;
+}
 
-void Map::lock(const map_tile_id_t& id)
+void Map::setBudget(size_t bytes)
 {
-	memcached_return mr = MEMCACHED_SUCCESS;
-	memcachedmap_key_t tile_lock_key;
+	if (!backend) return;
+
+	// write back and drop everything, then start over with the new budget
+	commit();
+	flush();
+	while (tail)
+		evict(tail);
+	ghosts.clear();
+	ghost_order.clear();
+	reserve(bytes / getTileSize());
+}
 
-	if (!isOpen()) return;
+map_stats_t Map::stats() const
+{
+	MutexLock lock(&statistics_mutex);
+	map_stats_t output = statistics;
+	output.conflicts = conflicts;
+	output.retries = retries;
+	return output;
+}
 
-	memset(&tile_lock_key, 0, sizeof(memcachedmap_key_t));
-	tile_lock_key.ns = MEMCACHEDMAP_KEY_NAMESPACE;
-	tile_lock_key.type = MEMCACHEDMAP_KEY_TYPE_TILE_LOCK;
-	map_tile_id_to_hex(id, tile_lock_key.id);
+void Map::refresh()
+{
+	std::vector<map_tile_t*> cached;
 
-	for(;;)
+	for (map_tile_t *tile = head; tile; tile = tile->next)
 	{
-		// the lock has some bogus data in it, because we don't really care
-		mr = memcached_add(memc, (const char*)&tile_lock_key, MEMCACHEDMAP_KEY_WITH_ID_SIZE, "L", 1, (time_t)0, 0);
-		// if we see a collision, it means someone has a lock on the tile already, so we wait
-		if (mr != MEMCACHED_NOTSTORED) break;
-		usleep(100); // make sure we don't use up 100% CPU when the network is fast
+		tile->stale = true;
+		cached.push_back(tile);
 	}
 
-	if (mr != MEMCACHED_SUCCESS)
-		goto error;
-	return;
+	// check all revisions in one go and pull whatever has changed,
+	// tiles that could not be checked stay stale and get loaded on access
+	fetch(cached);
+}
+
+void Map::prefetch(const std::vector<map_tile_id_t> &ids)
+{
+	std::vector<map_tile_t*> pending;
+	std::vector<map_tile_id_t> inserted;
+	std::set<map_tile_id_t> seen;
+	uint32_t taken = 0;
+
+	// bring tiles into the cache without loading them one by one, new tiles go into
+	// the second queue, so never more than what it holds at once
+	for (std::vector<map_tile_id_t>::const_iterator i = ids.begin(); i != ids.end(); ++i)
+	{
+		if (seen.count(*i)) continue;
+		if (taken + map_channel_width(i->channel) > pages / MAP_PROBATION_SHARE) break;
+		seen.insert(*i);
+		taken += map_channel_width(i->channel);
+
+		map_tile_t *tile = find(*i);
+		if (tile)
+			touch(tile);
+		else
+			insert(*i)->stale = true;
+		inserted.push_back(*i);
+	}
 
-error:
-	if (mr != MEMCACHED_SUCCESS)
+	// making room for one tile may have pushed out another one of them
+	for (std::vector<map_tile_id_t>::const_iterator i = inserted.begin(); i != inserted.end(); ++i)
 	{
-		fprintf(stderr, "memcachedmap: lock: error: %s\n", memcached_strerror(memc, mr));
+		map_tile_t *tile = find(*i);
+		if (tile && tile->stale) pending.push_back(tile);
 	}
+
+	// now load all of them in one go, tiles that failed stay stale and get loaded on access
+	fetch(pending);
 }
 
-void Map::unlock(const map_tile_id_t& id)
+map_tile_id_t Map::locate(uint32_t channel, int32_t x, int32_t y, int32_t z, uint32_t *index) const
 {
-	memcached_return mr = MEMCACHED_SUCCESS;
-	memcachedmap_key_t tile_lock_key;
+	// shifts round towards negative infinity just like floor, and masks wrap negative coordinates
+	if (tile_pow2)
+	{
+		*index = map_channel_width(channel) * (
+			(((uint32_t)z & (info.tile_depth - 1)) << (tile_shift_y + tile_shift_x)) |
+			(((uint32_t)y & (info.tile_height - 1)) << tile_shift_x) |
+			((uint32_t)x & (info.tile_width - 1)));
+		return (map_tile_id_t){channel, x >> tile_shift_x, y >> tile_shift_y, z >> tile_shift_z};
+	}
 
-	if (!isOpen()) return;
+	// values of a group are stored next to each other, so the cell index is scaled by the group width,
+	// the modulo has to be signed or negative coordinates wrap around 2^32 instead of the tile
+	const int32_t width = info.tile_width, height = info.tile_height, depth = info.tile_depth;
+	*index = map_channel_width(channel) * (
+		(((z % depth) + depth) % depth) * height * width +
+		(((y % height) + height) % height) * width +
+		(((x % width) + width) % width));
+	return (map_tile_id_t){channel,
+		(int32_t)floor((double)x / (double)info.tile_width),
+		(int32_t)floor((double)y / (double)info.tile_height),
+		(int32_t)floor((double)z / (double)info.tile_depth)};
+}
 
-	memset(&tile_lock_key, 0, sizeof(memcachedmap_key_t));
-	tile_lock_key.ns = MEMCACHEDMAP_KEY_NAMESPACE;
-	tile_lock_key.type = MEMCACHEDMAP_KEY_TYPE_TILE_LOCK;
-	map_tile_id_to_hex(id, tile_lock_key.id);
+void Map::prefetchRegion(uint32_t channel, int32_t x, int32_t y, int32_t z, uint32_t width, uint32_t height)
+{
+	std::vector<map_tile_id_t> ids;
+	uint32_t index = 0;
+
+	if (!width || !height) return;
+
+	// the corners tell which tiles the region covers
+	const map_tile_id_t first = locate(channel, x, y, z, &index);
+	const map_tile_id_t last = locate(channel, x + width - 1, y + height - 1, z, &index);
+	for (int32_t j = first.y; j <= last.y; j++)
+		for (int32_t i = first.x; i <= last.x; i++)
+			ids.push_back((map_tile_id_t){ channel, i, j, first.z });
+	prefetch(ids);
+}
 
-	mr = memcached_delete(memc, (const char*)&tile_lock_key, MEMCACHEDMAP_KEY_WITH_ID_SIZE, (time_t)0);
-	if (mr != MEMCACHED_SUCCESS)
-		goto error;
-	return;
+map_tile_t* Map::access(const map_tile_id_t &id)
+{
+	map_tile_t *tile = find(id);
+	if (!tile)
+	{
+		statistics.misses++;
+		tile = insert(id);
+		load(tile);
+		return tile;
+	}
+	statistics.hits++;
 
-error:
-	if (mr != MEMCACHED_SUCCESS)
+	if (tile->stale)
 	{
-		fprintf(stderr, "memcachedmap: unlock: error: %s\n", memcached_strerror(memc, mr));
+		// if tile has new revision, apply update again
+		statistics.stale_reloads++;
+		if (load(tile) && (tile->multiplication || tile->addition))
+			merge(tile);
+		tile->stale = false;
 	}
+
+	touch(tile);
+	return tile;
 }
 
-bool Map::load(const map_tile_id_t& id, map_data_t **data, uint32_t *revision)
+bool Map::load(map_tile_t *tile)
 {
-	memcached_return mr = MEMCACHED_SUCCESS;
+	struct timeval start;
 
-	uint32_t tile_revision = 0;
-	memcachedmap_key_t tile_revision_key;
-	size_t tile_revision_size = 0;
-	uint32_t tile_revision_flags = 0;
-	char *tile_revision_data = 0;
+	if (!backend) return false;
 
-	memcachedmap_key_t tile_data_key;
-	size_t tile_data_size = 0;
-	uint32_t tile_data_flags = 0;
-	char *tile_data_data = 0;
+	const uint64_t bytes = backend->getBytesLoaded(), spins = backend->getSpins();
+	Timer::getNow(start);
+	const bool loaded = backend->load(tile->id, tile->buffer, &tile->revision);
+	if (loaded) tile->data = tile->buffer;
+
+	MutexLock lock(&statistics_mutex);
+	map_histogram_add(&statistics.load_time, Timer::getSince(start));
+	statistics.bytes_loaded += backend->getBytesLoaded() - bytes;
+	statistics.spins += backend->getSpins() - spins;
+	return loaded;
+}
+
+map_tile_t* Map::insert(const map_tile_id_t &id)
+{
+	// get rid of tiles we can do without, a group tile takes one page per value in a cell
+	const uint32_t width = map_channel_width(id.channel);
+	shrink(width, 0);
+
+	// make sure we don't read the tile back while our own changes are still on the way
+	if (committer)
+	{
+		struct timeval start;
+		Timer::getNow(start);
+		committer->wait(id);
+		map_histogram_add(&statistics.wait_time, Timer::getSince(start));
+	}
 
-	if (!isOpen()) return false;
+	map_tile_t *tile = acquire();
+	tile->id = id;
+	tile->buffer = acquireBuffer(getTileLength(id.channel));
 
-	//
-	// first find out revision
-	//
+	// index the new tile
+	map_tile_t **bucket = &buckets[map_tile_id_hash(id) & (buckets.size() - 1)];
+	tile->chain = *bucket;
+	*bucket = tile;
 
-	memset(&tile_revision_key, 0, sizeof(memcachedmap_key_t));
-	tile_revision_key.ns = MEMCACHEDMAP_KEY_NAMESPACE;
-	tile_revision_key.type = MEMCACHEDMAP_KEY_TYPE_TILE_REVISION;
-	map_tile_id_to_hex(id, tile_revision_key.id);
-	tile_revision_data = memcached_get(memc, (const char*)&tile_revision_key, MEMCACHEDMAP_KEY_WITH_ID_SIZE, &tile_revision_size, &tile_revision_flags, &mr);
+	// a tile that was pushed out of the second queue not long ago is used again, so it is hot
+	tile->hot = ghosts.erase(id) > 0;
+	link(tile);
+	charge(tile, width);
+	return tile;
+}
 
-	// does tile exist on server?
-	if (!tile_revision_data) return false;
+void Map::touch(map_tile_t *tile)
+{
+	assert(tile);
 
-	if (tile_revision_size != sizeof(uint32_t))
-		goto error;
-	tile_revision = *((uint32_t*)tile_revision_data);
-	free(tile_revision_data);
-	tile_revision_data = 0;
+	// a tile is used in one go as long as no other tile has come in since, like a sweep
+	// that reads a tile cell by cell, after that it is hot and joins the first queue
+	if (tile == head || tile == probation) return;
+	if (!tile->hot)
+	{
+		const int32_t pages = map_channel_width(tile->id.channel) * (tile->multiplication ? 3 : 1);
+		charge(tile, -pages);
+		tile->hot = true;
+		charge(tile, pages);
+	}
+	unlink(tile);
+	link(tile);
+}
 
-	// if no new revision is available, we don't need to fetch the tile again
-	if (tile_revision <= *revision) return false;
+void Map::link(map_tile_t *tile)
+{
+	assert(tile);
 
-	//
-	// new revision, we do need to fetch tile
-	//
-	memset(&tile_data_key, 0, sizeof(memcachedmap_key_t));
-	tile_data_key.ns = MEMCACHEDMAP_KEY_NAMESPACE;
-	tile_data_key.type = MEMCACHEDMAP_KEY_TYPE_TILE_DATA;
-	memcpy(tile_data_key.id, tile_revision_key.id, MEMCACHEDMAP_KEY_ID_SIZE);
-	tile_data_data = memcached_get(memc, (const char*)&tile_data_key, MEMCACHEDMAP_KEY_WITH_ID_SIZE, &tile_data_size, &tile_data_flags, &mr);
-	// if revision key exists but not the tile data, something is terribly wrong
-	if (!tile_data_data)
-		goto error;
-	if (tile_data_size != getTileSize())
-		goto error;
+	// hot tiles go in front of all others, new tiles in front of the second queue
+	map_tile_t *next = tile->hot ? head : probation;
+	map_tile_t *prev = next ? next->prev : tail;
 
-	// trust you have the correct size if data is already allocated
-	if (!(*data))
-		*data = new map_data_t[getTileLength()];
-	memcpy(*data, tile_data_data, getTileSize());
+	tile->prev = prev;
+	tile->next = next;
+	if (prev) prev->next = tile; else head = tile;
+	if (next) next->prev = tile; else tail = tile;
+	if (!tile->hot) probation = tile;
+}
 
-	free(tile_data_data);
-	tile_data_data = 0;
+void Map::unlink(map_tile_t *tile)
+{
+	assert(tile);
 
-	*revision = tile_revision;
+	if (tile == probation)
+		probation = tile->next;
+	if (tile->prev)
+		tile->prev->next = tile->next;
+	else
+		head = tile->next;
+	if (tile->next)
+		tile->next->prev = tile->prev;
+	else
+		tail = tile->prev;
+	tile->prev = tile->next = 0;
+}
 
-	return true; // new tile loaded, hence return true
+void Map::charge(map_tile_t *tile, int32_t pages)
+{
+	size += pages;
+	if (!tile->hot) probation_size += pages;
+}
 
-error:
-	if (mr != MEMCACHED_SUCCESS)
+void Map::shrink(uint32_t pages, const map_tile_t *keep)
+{
+	map_tile_t *tile = 0;
+	while (size + committing + pages > this->pages)
 	{
-		fprintf(stderr, "memcachedmap: load: error: %s\n", memcached_strerror(memc, mr));
+		// buffers of committed snapshots go first
+		if (committing) reclaim();
+		if (size + committing + pages <= this->pages || !(tile = victim(keep))) break;
+		evict(tile);
 	}
+}
+
+map_tile_t* Map::victim(const map_tile_t *keep) const
+{
+	// least recently used hot tile and oldest tile of the second queue, other than the one to keep
+	map_tile_t *hot = probation ? probation->prev : tail;
+	map_tile_t *cold = probation ? tail : 0;
+	if (hot && hot == keep) hot = hot->prev;
+	if (cold && cold == keep) cold = cold != probation ? cold->prev : 0;
+
+	// the second queue gives up its tiles first once it takes more than its share
+	if (cold && (probation_size > this->pages / MAP_PROBATION_SHARE || !hot)) return cold;
+	return hot ? hot : cold;
+}
+
+map_tile_t* Map::find(const map_tile_id_t &id) const
+{
+	map_tile_t *tile = buckets[map_tile_id_hash(id) & (buckets.size() - 1)];
+	while (tile && !(tile->id == id))
+		tile = tile->chain;
+	return tile;
+}
+
+void Map::evict(map_tile_t *tile)
+{
+	assert(tile);
+	const uint32_t width = map_channel_width(tile->id.channel) * (tile->multiplication ? 3 : 1);
 
-	if (tile_revision_data)
+	// save it if dirty
+	statistics.evictions++;
+	if ((tile->addition || tile->multiplication) && tile->data)
 	{
-		free(tile_revision_data);
-		tile_revision_data = 0;
+		statistics.dirty_evictions++;
+		if (committer)
+		{
+			snapshot(tile);
+			if (MAP_CHANNEL_LEVEL_OF(tile->id.channel) < levels) coarsen.insert(tile->id);
+		}
+		else if (commit(tile, backend))
+		{
+			if (MAP_CHANNEL_LEVEL_OF(tile->id.channel) < levels) coarsen.insert(tile->id);
+		}
 	}
 
-	if (tile_data_data)
+	// remove it from hash index
+	map_tile_t **bucket = &buckets[map_tile_id_hash(tile->id) & (buckets.size() - 1)];
+	while (*bucket != tile)
+		bucket = &(*bucket)->chain;
+	*bucket = tile->chain;
+
+	// remember tiles that drop out of the second queue for a while, in case they are used again
+	if (!tile->hot)
 	{
-		free(tile_data_data);
-		tile_data_data = 0;
+		ghosts.insert(tile->id);
+		ghost_order.push_back(tile->id);
+		while (ghost_order.size() > pages / MAP_GHOST_SHARE)
+		{
+			ghosts.erase(ghost_order.front());
+			ghost_order.pop_front();
+		}
 	}
-	return false;
+
+	// give back its pages
+	charge(tile, -(int32_t)width);
+	unlink(tile);
+	release(tile);
 }
 
-void Map::save(const map_tile_id_t& id, const map_data_t *data, uint32_t *revision)
+bool Map::commit(map_tile_t *tile, MapBackend *connection)
 {
-	memcached_return mr = MEMCACHED_SUCCESS;
+	uint64_t cas = 0;
+	uint32_t conflicted = 0, retried = 0;
+	int rc = 0;
+	struct timeval start;
 
-	uint32_t tile_revision = 0;
-	memcachedmap_key_t tile_revision_key;
-	size_t tile_revision_size = 0;
-	uint32_t tile_revision_flags = 0;
-	char *tile_revision_data = 0;
+	assert(tile && tile->data);
 
-	memcachedmap_key_t tile_data_key;
+	const uint64_t loaded = connection->getBytesLoaded(), saved = connection->getBytesSaved(), spins = connection->getSpins();
+	Timer::getNow(start);
 
-	memcachedmap_key_t list_key;
-	
-	if (!isOpen()) return;
+	// backends that apply changes where the tile is stored take them in one go,
+	// nothing to check out and nothing to conflict with
+	rc = connection->apply(tile->id, tile->multiplication, tile->addition, tile->dirty_begin, tile->dirty_end, tile->data, &tile->revision);
 
-	//
-	// first find out revision
-	//
-	memset(&tile_revision_key, 0, sizeof(memcachedmap_key_t));
-	tile_revision_key.ns = MEMCACHEDMAP_KEY_NAMESPACE;
-	tile_revision_key.type = MEMCACHEDMAP_KEY_TYPE_TILE_REVISION;
-	map_tile_id_to_hex(id, tile_revision_key.id);
-	tile_revision_data = memcached_get(memc, (const char*)&tile_revision_key, MEMCACHEDMAP_KEY_WITH_ID_SIZE, &tile_revision_size, &tile_revision_flags, &mr);
+	for (uint32_t attempt = 0; rc > 0 && attempt < MAP_COMMIT_ATTEMPTS; attempt++)
+	{
+		// get the newest tile along with its cas token, if someone else has committed
+		// in the mean time, apply our update again on top of theirs
+		if (connection->checkout(tile->id, tile->buffer, &tile->revision, &cas))
+		{
+			merge(tile);
+			if (attempt > 0) retried++;
+		}
+
+		// try to swap in the new tile, this only fails if someone else was faster
+		rc = connection->patch(tile->id, tile->data, tile->dirty_begin, tile->dirty_end, &tile->revision, cas);
+		if (rc <= 0) break;
+		if (attempt == 0) conflicted++;
+	}
 
-	// does tile exist on server?
-	if (tile_revision_data)
+	// this may run on the committer thread
 	{
-		if (tile_revision_size != sizeof(uint32_t))
-			goto error;
-		tile_revision = *((uint32_t*)tile_revision_data);
-		free(tile_revision_data);
-		tile_revision_data = 0;
+		MutexLock lock(&statistics_mutex);
+		map_histogram_add(&statistics.commit_time, Timer::getSince(start));
+		statistics.bytes_loaded += connection->getBytesLoaded() - loaded;
+		statistics.bytes_saved += connection->getBytesSaved() - saved;
+		statistics.spins += connection->getSpins() - spins;
+		if (!rc) statistics.commits++;
+		conflicts += conflicted;
+		retries += retried;
 	}
-	else if (mr != MEMCACHED_NOTFOUND)
-		goto error;
-	
-	// the revision on the server should be the same as the one we have
-	assert(*revision == tile_revision);
 
-	//
-	// new revision, we do need to upload tile
-	//
-	memset(&tile_data_key, 0, sizeof(memcachedmap_key_t));
-	tile_data_key.ns = MEMCACHEDMAP_KEY_NAMESPACE;
-	tile_data_key.type = MEMCACHEDMAP_KEY_TYPE_TILE_DATA;
-	memcpy(tile_data_key.id, tile_revision_key.id, MEMCACHEDMAP_KEY_ID_SIZE);
-	mr = memcached_set(memc, (const char*)&tile_data_key, MEMCACHEDMAP_KEY_WITH_ID_SIZE, (const char*)data, getTileSize(), (time_t)0, 0);
-	if (mr != MEMCACHED_SUCCESS)
-		goto error;
+	if (rc)
+	{
+		fprintf(stderr, "map: commit: failed to commit tile (%i, %i, %i, %i)\n", tile->id.channel, tile->id.x, tile->id.y, tile->id.z);
+		return false;
+	}
+	return true;
+}
+
+void Map::snapshot(map_tile_t *tile)
+{
+	assert(committer && tile && tile->data);
+
+	// this blocks if the committer is falling behind
+	struct timeval start;
+	Timer::getNow(start);
+	map_tile_t *job = committer->reserve();
+	map_histogram_add(&statistics.wait_time, Timer::getSince(start));
+	reclaim(job);
+
+	job->id = tile->id;
+	job->revision = tile->revision;
+	job->dirty_begin = tile->dirty_begin;
+	job->dirty_end = tile->dirty_end;
+	job->buffer = job->data = acquireBuffer(getTileLength(tile->id.channel));
+	memcpy(job->data, tile->data, getTileSize(tile->id.channel));
+
+	// the changes go along with the job rather than being copied, the tile starts over without any,
+	// its pages now count as the committer's until the job is done
+	job->multiplication = tile->multiplication;
+	job->addition = tile->addition;
+	tile->multiplication = tile->addition = 0;
+	committing += map_channel_width(job->id.channel) * (1 + (job->multiplication ? 1 : 0) + (job->addition ? 1 : 0));
+
+	committer->submit(job);
+}
+
+void Map::reclaim()
+{
+	std::vector<map_tile_t*> done;
+	if (committer) committer->collect(done);
+	for (std::vector<map_tile_t*>::iterator i = done.begin(); i != done.end(); ++i)
+		reclaim(*i);
+}
+
+void Map::reclaim(map_tile_t *job)
+{
+	assert(job);
+	if (!job->buffer) return;
+
+	const uint32_t length = getTileLength(job->id.channel);
+	committing -= map_channel_width(job->id.channel) * (1 + (job->multiplication ? 1 : 0) + (job->addition ? 1 : 0));
+	releaseBuffer(job->multiplication, length);
+	releaseBuffer(job->addition, length);
+	releaseBuffer(job->buffer, length);
+	job->multiplication = job->addition = job->buffer = job->data = 0;
+}
+
+void Map::merge(map_tile_t *tile)
+{
+	assert(tile && tile->data);
+
+	// only the dirty span has anything to apply
+	const uint32_t begin = tile->dirty_begin;
+	if (begin >= tile->dirty_end) return;
+	map_tile_merge(tile->data + begin,
+		tile->multiplication ? tile->multiplication + begin : 0,
+		tile->addition ? tile->addition + begin : 0,
+		tile->dirty_end - begin);
+}
 
-	//
-	// now we need to update revision number
-	//
-	tile_revision ++;
-	mr = memcached_set(memc, (const char*)&tile_revision_key, MEMCACHEDMAP_KEY_WITH_ID_SIZE, (const char*)&tile_revision, sizeof(uint32_t), (time_t)0, 0);
-	if (mr != MEMCACHED_SUCCESS)
-		goto error;
-	*revision = tile_revision;
+map_tile_t* Map::modify(const map_tile_id_t &id, uint32_t begin, uint32_t end)
+{
+	map_tile_t *tile = access(id);
 
-	//
-	// now we need to add this tile into the list of tiles if it does not exists in there yet
-	//
-	if (tile_revision != 1) return;
-	memset(&list_key, 0, sizeof(memcachedmap_key_t));
-	list_key.ns = MEMCACHEDMAP_KEY_NAMESPACE;
-	list_key.type = MEMCACHEDMAP_KEY_TYPE_LIST;
-	mr = memcached_append(memc, (const char*)&list_key, MEMCACHEDMAP_KEY_SIZE, (const char*)&id, sizeof(map_tile_id_t), (time_t)0, 0);
-	if (mr != MEMCACHED_SUCCESS)
-		goto error;
+	if (!tile->data)
+	{
+		tile->data = tile->buffer;
+		for (int j = 0; j < (int)getTileLength(id.channel); j++)
+			tile->data[j] = ((map_data_t[])MAP_CHANNEL_DEFAULTS)[MAP_CHANNEL_BASE(id.channel)];
+	}
 
-	return;
+	// changes are only set up as far as they are needed, and the dirty span grows with them,
+	// their pages come out of the budget like any other
+	if (!tile->multiplication)
+	{
+		assert(!tile->addition);
+		shrink(2 * map_channel_width(id.channel), tile);
+		tile->multiplication = acquireBuffer(getTileLength(id.channel));
+		tile->addition = acquireBuffer(getTileLength(id.channel));
+		tile->dirty_begin = tile->dirty_end = begin;
+		charge(tile, 2 * map_channel_width(id.channel));
+	}
 
-error:
-	if (mr != MEMCACHED_SUCCESS)
+	if (begin < tile->dirty_begin)
 	{
-		fprintf(stderr, "memcachedmap: save: error: %s\n", memcached_strerror(memc, mr));
+		for (uint32_t j = begin; j < tile->dirty_begin; j++)
+			tile->multiplication[j] = 1.0f;
+		memset(tile->addition + begin, 0, sizeof(map_data_t) * (tile->dirty_begin - begin));
+		tile->dirty_begin = begin;
 	}
 
-	if (tile_revision_data)
+	if (end > tile->dirty_end)
 	{
-		free(tile_revision_data);
-		tile_revision_data = 0;
+		for (uint32_t j = tile->dirty_end; j < end; j++)
+			tile->multiplication[j] = 1.0f;
+		memset(tile->addition + tile->dirty_end, 0, sizeof(map_data_t) * (end - tile->dirty_end));
+		tile->dirty_end = end;
 	}
+	return tile;
 }
 
-void Map::list(std::set<map_tile_id_t> &output)
+void Map::downsample()
 {
-	memcached_return mr = MEMCACHED_SUCCESS;
+	std::set<map_tile_id_t> pending;
 
-	memcachedmap_key_t list_key;
-	size_t list_size = 0;
-	uint32_t list_flags = 0;
-	char *list_data = 0;
-	map_tile_id_t *list_ptr = 0;
-	unsigned int i = 0;
-
-	if (!isOpen()) return;
-	memset(&list_key, 0, sizeof(memcachedmap_key_t));
-	list_key.ns = MEMCACHEDMAP_KEY_NAMESPACE;
-	list_key.type = MEMCACHEDMAP_KEY_TYPE_LIST;
-	list_data = memcached_get(memc, (const char*)&list_key, MEMCACHEDMAP_KEY_SIZE, &list_size, &list_flags, &mr);
+	// tiles that get evicted on the way are queued again for the next round
+	pending.swap(coarsen);
+	for (std::set<map_tile_id_t>::const_iterator i = pending.begin(); i != pending.end(); ++i)
+		downsample(*i);
+}
 
-	// it might be the case that no tile exists yet
-	if (list_data)
+void Map::downsample(const map_tile_id_t &id)
+{
+	const uint32_t channel = MAP_CHANNEL_BASE(id.channel);
+	const uint32_t level = MAP_CHANNEL_LEVEL_OF(id.channel);
+	const uint8_t reduction = ((uint8_t[])MAP_CHANNEL_REDUCTIONS)[channel];
+	const uint32_t stride = map_channel_width(channel); // values per cell
+	const uint32_t row = info.tile_width * stride; // values per row
+	const uint32_t width = info.tile_width / 2, height = info.tile_height / 2; // quadrant, in cells
+	const map_tile_id_t parent = { MAP_CHANNEL_LEVEL(channel, level + 1), (int32_t)floor(id.x / 2.0), (int32_t)floor(id.y / 2.0), id.z };
+	const uint32_t offset_x = (id.x - 2 * parent.x) * width, offset_y = (id.y - 2 * parent.y) * height;
+	std::vector<map_data_t> cells((size_t)width * height * info.tile_depth * stride);
+
+	// reduce every 2x2 block first, getting the parent may push this tile out of the cache
+	map_tile_t *tile = access(id);
+	if (!tile->data) return;
+	for (uint32_t z = 0, j = 0; z < info.tile_depth; z++)
 	{
-		if (list_size % sizeof(map_tile_id_t) != 0)
-			goto error;
+		for (uint32_t y = 0; y < height; y++)
+		{
+			for (uint32_t x = 0; x < width; x++)
+			{
+				const map_data_t *cell = tile->data + ((size_t)z * info.tile_height + 2 * y) * row + 2 * x * stride;
+				for (uint32_t k = 0; k < stride; k++, j++, cell++)
+				{
+					if (reduction == MAP_REDUCTION_MAX)
+						cells[j] = std::max(std::max(cell[0], cell[stride]), std::max(cell[row], cell[row + stride]));
+					else
+						cells[j] = 0.25f * (cell[0] + cell[stride] + cell[row] + cell[row + stride]);
+				}
+			}
+		}
+	}
 
-		list_ptr = (map_tile_id_t*)list_data;
-		for (i = 0; i < list_size / sizeof(map_tile_id_t); i++, list_ptr++)
-			output.insert(*list_ptr);
-		free(list_data);
-		list_data = 0;
+	// overwrite our quadrant of the parent only, others may be committing the rest of it
+	tile = modify(parent,
+		((offset_y * info.tile_width) + offset_x) * stride,
+		((((info.tile_depth - 1) * info.tile_height + offset_y + height - 1) * info.tile_width) + offset_x + width) * stride);
+	for (uint32_t z = 0, j = 0; z < info.tile_depth; z++)
+	{
+		for (uint32_t y = 0; y < height; y++)
+		{
+			const uint32_t index = ((z * info.tile_height + offset_y + y) * info.tile_width + offset_x) * stride;
+			for (uint32_t x = 0; x < width * stride; x++, j++)
+			{
+				tile->multiplication[index + x] = 0.0f;
+				tile->addition[index + x] = cells[j];
+				tile->data[index + x] = cells[j];
+			}
+		}
 	}
-	else if (mr != MEMCACHED_NOTFOUND)
+}
+
+map_tile_t* Map::acquire()
+{
+	map_tile_t *tile = free_records;
+
+	// there are exactly as many records as there are pages
+	assert(tile);
+	free_records = tile->chain;
+
+	memset(tile, 0, sizeof(map_tile_t));
+	return tile;
+}
+
+void Map::release(map_tile_t *tile)
+{
+	assert(tile);
+
+	releaseBuffer(tile->multiplication, getTileLength(tile->id.channel));
+	releaseBuffer(tile->addition, getTileLength(tile->id.channel));
+	releaseBuffer(tile->buffer, getTileLength(tile->id.channel));
+	tile->multiplication = tile->addition = tile->buffer = tile->data = 0;
+	tile->dirty_begin = tile->dirty_end = 0;
+
+	tile->prev = tile->next = 0;
+	tile->chain = free_records;
+	free_records = tile;
+}
+
+map_data_t* Map::acquireBuffer(uint32_t length)
+{
+	const uint32_t width = length / getTileLength();
+	std::vector<map_data_t*> &available = free_buffers[length];
+
+	if (!available.empty())
 	{
-		goto error;
+		map_data_t *buffer = available.back();
+		available.pop_back();
+		return buffer;
 	}
-	return;
 
-error:
-	if (mr != MEMCACHED_SUCCESS)
+	// buffers of another length that are not in use make room for a new one
+	for (std::map<uint32_t, std::vector<map_data_t*> >::iterator i = free_buffers.begin(); i != free_buffers.end() && allocated + width > pages; ++i)
 	{
-		fprintf(stderr, "memcachedmap: list: error: %s\n", memcached_strerror(memc, mr));
+		while (allocated + width > pages && !i->second.empty())
+		{
+			delete [] i->second.back();
+			i->second.pop_back();
+			allocated -= i->first / getTileLength();
+		}
 	}
 
-	if (list_data)
+	allocated += width;
+	return new map_data_t[length];
+}
+
+void Map::releaseBuffer(map_data_t *buffer, uint32_t length)
+{
+	if (!buffer) return;
+
+	// keep it for later unless the budget is used up
+	if (allocated > pages)
 	{
-		free(list_data);
-		list_data = 0;
+		delete [] buffer;
+		allocated -= length / getTileLength();
+		return;
 	}
+	free_buffers[length].push_back(buffer);
 }
 
+void Map::fetch(const std::vector<map_tile_t*> &pending)
+{
+	std::vector<uint32_t> revisions;
+	struct timeval start;
+
+	if (!backend || pending.empty()) return;
+
+	for (std::vector<map_tile_t*>::const_iterator i = pending.begin(); i != pending.end(); ++i)
+		revisions.push_back((*i)->revision);
 
+	const uint64_t bytes = backend->getBytesLoaded(), spins = backend->getSpins();
+	Timer::getNow(start);
+	backend->fetch(pending);
+	{
+		MutexLock lock(&statistics_mutex);
+		map_histogram_add(&statistics.load_time, Timer::getSince(start));
+		statistics.bytes_loaded += backend->getBytesLoaded() - bytes;
+		statistics.spins += backend->getSpins() - spins;
+		statistics.fetched += pending.size();
+	}
+
+	// tiles that came in with a new revision need our changes applied again
+	for (unsigned int i = 0; i < pending.size(); i++)
+	{
+		if (pending[i]->revision != revisions[i] && (pending[i]->multiplication || pending[i]->addition))
+			merge(pending[i]);
+	}
+}
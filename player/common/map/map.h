@@ -1,31 +1,37 @@
 #ifndef AMOS_COMMON_MAP_H
 #define AMOS_COMMON_MAP_H
 
-#include <list>
-#include <map>
 #include <set>
+#include <map>
+#include <deque>
 #include <vector>
 #include <string>
 #include <cmath>
 #include <stdint.h>
-#include <libmemcached/memcached.h>
-
 #include "define.h"
 #include "type.h"
+#include "backend.h"
+#include "thread/mutex.h"
 
 namespace amos
 {
+	class MapCommitter;
+
 	class Map
 	{
 	public:
+		// pages is the memory budget in tiles of a single channel, pending changes take pages as well
 		Map(const std::vector< std::pair<std::string, uint16_t> > &servers, uint32_t pages = 500);
+		Map(MapBackend *backend, uint32_t pages = 500); // takes ownership of the backend
 		virtual ~Map();
 
-		bool isOpen() const { return memc; }
+		bool isOpen() const { return backend; }
 		virtual map_info_t getInfo() const { return info; }
 
 		virtual uint32_t getTileLength() const;
 		virtual uint32_t getTileSize() const;
+		virtual uint32_t getTileLength(uint32_t channel) const; // more than one value per cell for channel groups
+		virtual uint32_t getTileSize(uint32_t channel) const;
 
 		virtual map_data_t get(uint32_t channel, double x, double y, double z);
 		virtual void set(uint32_t channel, double x, double y, double z, map_data_t value);
@@ -35,39 +41,135 @@ namespace amos
 		virtual void set(uint32_t channel, int32_t x, int32_t y, int32_t z, map_data_t value);
 		virtual void update(uint32_t channel, int32_t x, int32_t y, int32_t z, map_data_t multiplication, map_data_t addition);
 
+		// all values of a channel group at once, see MAP_CHANNEL_WIDTHS for how many
+		virtual void getGroup(uint32_t group, int32_t x, int32_t y, int32_t z, map_data_t *values);
+		virtual void setGroup(uint32_t group, int32_t x, int32_t y, int32_t z, const map_data_t *values);
+		virtual void updateGroup(uint32_t group, int32_t x, int32_t y, int32_t z, const map_data_t *multiplication, const map_data_t *addition);
+
 		virtual map_data_t get(const map_tile_id_t &id, uint32_t index);
 		virtual void set(const map_tile_id_t &id, uint32_t index, map_data_t value);
 		virtual void update(const map_tile_id_t &id, uint32_t index, map_data_t multiplication, map_data_t addition);
 		
+		// the tile a cell is in and where in the tile its values start, for working on whole tiles
+		virtual map_tile_id_t locate(uint32_t channel, int32_t x, int32_t y, int32_t z, uint32_t *index) const;
+
 		virtual const map_data_t* get(const map_tile_id_t &id, uint32_t *rev = 0);
 		virtual void set(const map_tile_id_t &id, const map_data_t* tile);
 		virtual void update(const map_tile_id_t &id, const map_data_t* multiplication, const map_data_t* addition);
+		virtual void update(const map_tile_id_t &id, const map_data_t* multiplication, const map_data_t* addition, uint32_t begin, uint32_t end); // whole tiles, only values from begin to end
+
+		// a rectangle of cells starting at (x, y) as one raster, row by row with y going up,
+		// values of a channel group next to each other, cells of missing tiles get the channel default
+		virtual void getRegion(uint32_t channel, int32_t x, int32_t y, int32_t z, uint32_t width, uint32_t height, map_data_t *raster);
+		virtual void setRegion(uint32_t channel, int32_t x, int32_t y, int32_t z, uint32_t width, uint32_t height, const map_data_t *raster);
+		virtual void updateRegion(uint32_t channel, int32_t x, int32_t y, int32_t z, uint32_t width, uint32_t height, const map_data_t *multiplication, const map_data_t *addition);
+
+		// walks the cells from (x0, y0) to (x1, y1) at height z, both ends included, crossing one tile after
+		// another without looking each cell up, and calls back once per tile, if write is set every cell
+		// has its pending change set up so that map_cell_update() can be used on it, returns the cell count
+		virtual uint32_t trace(uint32_t channel, double x0, double y0, double x1, double y1, double z, bool write, map_ray_callback_t callback, void *context);
 
 		virtual std::set<map_tile_id_t> list(bool refresh = false);
+		virtual std::vector<map_tile_id_t> listNew(); // tiles that have shown up since the last call
 		virtual void commit();
 		virtual void refresh();
+		virtual void flush();
+		virtual void prefetch(const std::vector<map_tile_id_t> &ids);
+
+		virtual void setCommitter(uint32_t queue_length);
+		virtual void setLevels(uint32_t levels); // number of coarser levels kept up to date on commit
+		virtual void setBudget(size_t bytes); // same as pages, but in bytes, commits and empties the cache
+
+		// counted by the committer thread if there is one
+		uint32_t getConflicts() const { MutexLock lock(&statistics_mutex); return conflicts; }
+		uint32_t getRetries() const { MutexLock lock(&statistics_mutex); return retries; }
+
+		// counters and latencies since the map was created, counters are only exact when read
+		// by the thread that uses the map, from other threads they may lag behind a little
+		virtual map_stats_t stats() const;
 
 	protected:
-		virtual void access(const map_tile_id_t &id);
-		
-		virtual void lock(const map_tile_id_t& id);
-		virtual void unlock(const map_tile_id_t& id);
-		virtual bool load(const map_tile_id_t& id, map_data_t **data, uint32_t *revision);
-		virtual void save(const map_tile_id_t& id, const map_data_t *data,  uint32_t *revision);
-		virtual void list(std::set<map_tile_id_t> &list);
+		void init(MapBackend *backend);
+		void reserve(uint32_t pages);
+
+		virtual void traceSpan(map_ray_span_t *span, bool write, map_ray_callback_t callback, void *context);
+		virtual void prefetchRegion(uint32_t channel, int32_t x, int32_t y, int32_t z, uint32_t width, uint32_t height);
+		virtual map_tile_t* access(const map_tile_id_t &id);
+		virtual map_tile_t* find(const map_tile_id_t &id) const;
+		virtual map_tile_t* insert(const map_tile_id_t &id);
+		virtual bool load(map_tile_t *tile);
+		virtual void touch(map_tile_t *tile);
+		virtual void link(map_tile_t *tile);
+		virtual void unlink(map_tile_t *tile);
+		virtual void charge(map_tile_t *tile, int32_t pages);
+		virtual void shrink(uint32_t pages, const map_tile_t *keep);
+		virtual map_tile_t* victim(const map_tile_t *keep) const;
+		virtual void evict(map_tile_t *tile);
+		virtual bool commit(map_tile_t *tile, MapBackend *connection);
+		virtual void snapshot(map_tile_t *tile);
+		virtual void reclaim();
+		virtual void reclaim(map_tile_t *job);
+		virtual void merge(map_tile_t *tile);
+		virtual map_tile_t* modify(const map_tile_id_t &id, uint32_t begin, uint32_t end);
+		virtual void downsample();
+		virtual void downsample(const map_tile_id_t &id);
+
+		virtual map_tile_t* acquire();
+		virtual void release(map_tile_t *tile);
+		virtual map_data_t* acquireBuffer(uint32_t length);
+		virtual void releaseBuffer(map_data_t *buffer, uint32_t length);
+
+		virtual void fetch(const std::vector<map_tile_t*> &tiles);
 
 		uint32_t pages;
 		map_info_t info;
 
-		std::list<map_tile_id_t> lru; // a queue for LRU, last element is last used
-		std::map<map_tile_id_t, map_data_t*> data; // tile data map
-		std::map<map_tile_id_t, map_data_t*> addition;
-		std::map<map_tile_id_t, map_data_t*> multiplication;
-		std::map<map_tile_id_t, bool> stale; // tile stale bit map
-		std::map<map_tile_id_t, uint32_t> revision; // revision of the map
-		std::set<map_tile_id_t> tiles; // cached tile list
-		
-		memcached_st *memc;
+		// tiles whose sides are all powers of two are located with shifts and masks, see locate()
+		bool tile_pow2;
+		uint32_t tile_shift_x, tile_shift_y, tile_shift_z;
+
+		std::vector<map_tile_t*> buckets; // hash index of cached tiles, size is a power of two
+
+		// cached tiles in two queues (2Q), hot tiles first in LRU order, then tiles that have only been
+		// used in one go in FIFO order, a sweep over many tiles passes through the second queue only
+		map_tile_t *head, *tail;
+		map_tile_t *probation; // newest tile of the second queue, null if it is empty
+		uint32_t size; // pages taken by cached tiles, data and pending changes
+		uint32_t probation_size; // pages taken by tiles in the second queue
+		std::set<map_tile_id_t> ghosts; // tiles that recently dropped out of the second queue
+		std::deque<map_tile_id_t> ghost_order;
+
+		// tile records, one per page, allocated once
+		map_tile_t *records;
+		map_tile_t *free_records;
+
+		// tile data and pending changes, recycled as long as the budget allows
+		std::map<uint32_t, std::vector<map_data_t*> > free_buffers; // by length
+		uint32_t allocated; // pages allocated, in use or not
+		std::vector<uint32_t> ray; // cells of the tile a ray is crossing
+		std::set<map_tile_id_t> tiles; // tiles listed so far
+		uint64_t list_cursor; // how far into the list of tiles we have got
+
+		// optimistic commit statistics
+		uint32_t conflicts; // number of tiles that someone else committed in between
+		uint32_t retries; // number of times deltas had to be applied again
+
+		// cache and backend statistics, the committer thread updates them as well
+		// so anything it touches is only updated while holding the mutex
+		map_stats_t statistics;
+		mutable Mutex statistics_mutex;
+
+		// committed tiles whose coarser levels have not caught up yet
+		uint32_t levels;
+		std::set<map_tile_id_t> coarsen;
+
+		// optional write-behind committer, owns its own connection
+		MapCommitter *committer;
+		uint32_t committing; // pages of buffers handed over to the committer
+
+		MapBackend *backend;
+
+		friend class MapCommitter;
 	};
 }
 
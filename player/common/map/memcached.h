@@ -7,8 +7,8 @@
 #define MEMCACHEDMAP_KEY_NAMESPACE			((uint8_t)'M')
 #define MEMCACHEDMAP_KEY_TYPE_INFO			((uint8_t)'i')
 #define MEMCACHEDMAP_KEY_TYPE_LIST			((uint8_t)'s')
+#define MEMCACHEDMAP_KEY_TYPE_LIST_COUNT	((uint8_t)'n')
 #define MEMCACHEDMAP_KEY_TYPE_TILE_DATA		((uint8_t)'t')
-#define MEMCACHEDMAP_KEY_TYPE_TILE_LOCK		((uint8_t)'l')
 #define MEMCACHEDMAP_KEY_TYPE_TILE_REVISION	((uint8_t)'r')
 
 typedef struct memcachedmap_key
@@ -22,5 +22,20 @@ typedef struct memcachedmap_key
 #define MEMCACHEDMAP_KEY_ID_SIZE			(sizeof(map_tile_id_t) + sizeof(map_tile_id_t))
 #define MEMCACHEDMAP_KEY_WITH_ID_SIZE		(MEMCACHEDMAP_KEY_SIZE + MEMCACHEDMAP_KEY_ID_SIZE)
 
+// the list of tiles is split into chunks, so that readers only need to download what is new,
+// every new tile increments the list count (ascii, as memcached increments it) and goes into chunk
+// (count - 1) / MEMCACHEDMAP_LIST_CHUNK_LENGTH,
+// chunks are keyed like tiles with the chunk number in place of the channel
+#define MEMCACHEDMAP_LIST_CHUNK_LENGTH		256
+
+// tile data is stored behind its revision, so that both can be replaced with a single cas,
+// the separate revision key only serves as a cheap hint for readers polling for changes
+typedef struct memcachedmap_tile_header
+{
+	uint32_t revision;
+} memcachedmap_tile_header_t;
+
+#define MEMCACHEDMAP_TILE_HEADER_SIZE		(sizeof(memcachedmap_tile_header_t))
+
 #endif // AMOS_COMMON_MAP_MEMCACHEDMAPDEF_H
 
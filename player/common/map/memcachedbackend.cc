@@ -0,0 +1,613 @@
+#include "memcachedbackend.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <map>
+
+#include "memcached.h"
+
+#define MEMCACHEDMAP_LIST_PATIENCE 100 // reads of the list a short chunk is waited on once a later chunk has been started
+
+using namespace amos;
+
+MemcachedMapBackend::MemcachedMapBackend(const std::vector< std::pair<std::string, uint16_t> > &servers) : MapBackend(), tile_length(0), memc(0)
+{
+	memcached_return mr = MEMCACHED_SUCCESS;
+	memcached_server_st *server_list = 0;
+	memcachedmap_key_t info_key;
+	size_t info_size = 0;
+	uint32_t info_flags = 0;
+	char *info_data = 0;
+
+	memset(&info, 0, sizeof(map_info_t));
+
+	memc = memcached_create(0);
+	assert(memc);
+
+	// create the list of server
+	for (std::vector< std::pair<std::string, uint16_t> >::const_iterator i = servers.begin(); i != servers.end(); i++)
+	{
+		server_list = memcached_server_list_append(server_list, i->first.c_str(), i->second, &mr);
+		if (mr != MEMCACHED_SUCCESS)
+			goto error;
+	}
+
+	// connect to all servers
+	mr = memcached_server_push(memc, server_list);
+	if (mr != MEMCACHED_SUCCESS)
+		goto error;
+	memcached_server_free(server_list);
+	server_list = 0;
+
+	// tiles are committed optimistically with cas
+	mr = memcached_behavior_set(memc, MEMCACHED_BEHAVIOR_SUPPORT_CAS, 1);
+	if (mr != MEMCACHED_SUCCESS)
+		goto error;
+
+	// now find out if there is a map on the server
+	memset(&info_key, 0, sizeof(memcachedmap_key_t));
+	info_key.ns = MEMCACHEDMAP_KEY_NAMESPACE;
+	info_key.type = MEMCACHEDMAP_KEY_TYPE_INFO;
+	info_data = memcached_get(memc, (const char*)&info_key, MEMCACHEDMAP_KEY_SIZE, &info_size, &info_flags, &mr);
+	if (!info_data)
+		goto error;
+	if (info_size != sizeof(map_info_t))
+		goto error;
+	memcpy(&info, info_data, sizeof(map_info_t));
+	free(info_data);
+	info_data = 0;
+
+	// a little sanity check
+	if (info.scale <= 0.0)
+		goto error;
+
+	tile_length = info.tile_width * info.tile_height * info.tile_depth;
+	return;
+
+error:
+	if (mr != MEMCACHED_SUCCESS)
+	{
+		fprintf(stderr, "memcachedmap: error: %s\n", memcached_strerror(memc, mr));
+	}
+
+	if (server_list)
+	{
+		memcached_server_free(server_list);
+		server_list = 0;
+	}
+
+	if (info_data)
+	{
+		free(info_data);
+		info_data = 0;
+	}
+
+	if (memc)
+	{
+		memcached_quit(memc);
+		memcached_free(memc);
+		memc = 0;
+	}
+}
+
+MemcachedMapBackend::MemcachedMapBackend(const MemcachedMapBackend &other) : MapBackend(), info(other.info), tile_length(other.tile_length), memc(0)
+{
+	// libmemcached connections are not thread safe, so every clone gets its own
+	if (other.memc)
+		memc = memcached_clone(0, other.memc);
+}
+
+MemcachedMapBackend::~MemcachedMapBackend()
+{
+	if (memc)
+	{
+		memcached_quit(memc);
+		memcached_free(memc);
+		memc = 0;
+	}
+}
+
+MapBackend* MemcachedMapBackend::clone() const
+{
+	return new MemcachedMapBackend(*this);
+}
+
+bool MemcachedMapBackend::load(const map_tile_id_t& id, map_data_t *data, uint32_t *revision)
+{
+	memcached_return mr = MEMCACHED_SUCCESS;
+
+	uint32_t tile_revision = 0;
+	memcachedmap_key_t tile_revision_key;
+	size_t tile_revision_size = 0;
+	uint32_t tile_revision_flags = 0;
+	char *tile_revision_data = 0;
+
+	memcachedmap_key_t tile_data_key;
+	size_t tile_data_size = 0;
+	uint32_t tile_data_flags = 0;
+	char *tile_data_data = 0;
+
+	if (!memc) return false;
+
+	//
+	// first find out revision
+	//
+
+	memset(&tile_revision_key, 0, sizeof(memcachedmap_key_t));
+	tile_revision_key.ns = MEMCACHEDMAP_KEY_NAMESPACE;
+	tile_revision_key.type = MEMCACHEDMAP_KEY_TYPE_TILE_REVISION;
+	map_tile_id_to_hex(id, tile_revision_key.id);
+	tile_revision_data = memcached_get(memc, (const char*)&tile_revision_key, MEMCACHEDMAP_KEY_WITH_ID_SIZE, &tile_revision_size, &tile_revision_flags, &mr);
+
+	// does tile exist on server?
+	if (!tile_revision_data) return false;
+
+	if (tile_revision_size != sizeof(uint32_t))
+		goto error;
+	tile_revision = *((uint32_t*)tile_revision_data);
+	free(tile_revision_data);
+	tile_revision_data = 0;
+
+	// if no new revision is available, we don't need to fetch the tile again
+	if (tile_revision <= *revision) return false;
+
+	//
+	// new revision, we do need to fetch tile
+	//
+	memset(&tile_data_key, 0, sizeof(memcachedmap_key_t));
+	tile_data_key.ns = MEMCACHEDMAP_KEY_NAMESPACE;
+	tile_data_key.type = MEMCACHEDMAP_KEY_TYPE_TILE_DATA;
+	memcpy(tile_data_key.id, tile_revision_key.id, MEMCACHEDMAP_KEY_ID_SIZE);
+	tile_data_data = memcached_get(memc, (const char*)&tile_data_key, MEMCACHEDMAP_KEY_WITH_ID_SIZE, &tile_data_size, &tile_data_flags, &mr);
+	// if revision key exists but not the tile data, something is terribly wrong
+	if (!tile_data_data)
+		goto error;
+	if (tile_data_size != MEMCACHEDMAP_TILE_HEADER_SIZE + map_tile_wire_size(id.channel, tile_length * map_channel_width(id.channel)))
+		goto error;
+	bytes_loaded += tile_data_size;
+
+	// the revision stored with the data is the authoritative one
+	tile_revision = ((memcachedmap_tile_header_t*)tile_data_data)->revision;
+	if (tile_revision <= *revision)
+	{
+		free(tile_data_data);
+		tile_data_data = 0;
+		return false;
+	}
+
+	// trust you have the correct size for the buffer
+	assert(data);
+	map_tile_decode(id.channel, (const uint8_t*)tile_data_data + MEMCACHEDMAP_TILE_HEADER_SIZE, tile_length * map_channel_width(id.channel), data);
+
+	free(tile_data_data);
+	tile_data_data = 0;
+
+	*revision = tile_revision;
+
+	return true; // new tile loaded, hence return true
+
+error:
+	if (mr != MEMCACHED_SUCCESS)
+	{
+		fprintf(stderr, "memcachedmap: load: error: %s\n", memcached_strerror(memc, mr));
+	}
+
+	if (tile_revision_data)
+	{
+		free(tile_revision_data);
+		tile_revision_data = 0;
+	}
+
+	if (tile_data_data)
+	{
+		free(tile_data_data);
+		tile_data_data = 0;
+	}
+	return false;
+}
+
+void MemcachedMapBackend::fetch(const std::vector<map_tile_t*> &pending)
+{
+	memcached_return mr = MEMCACHED_SUCCESS;
+
+	std::vector<memcachedmap_key_t> keys;
+	std::vector<const char*> key_ptrs;
+	std::vector<size_t> key_sizes;
+	std::map<std::string, map_tile_t*> tiles;
+	std::map<map_tile_t*, uint32_t> revisions;
+
+	char key[MEMCACHED_MAX_KEY];
+	size_t key_size = 0;
+	char *value = 0;
+	size_t value_size = 0;
+	uint32_t value_flags = 0;
+
+	if (!memc || pending.empty()) return;
+
+	//
+	// first find out revisions of all tiles
+	//
+	keys.resize(pending.size());
+	for (unsigned int i = 0; i < pending.size(); i++)
+	{
+		memset(&keys[i], 0, sizeof(memcachedmap_key_t));
+		keys[i].ns = MEMCACHEDMAP_KEY_NAMESPACE;
+		keys[i].type = MEMCACHEDMAP_KEY_TYPE_TILE_REVISION;
+		map_tile_id_to_hex(pending[i]->id, keys[i].id);
+		key_ptrs.push_back((const char*)&keys[i]);
+		key_sizes.push_back(MEMCACHEDMAP_KEY_WITH_ID_SIZE);
+		tiles[std::string((const char*)keys[i].id, MEMCACHEDMAP_KEY_ID_SIZE)] = pending[i];
+	}
+
+	mr = memcached_mget(memc, &key_ptrs[0], &key_sizes[0], key_ptrs.size());
+	if (mr != MEMCACHED_SUCCESS)
+		goto error;
+
+	while ((value = memcached_fetch(memc, key, &key_size, &value_size, &value_flags, &mr)))
+	{
+		if (key_size == MEMCACHEDMAP_KEY_WITH_ID_SIZE && value_size == sizeof(uint32_t))
+		{
+			std::map<std::string, map_tile_t*>::iterator i = tiles.find(std::string(key + MEMCACHEDMAP_KEY_SIZE, MEMCACHEDMAP_KEY_ID_SIZE));
+			if (i != tiles.end())
+				revisions[i->second] = *((uint32_t*)value);
+		}
+		free(value);
+		value = 0;
+	}
+	if (mr != MEMCACHED_END && mr != MEMCACHED_NOTFOUND)
+		goto error;
+
+	//
+	// only fetch tiles that have a new revision
+	//
+	keys.clear();
+	key_ptrs.clear();
+	key_sizes.clear();
+	for (std::vector<map_tile_t*>::const_iterator i = pending.begin(); i != pending.end(); ++i)
+	{
+		// tile does not exist on server or we already have the newest revision
+		if (revisions.find(*i) == revisions.end() || revisions[*i] <= (*i)->revision)
+		{
+			(*i)->stale = false;
+			continue;
+		}
+
+		memcachedmap_key_t tile_data_key;
+		memset(&tile_data_key, 0, sizeof(memcachedmap_key_t));
+		tile_data_key.ns = MEMCACHEDMAP_KEY_NAMESPACE;
+		tile_data_key.type = MEMCACHEDMAP_KEY_TYPE_TILE_DATA;
+		map_tile_id_to_hex((*i)->id, tile_data_key.id);
+		keys.push_back(tile_data_key);
+	}
+	if (keys.empty()) return;
+
+	for (unsigned int i = 0; i < keys.size(); i++)
+	{
+		key_ptrs.push_back((const char*)&keys[i]);
+		key_sizes.push_back(MEMCACHEDMAP_KEY_WITH_ID_SIZE);
+	}
+
+	mr = memcached_mget(memc, &key_ptrs[0], &key_sizes[0], key_ptrs.size());
+	if (mr != MEMCACHED_SUCCESS)
+		goto error;
+
+	while ((value = memcached_fetch(memc, key, &key_size, &value_size, &value_flags, &mr)))
+	{
+		std::map<std::string, map_tile_t*>::iterator i = tiles.end();
+		if (key_size == MEMCACHEDMAP_KEY_WITH_ID_SIZE)
+			i = tiles.find(std::string(key + MEMCACHEDMAP_KEY_SIZE, MEMCACHEDMAP_KEY_ID_SIZE));
+		if (i != tiles.end() && value_size == MEMCACHEDMAP_TILE_HEADER_SIZE + map_tile_wire_size(i->second->id.channel, tile_length * map_channel_width(i->second->id.channel)))
+		{
+			map_tile_t *tile = i->second;
+			const uint32_t tile_revision = ((memcachedmap_tile_header_t*)value)->revision;
+			bytes_loaded += value_size;
+			if (tile_revision > tile->revision)
+			{
+				map_tile_decode(tile->id.channel, (const uint8_t*)value + MEMCACHEDMAP_TILE_HEADER_SIZE, tile_length * map_channel_width(tile->id.channel), tile->buffer);
+				tile->data = tile->buffer;
+				tile->revision = tile_revision;
+			}
+			tile->stale = false;
+		}
+		free(value);
+		value = 0;
+	}
+	if (mr != MEMCACHED_END && mr != MEMCACHED_NOTFOUND)
+		goto error;
+
+	return;
+
+error:
+	if (mr != MEMCACHED_SUCCESS)
+	{
+		fprintf(stderr, "memcachedmap: fetch: error: %s\n", memcached_strerror(memc, mr));
+	}
+
+	if (value)
+	{
+		free(value);
+		value = 0;
+	}
+}
+
+bool MemcachedMapBackend::checkout(const map_tile_id_t& id, map_data_t *data, uint32_t *revision, uint64_t *cas)
+{
+	memcached_return mr = MEMCACHED_SUCCESS;
+	memcached_result_st *result = 0;
+	memcachedmap_key_t tile_data_key;
+	const char *tile_data_key_ptr = (const char*)&tile_data_key;
+	const size_t tile_data_key_size = MEMCACHEDMAP_KEY_WITH_ID_SIZE;
+	const memcachedmap_tile_header_t *header = 0;
+	bool loaded = false;
+
+	*cas = 0;
+	if (!memc) return false;
+
+	//
+	// gets the tile, this always transfers the data because we need the cas token of the whole value
+	//
+	memset(&tile_data_key, 0, sizeof(memcachedmap_key_t));
+	tile_data_key.ns = MEMCACHEDMAP_KEY_NAMESPACE;
+	tile_data_key.type = MEMCACHEDMAP_KEY_TYPE_TILE_DATA;
+	map_tile_id_to_hex(id, tile_data_key.id);
+	mr = memcached_mget(memc, &tile_data_key_ptr, &tile_data_key_size, 1);
+	if (mr != MEMCACHED_SUCCESS)
+		goto error;
+
+	while ((result = memcached_fetch_result(memc, 0, &mr)))
+	{
+		if (memcached_result_length(result) == MEMCACHEDMAP_TILE_HEADER_SIZE + map_tile_wire_size(id.channel, tile_length * map_channel_width(id.channel)))
+		{
+			header = (const memcachedmap_tile_header_t*)memcached_result_value(result);
+			*cas = memcached_result_cas(result);
+			bytes_loaded += memcached_result_length(result);
+
+			// only copy the tile if someone else has committed since we last loaded it
+			if (header->revision > *revision)
+			{
+				map_tile_decode(id.channel, (const uint8_t*)memcached_result_value(result) + MEMCACHEDMAP_TILE_HEADER_SIZE, tile_length * map_channel_width(id.channel), data);
+				*revision = header->revision;
+				loaded = true;
+			}
+		}
+		memcached_result_free(result);
+		result = 0;
+	}
+
+	// the tile might not exist on server yet
+	if (mr != MEMCACHED_END && mr != MEMCACHED_NOTFOUND)
+		goto error;
+
+	return loaded;
+
+error:
+	if (mr != MEMCACHED_SUCCESS)
+	{
+		fprintf(stderr, "memcachedmap: checkout: error: %s\n", memcached_strerror(memc, mr));
+	}
+	return loaded;
+}
+
+int MemcachedMapBackend::save(const map_tile_id_t& id, const map_data_t *data, uint32_t *revision, uint64_t cas)
+{
+	memcached_return mr = MEMCACHED_SUCCESS;
+	memcachedmap_key_t tile_data_key, tile_revision_key;
+	std::vector<uint8_t> value(MEMCACHEDMAP_TILE_HEADER_SIZE + map_tile_wire_size(id.channel, tile_length * map_channel_width(id.channel)));
+	memcachedmap_tile_header_t *header = (memcachedmap_tile_header_t*)&value[0];
+
+	if (!memc) return -1;
+
+	//
+	// build the new value, revision goes together with the data
+	//
+	header->revision = *revision + 1;
+	map_tile_encode(id.channel, data, tile_length * map_channel_width(id.channel), &value[MEMCACHEDMAP_TILE_HEADER_SIZE]);
+
+	memset(&tile_data_key, 0, sizeof(memcachedmap_key_t));
+	tile_data_key.ns = MEMCACHEDMAP_KEY_NAMESPACE;
+	tile_data_key.type = MEMCACHEDMAP_KEY_TYPE_TILE_DATA;
+	map_tile_id_to_hex(id, tile_data_key.id);
+
+	// a new tile has to be added, an existing one swapped only if nobody else has touched it
+	if (cas)
+		mr = memcached_cas(memc, (const char*)&tile_data_key, MEMCACHEDMAP_KEY_WITH_ID_SIZE, (const char*)&value[0], value.size(), (time_t)0, 0, cas);
+	else
+		mr = memcached_add(memc, (const char*)&tile_data_key, MEMCACHEDMAP_KEY_WITH_ID_SIZE, (const char*)&value[0], value.size(), (time_t)0, 0);
+
+	// someone else was faster
+	if (mr == MEMCACHED_DATA_EXISTS || mr == MEMCACHED_NOTSTORED || mr == MEMCACHED_NOTFOUND)
+		return 1;
+	if (mr != MEMCACHED_SUCCESS)
+		goto error;
+	*revision = header->revision;
+	bytes_saved += value.size();
+
+	//
+	// now we need to update the revision hint for readers
+	//
+	memset(&tile_revision_key, 0, sizeof(memcachedmap_key_t));
+	tile_revision_key.ns = MEMCACHEDMAP_KEY_NAMESPACE;
+	tile_revision_key.type = MEMCACHEDMAP_KEY_TYPE_TILE_REVISION;
+	memcpy(tile_revision_key.id, tile_data_key.id, MEMCACHEDMAP_KEY_ID_SIZE);
+	mr = memcached_set(memc, (const char*)&tile_revision_key, MEMCACHEDMAP_KEY_WITH_ID_SIZE, (const char*)revision, sizeof(uint32_t), (time_t)0, 0);
+	if (mr != MEMCACHED_SUCCESS)
+		goto error;
+
+	//
+	// now we need to add this tile into the list of tiles if it does not exists in there yet
+	//
+	if (*revision != 1) return 0;
+	mr = appendList(memc, id);
+	if (mr != MEMCACHED_SUCCESS)
+		goto error;
+
+	return 0;
+
+error:
+	if (mr != MEMCACHED_SUCCESS)
+	{
+		fprintf(stderr, "memcachedmap: save: error: %s\n", memcached_strerror(memc, mr));
+	}
+
+	// the tile itself has been committed already if we know its new revision
+	return (*revision == header->revision) ? 0 : -1;
+}
+
+void MemcachedMapBackend::list(uint64_t *cursor, std::vector<map_tile_id_t> &output)
+{
+	if (!memc) return;
+	readList(memc, cursor, output);
+}
+
+memcached_return MemcachedMapBackend::appendList(memcached_st *memc, const map_tile_id_t &id)
+{
+	memcached_return mr = MEMCACHED_SUCCESS;
+	memcachedmap_key_t count_key, list_key;
+	uint64_t count = 0;
+
+	//
+	// first reserve a place in the list
+	//
+	memset(&count_key, 0, sizeof(memcachedmap_key_t));
+	count_key.ns = MEMCACHEDMAP_KEY_NAMESPACE;
+	count_key.type = MEMCACHEDMAP_KEY_TYPE_LIST_COUNT;
+	mr = memcached_increment(memc, (const char*)&count_key, MEMCACHEDMAP_KEY_SIZE, 1, &count);
+	if (mr == MEMCACHED_NOTFOUND)
+	{
+		// first tile ever, somebody else might be creating the counter as well
+		mr = memcached_add(memc, (const char*)&count_key, MEMCACHEDMAP_KEY_SIZE, "0", 1, (time_t)0, 0);
+		if (mr != MEMCACHED_SUCCESS && mr != MEMCACHED_NOTSTORED && mr != MEMCACHED_DATA_EXISTS)
+			return mr;
+		mr = memcached_increment(memc, (const char*)&count_key, MEMCACHEDMAP_KEY_SIZE, 1, &count);
+	}
+	if (mr != MEMCACHED_SUCCESS)
+		return mr;
+
+	//
+	// then append the tile to its chunk, which might not exist yet
+	//
+	memset(&list_key, 0, sizeof(memcachedmap_key_t));
+	list_key.ns = MEMCACHEDMAP_KEY_NAMESPACE;
+	list_key.type = MEMCACHEDMAP_KEY_TYPE_LIST;
+	map_tile_id_to_hex((map_tile_id_t){ (uint32_t)((count - 1) / MEMCACHEDMAP_LIST_CHUNK_LENGTH), 0, 0, 0 }, list_key.id);
+	for (int attempt = 0; attempt < 2; attempt++)
+	{
+		mr = memcached_append(memc, (const char*)&list_key, MEMCACHEDMAP_KEY_WITH_ID_SIZE, (const char*)&id, sizeof(map_tile_id_t), (time_t)0, 0);
+		if (mr != MEMCACHED_NOTSTORED)
+			break;
+		mr = memcached_add(memc, (const char*)&list_key, MEMCACHEDMAP_KEY_WITH_ID_SIZE, (const char*)&id, sizeof(map_tile_id_t), (time_t)0, 0);
+		if (mr != MEMCACHED_NOTSTORED && mr != MEMCACHED_DATA_EXISTS)
+			break;
+	}
+	return mr;
+}
+
+bool MemcachedMapBackend::readList(memcached_st *memc, uint64_t *cursor, std::vector<map_tile_id_t> &output)
+{
+	memcached_return mr = MEMCACHED_SUCCESS;
+
+	memcachedmap_key_t list_keys[2];
+	const char *key_ptrs[2] = { (const char*)&list_keys[0], (const char*)&list_keys[1] };
+	const size_t key_sizes[2] = { MEMCACHEDMAP_KEY_WITH_ID_SIZE, MEMCACHEDMAP_KEY_WITH_ID_SIZE };
+	char key[MEMCACHED_MAX_KEY];
+	size_t key_size = 0;
+	char *value = 0;
+	size_t value_size = 0;
+	uint32_t value_flags = 0;
+	std::string list_data;
+	bool started = false, later = false;
+
+	// the cursor is the chunk, how many reads it has been left short for while a later one exists,
+	// and how many of its tiles we have seen already
+	uint32_t chunk = (uint32_t)(*cursor >> 32);
+	uint32_t waited = (uint32_t)(*cursor >> 16) & 0xffff;
+	uint32_t offset = (uint32_t)*cursor & 0xffff;
+	uint32_t length = 0;
+
+	memset(list_keys, 0, sizeof(list_keys));
+	for (int i = 0; i < 2; i++)
+	{
+		list_keys[i].ns = MEMCACHEDMAP_KEY_NAMESPACE;
+		list_keys[i].type = MEMCACHEDMAP_KEY_TYPE_LIST;
+	}
+
+	// only move on to the next chunk once the current one is full, the next one comes along
+	// in the same round trip to tell a chunk that is still filling from one a writer has left short
+	for(;;)
+	{
+		map_tile_id_to_hex((map_tile_id_t){ chunk, 0, 0, 0 }, list_keys[0].id);
+		map_tile_id_to_hex((map_tile_id_t){ chunk + 1, 0, 0, 0 }, list_keys[1].id);
+		mr = memcached_mget(memc, key_ptrs, key_sizes, 2);
+		if (mr != MEMCACHED_SUCCESS)
+			goto error;
+
+		started = later = false;
+		while ((value = memcached_fetch(memc, key, &key_size, &value_size, &value_flags, &mr)))
+		{
+			if (key_size == MEMCACHEDMAP_KEY_WITH_ID_SIZE && !memcmp(key, key_ptrs[0], key_size))
+			{
+				list_data.assign(value, value_size);
+				started = true;
+			}
+			else if (key_size == MEMCACHEDMAP_KEY_WITH_ID_SIZE && !memcmp(key, key_ptrs[1], key_size))
+			{
+				later = true;
+			}
+			free(value);
+			value = 0;
+		}
+		if (mr != MEMCACHED_END && mr != MEMCACHED_NOTFOUND)
+			goto error;
+
+		// chunk has not been started yet
+		if (!started)
+			break;
+
+		if (list_data.size() % sizeof(map_tile_id_t) != 0)
+			goto error;
+		length = list_data.size() / sizeof(map_tile_id_t);
+		if (length > offset)
+		{
+			output.insert(output.end(), (const map_tile_id_t*)list_data.data() + offset, (const map_tile_id_t*)list_data.data() + length);
+			offset = length;
+			waited = 0;
+		}
+
+		if (offset < MEMCACHEDMAP_LIST_CHUNK_LENGTH)
+		{
+			// the newest chunk is still filling
+			if (!later)
+				break;
+
+			// somebody has taken a place here and not appended yet, give a slow writer plenty
+			// of time before taking it for one that failed and will never append
+			if (++waited < MEMCACHEDMAP_LIST_PATIENCE)
+				break;
+			fprintf(stderr, "memcachedmap: list: chunk %u is missing %u tiles, moving on\n", chunk, MEMCACHEDMAP_LIST_CHUNK_LENGTH - offset);
+		}
+
+		chunk++;
+		offset = 0;
+		waited = 0;
+	}
+	*cursor = ((uint64_t)chunk << 32) | (waited << 16) | offset;
+	return true;
+
+error:
+	if (mr != MEMCACHED_SUCCESS)
+	{
+		fprintf(stderr, "memcachedmap: list: error: %s\n", memcached_strerror(memc, mr));
+	}
+
+	if (value)
+	{
+		free(value);
+		value = 0;
+	}
+
+	// keep what we have got so far
+	*cursor = ((uint64_t)chunk << 32) | (waited << 16) | offset;
+	return false;
+}
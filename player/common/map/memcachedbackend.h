@@ -0,0 +1,42 @@
+#ifndef AMOS_COMMON_MAP_MEMCACHEDBACKEND_H
+#define AMOS_COMMON_MAP_MEMCACHEDBACKEND_H
+
+#include <string>
+#include <libmemcached/memcached.h>
+
+#include "backend.h"
+
+namespace amos
+{
+	// tiles live on memcached servers, see memcached.h for the layout
+	class MemcachedMapBackend : public MapBackend
+	{
+	public:
+		MemcachedMapBackend(const std::vector< std::pair<std::string, uint16_t> > &servers);
+		virtual ~MemcachedMapBackend();
+
+		virtual bool isOpen() const { return memc; }
+		virtual map_info_t getInfo() const { return info; }
+		virtual MapBackend* clone() const;
+
+		virtual bool load(const map_tile_id_t &id, map_data_t *data, uint32_t *revision);
+		virtual void fetch(const std::vector<map_tile_t*> &tiles);
+		virtual bool checkout(const map_tile_id_t &id, map_data_t *data, uint32_t *revision, uint64_t *cas);
+		virtual int save(const map_tile_id_t &id, const map_data_t *data, uint32_t *revision, uint64_t cas);
+		virtual void list(uint64_t *cursor, std::vector<map_tile_id_t> &list);
+
+		// the tile list is shared with tools working on the servers directly
+		static memcached_return appendList(memcached_st *memc, const map_tile_id_t &id);
+		static bool readList(memcached_st *memc, uint64_t *cursor, std::vector<map_tile_id_t> &list);
+
+	protected:
+		MemcachedMapBackend(const MemcachedMapBackend &other);
+
+		map_info_t info;
+		uint32_t tile_length;
+
+		memcached_st *memc;
+	};
+}
+
+#endif // AMOS_COMMON_MAP_MEMCACHEDBACKEND_H
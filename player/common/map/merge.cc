@@ -0,0 +1,168 @@
+#include "merge.h"
+
+#include <math.h>
+#include <assert.h>
+#include <limits>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MAP_MERGE_X86
+#include <immintrin.h>
+#define MAP_MERGE_SSE2 __attribute__((target("sse2")))
+#define MAP_MERGE_AVX2 __attribute__((target("avx2")))
+#endif
+
+typedef void (*map_tile_merge_t)(map_data_t*, const map_data_t*, const map_data_t*, uint32_t);
+typedef void (*map_tile_update_t)(map_data_t*, map_data_t*, map_data_t*, const map_data_t*, const map_data_t*, uint32_t);
+
+// picked on first use, every thread picks the same ones
+static map_tile_merge_t merge_kernel = 0;
+static map_tile_update_t update_kernel = 0;
+
+static inline map_data_t scale(map_data_t value, map_data_t m)
+{
+	static const float inf = std::numeric_limits<float>::infinity();
+	return m == 0.0f && fabs(value) == inf ? 0.0f : value * m;
+}
+
+static void merge_scalar(map_data_t *data, const map_data_t *multiplication, const map_data_t *addition, uint32_t length)
+{
+	for (uint32_t j = 0; j < length; j++)
+	{
+		if (multiplication) data[j] = scale(data[j], multiplication[j]);
+		if (addition) data[j] += addition[j];
+	}
+}
+
+static void update_scalar(map_data_t *data, map_data_t *multiplication, map_data_t *addition, const map_data_t *m, const map_data_t *a, uint32_t length)
+{
+	for (uint32_t j = 0; j < length; j++)
+	{
+		assert(fabs(m[j]) != std::numeric_limits<float>::infinity());
+
+		multiplication[j] *= m[j];
+		addition[j] = scale(addition[j], m[j]) + a[j];
+		data[j] = scale(data[j], m[j]) + a[j];
+	}
+}
+
+#ifdef MAP_MERGE_X86
+
+// same as scale(), lanes where m is zero and value is infinite are cleared
+MAP_MERGE_SSE2 static inline __m128 scale_sse2(__m128 value, __m128 m)
+{
+	const __m128 magnitude = _mm_and_ps(value, _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff)));
+	const __m128 clear = _mm_and_ps(
+		_mm_cmpeq_ps(m, _mm_setzero_ps()),
+		_mm_cmpeq_ps(magnitude, _mm_set1_ps(std::numeric_limits<float>::infinity())));
+	return _mm_andnot_ps(clear, _mm_mul_ps(value, m));
+}
+
+MAP_MERGE_SSE2 static void merge_sse2(map_data_t *data, const map_data_t *multiplication, const map_data_t *addition, uint32_t length)
+{
+	uint32_t j = 0;
+
+	if (!multiplication || !addition)
+	{
+		merge_scalar(data, multiplication, addition, length);
+		return;
+	}
+
+	for (; j + 4 <= length; j += 4)
+	{
+		const __m128 value = scale_sse2(_mm_loadu_ps(data + j), _mm_loadu_ps(multiplication + j));
+		_mm_storeu_ps(data + j, _mm_add_ps(value, _mm_loadu_ps(addition + j)));
+	}
+	merge_scalar(data + j, multiplication + j, addition + j, length - j);
+}
+
+MAP_MERGE_SSE2 static void update_sse2(map_data_t *data, map_data_t *multiplication, map_data_t *addition, const map_data_t *m, const map_data_t *a, uint32_t length)
+{
+	uint32_t j = 0;
+
+	for (; j + 4 <= length; j += 4)
+	{
+		const __m128 mm = _mm_loadu_ps(m + j), aa = _mm_loadu_ps(a + j);
+		_mm_storeu_ps(multiplication + j, _mm_mul_ps(_mm_loadu_ps(multiplication + j), mm));
+		_mm_storeu_ps(addition + j, _mm_add_ps(scale_sse2(_mm_loadu_ps(addition + j), mm), aa));
+		_mm_storeu_ps(data + j, _mm_add_ps(scale_sse2(_mm_loadu_ps(data + j), mm), aa));
+	}
+	update_scalar(data + j, multiplication + j, addition + j, m + j, a + j, length - j);
+}
+
+MAP_MERGE_AVX2 static inline __m256 scale_avx2(__m256 value, __m256 m)
+{
+	const __m256 magnitude = _mm256_and_ps(value, _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff)));
+	const __m256 clear = _mm256_and_ps(
+		_mm256_cmp_ps(m, _mm256_setzero_ps(), _CMP_EQ_OQ),
+		_mm256_cmp_ps(magnitude, _mm256_set1_ps(std::numeric_limits<float>::infinity()), _CMP_EQ_OQ));
+	return _mm256_andnot_ps(clear, _mm256_mul_ps(value, m));
+}
+
+MAP_MERGE_AVX2 static void merge_avx2(map_data_t *data, const map_data_t *multiplication, const map_data_t *addition, uint32_t length)
+{
+	uint32_t j = 0;
+
+	if (!multiplication || !addition)
+	{
+		merge_scalar(data, multiplication, addition, length);
+		return;
+	}
+
+	for (; j + 8 <= length; j += 8)
+	{
+		const __m256 value = scale_avx2(_mm256_loadu_ps(data + j), _mm256_loadu_ps(multiplication + j));
+		_mm256_storeu_ps(data + j, _mm256_add_ps(value, _mm256_loadu_ps(addition + j)));
+	}
+	merge_scalar(data + j, multiplication + j, addition + j, length - j);
+}
+
+MAP_MERGE_AVX2 static void update_avx2(map_data_t *data, map_data_t *multiplication, map_data_t *addition, const map_data_t *m, const map_data_t *a, uint32_t length)
+{
+	uint32_t j = 0;
+
+	for (; j + 8 <= length; j += 8)
+	{
+		const __m256 mm = _mm256_loadu_ps(m + j), aa = _mm256_loadu_ps(a + j);
+		_mm256_storeu_ps(multiplication + j, _mm256_mul_ps(_mm256_loadu_ps(multiplication + j), mm));
+		_mm256_storeu_ps(addition + j, _mm256_add_ps(scale_avx2(_mm256_loadu_ps(addition + j), mm), aa));
+		_mm256_storeu_ps(data + j, _mm256_add_ps(scale_avx2(_mm256_loadu_ps(data + j), mm), aa));
+	}
+	update_scalar(data + j, multiplication + j, addition + j, m + j, a + j, length - j);
+}
+
+#endif // MAP_MERGE_X86
+
+static void select_kernels()
+{
+	map_tile_merge_t merge = &merge_scalar;
+	map_tile_update_t update = &update_scalar;
+
+#ifdef MAP_MERGE_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+	{
+		merge = &merge_avx2;
+		update = &update_avx2;
+	}
+	else if (__builtin_cpu_supports("sse2"))
+	{
+		merge = &merge_sse2;
+		update = &update_sse2;
+	}
+#endif
+
+	update_kernel = update;
+	merge_kernel = merge;
+}
+
+void map_tile_merge(map_data_t *data, const map_data_t *multiplication, const map_data_t *addition, uint32_t length)
+{
+	if (!merge_kernel) select_kernels();
+	merge_kernel(data, multiplication, addition, length);
+}
+
+void map_tile_update(map_data_t *data, map_data_t *multiplication, map_data_t *addition, const map_data_t *m, const map_data_t *a, uint32_t length)
+{
+	if (!update_kernel) select_kernels();
+	update_kernel(data, multiplication, addition, m, a, length);
+}
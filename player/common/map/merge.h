@@ -0,0 +1,27 @@
+#ifndef AMOS_COMMON_MAP_MERGE_H
+#define AMOS_COMMON_MAP_MERGE_H
+
+#include <cmath>
+#include <limits>
+#include "type.h"
+
+// kernels for whole runs of tile data, they use AVX2 or SSE2 when the cpu has it and
+// behave exactly like the scalar loops otherwise, a zero multiplier turns infinity into zero
+
+// applies pending changes to tile data, data = data * multiplication + addition,
+// either of the changes may be null
+void map_tile_merge(map_data_t *data, const map_data_t *multiplication, const map_data_t *addition, uint32_t length);
+
+// records a change in the pending changes and applies it to the data right away,
+// m has to be finite
+void map_tile_update(map_data_t *data, map_data_t *multiplication, map_data_t *addition, const map_data_t *m, const map_data_t *a, uint32_t length);
+
+// same as map_tile_update, for a single value, m has to be finite
+static inline void map_cell_update(map_data_t *data, map_data_t *multiplication, map_data_t *addition, uint32_t index, map_data_t m, map_data_t a)
+{
+	multiplication[index] *= m;
+	addition[index] = (m == 0.0f && std::fabs(addition[index]) == std::numeric_limits<float>::infinity() ? 0.0f : addition[index] * m) + a;
+	data[index] = (m == 0.0f && std::fabs(data[index]) == std::numeric_limits<float>::infinity() ? 0.0f : data[index] * m) + a;
+}
+
+#endif // AMOS_COMMON_MAP_MERGE_H
@@ -0,0 +1,170 @@
+#include "mockbackend.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+
+using namespace amos;
+
+MockMapStore::MockMapStore(const map_info_t &info) : info(info)
+{
+	tile_length = info.tile_width * info.tile_height * info.tile_depth;
+}
+
+MockMapStore::~MockMapStore()
+{
+	for (std::map<map_tile_id_t, mock_tile_t>::iterator i = tiles.begin(); i != tiles.end(); ++i)
+	{
+		delete [] i->second.data;
+		i->second.data = 0;
+	}
+	tiles.clear();
+}
+
+
+MockMapBackend::MockMapBackend(MockMapStore *store, uint32_t latency) : MapBackend(), store(store), latency(latency), round_trips(0)
+{
+	assert(store);
+}
+
+MockMapBackend::~MockMapBackend()
+{
+}
+
+MapBackend* MockMapBackend::clone() const
+{
+	return new MockMapBackend(store, latency);
+}
+
+void MockMapBackend::roundTrip()
+{
+	round_trips++;
+	if (latency) usleep(latency);
+}
+
+bool MockMapBackend::read(const map_tile_id_t &id, map_data_t *data, uint32_t *revision, uint32_t *stored)
+{
+	MutexLock lock(&store->mutex);
+
+	std::map<map_tile_id_t, MockMapStore::mock_tile_t>::const_iterator i = store->tiles.find(id);
+	*stored = 0;
+	if (i == store->tiles.end()) return false;
+
+	*stored = i->second.revision;
+	if (i->second.revision <= *revision) return false;
+
+	memcpy(data, i->second.data, sizeof(map_data_t) * store->tile_length * map_channel_width(id.channel));
+	bytes_loaded += sizeof(map_data_t) * store->tile_length * map_channel_width(id.channel);
+	*revision = i->second.revision;
+	return true;
+}
+
+bool MockMapBackend::load(const map_tile_id_t &id, map_data_t *data, uint32_t *revision)
+{
+	uint32_t stored = 0;
+
+	// revision first, then the data if it is new
+	roundTrip();
+	{
+		MutexLock lock(&store->mutex);
+		std::map<map_tile_id_t, MockMapStore::mock_tile_t>::const_iterator i = store->tiles.find(id);
+		if (i == store->tiles.end() || i->second.revision <= *revision) return false;
+	}
+
+	roundTrip();
+	return read(id, data, revision, &stored);
+}
+
+void MockMapBackend::fetch(const std::vector<map_tile_t*> &tiles)
+{
+	std::vector<map_tile_t*> pending;
+	uint32_t stored = 0;
+
+	if (tiles.empty()) return;
+
+	// one multi-get for the revisions
+	roundTrip();
+	{
+		MutexLock lock(&store->mutex);
+		for (std::vector<map_tile_t*>::const_iterator i = tiles.begin(); i != tiles.end(); ++i)
+		{
+			std::map<map_tile_id_t, MockMapStore::mock_tile_t>::const_iterator j = store->tiles.find((*i)->id);
+			if (j != store->tiles.end() && j->second.revision > (*i)->revision)
+				pending.push_back(*i);
+			else
+				(*i)->stale = false;
+		}
+	}
+	if (pending.empty()) return;
+
+	// and another one for the tiles that have changed
+	roundTrip();
+	for (std::vector<map_tile_t*>::const_iterator i = pending.begin(); i != pending.end(); ++i)
+	{
+		if (read((*i)->id, (*i)->buffer, &(*i)->revision, &stored))
+			(*i)->data = (*i)->buffer;
+		(*i)->stale = false;
+	}
+}
+
+bool MockMapBackend::checkout(const map_tile_id_t &id, map_data_t *data, uint32_t *revision, uint64_t *cas)
+{
+	uint32_t stored = 0;
+	bool loaded = false;
+
+	roundTrip();
+	loaded = read(id, data, revision, &stored);
+	*cas = stored;
+	return loaded;
+}
+
+int MockMapBackend::save(const map_tile_id_t &id, const map_data_t *data, uint32_t *revision, uint64_t cas)
+{
+	return patch(id, data, 0, store->tile_length * map_channel_width(id.channel), revision, cas);
+}
+
+int MockMapBackend::patch(const map_tile_id_t &id, const map_data_t *data, uint32_t begin, uint32_t end, uint32_t *revision, uint64_t cas)
+{
+	// cas or add, then the revision hint
+	roundTrip();
+	{
+		MutexLock lock(&store->mutex);
+		std::map<map_tile_id_t, MockMapStore::mock_tile_t>::iterator i = store->tiles.find(id);
+
+		// someone else was faster
+		if (cas ? (i == store->tiles.end() || i->second.revision != cas) : (i != store->tiles.end()))
+			return 1;
+
+		if (i == store->tiles.end())
+		{
+			MockMapStore::mock_tile_t tile = { new map_data_t[store->tile_length * map_channel_width(id.channel)], 0 };
+			i = store->tiles.insert(std::make_pair(id, tile)).first;
+			store->order.push_back(id);
+
+			// a new tile goes in as a whole
+			begin = 0;
+			end = store->tile_length * map_channel_width(id.channel);
+		}
+		if (begin < end)
+		{
+			memcpy(i->second.data + begin, data + begin, sizeof(map_data_t) * (end - begin));
+			bytes_saved += sizeof(map_data_t) * (end - begin);
+		}
+		i->second.revision = *revision + 1;
+		*revision = i->second.revision;
+	}
+	roundTrip();
+
+	// new tiles are appended to the list
+	if (*revision == 1) roundTrip();
+	return 0;
+}
+
+void MockMapBackend::list(uint64_t *cursor, std::vector<map_tile_id_t> &output)
+{
+	roundTrip();
+
+	MutexLock lock(&store->mutex);
+	for (; *cursor < store->order.size(); (*cursor)++)
+		output.push_back(store->order[*cursor]);
+}
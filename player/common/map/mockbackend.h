@@ -0,0 +1,68 @@
+#ifndef AMOS_COMMON_MAP_MOCKBACKEND_H
+#define AMOS_COMMON_MAP_MOCKBACKEND_H
+
+#include <map>
+
+#include "backend.h"
+#include "thread/mutex.h"
+
+namespace amos
+{
+	// tiles held in memory, stands in for the memcached servers so that maps can be
+	// exercised without any, must outlive all backends that use it
+	class MockMapStore
+	{
+	public:
+		MockMapStore(const map_info_t &info);
+		virtual ~MockMapStore();
+
+		map_info_t getInfo() const { return info; }
+
+	protected:
+		typedef struct mock_tile
+		{
+			map_data_t *data;
+			uint32_t revision;
+		} mock_tile_t;
+
+		map_info_t info;
+		uint32_t tile_length;
+		std::map<map_tile_id_t, mock_tile_t> tiles;
+		std::vector<map_tile_id_t> order; // tiles in the order they were added
+		Mutex mutex;
+
+		friend class MockMapBackend;
+	};
+
+	// behaves like the memcached backend, including the number of round trips,
+	// each of which takes latency microseconds
+	class MockMapBackend : public MapBackend
+	{
+	public:
+		MockMapBackend(MockMapStore *store, uint32_t latency = 0);
+		virtual ~MockMapBackend();
+
+		virtual bool isOpen() const { return store; }
+		virtual map_info_t getInfo() const { return store->getInfo(); }
+		virtual MapBackend* clone() const;
+
+		virtual bool load(const map_tile_id_t &id, map_data_t *data, uint32_t *revision);
+		virtual void fetch(const std::vector<map_tile_t*> &tiles);
+		virtual bool checkout(const map_tile_id_t &id, map_data_t *data, uint32_t *revision, uint64_t *cas);
+		virtual int save(const map_tile_id_t &id, const map_data_t *data, uint32_t *revision, uint64_t cas);
+		virtual int patch(const map_tile_id_t &id, const map_data_t *data, uint32_t begin, uint32_t end, uint32_t *revision, uint64_t cas);
+		virtual void list(uint64_t *cursor, std::vector<map_tile_id_t> &list);
+
+		uint32_t getRoundTrips() const { return round_trips; }
+
+	protected:
+		virtual void roundTrip();
+		virtual bool read(const map_tile_id_t &id, map_data_t *data, uint32_t *revision, uint32_t *stored);
+
+		MockMapStore *store;
+		uint32_t latency;
+		uint32_t round_trips;
+	};
+}
+
+#endif // AMOS_COMMON_MAP_MOCKBACKEND_H
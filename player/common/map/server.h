@@ -0,0 +1,65 @@
+#ifndef AMOS_COMMON_MAP_SERVER_H
+#define AMOS_COMMON_MAP_SERVER_H
+
+#include "type.h"
+#include <stdint.h>
+
+// protocol between ServerMapBackend and amosmapserver, which owns the tiles in memory,
+// every message is a header followed by length bytes, a request is answered with a message
+// of the same type, tile data and changes are sent as plain map_data_t in host byte order
+
+#define MAPSERVER_PORT				11311
+
+#define MAPSERVER_INFO				((uint32_t)'i') // reply: map_info_t
+#define MAPSERVER_LOAD				((uint32_t)'l') // mapserver_tile_t, reply: mapserver_tile_t and the data if it is newer
+#define MAPSERVER_SAVE				((uint32_t)'s') // mapserver_save_t and the values, reply: mapserver_result_t
+#define MAPSERVER_APPLY				((uint32_t)'a') // mapserver_apply_t and the changes, reply: mapserver_result_t and maybe the data
+#define MAPSERVER_LIST				((uint32_t)'n') // uint64_t cursor, reply: the new cursor and map_tile_id_t for each new tile
+#define MAPSERVER_SUBSCRIBE			((uint32_t)'w') // no reply, the server sends MAPSERVER_NOTIFY from now on
+#define MAPSERVER_NOTIFY			((uint32_t)'c') // sent by the server only, mapserver_tile_t of a tile that has changed
+
+// larger messages are taken as garbage and the connection is dropped
+#define MAPSERVER_MESSAGE_MAX		(64u << 20)
+
+typedef struct mapserver_header
+{
+	uint32_t type;
+	uint32_t length; // of what follows
+} mapserver_header_t;
+
+typedef struct mapserver_tile
+{
+	map_tile_id_t id;
+	uint32_t revision; // 0 if the tile does not exist
+} mapserver_tile_t;
+
+// values from begin to end follow, they are only stored if the tile is still at revision cas,
+// 0 for a tile that does not exist yet
+typedef struct mapserver_save
+{
+	map_tile_id_t id;
+	uint32_t begin, end;
+	uint64_t cas;
+} mapserver_save_t;
+
+// multiplication from begin to end follows, then addition, the server applies them
+// to whatever it has, so they never conflict, missing tiles start from the channel default,
+// changes a client sends again because it lost the reply are only applied the first time
+typedef struct mapserver_apply
+{
+	map_tile_id_t id;
+	uint32_t revision; // the revision the changes were made on
+	uint32_t begin, end;
+	uint32_t sequence; // goes up by one with every new set of changes from the client
+	uint64_t client; // picked at random by the client, and kept across connections
+} mapserver_apply_t;
+
+// status is 0 on success, 1 on conflict, -1 on error, an apply reply is followed by the whole tile
+// if someone else has changed it since the revision the changes were made on
+typedef struct mapserver_result
+{
+	int32_t status;
+	uint32_t revision;
+} mapserver_result_t;
+
+#endif // AMOS_COMMON_MAP_SERVER_H
@@ -0,0 +1,482 @@
+#include "serverbackend.h"
+
+#include <string.h>
+#include <algorithm>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/time.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define SERVERMAP_RECONNECT_DELAY 1 // seconds between attempts to reach a server that went away
+
+using namespace amos;
+
+ServerMapBackend::ServerMapBackend(const std::string &host, uint16_t port) : MapBackend(), host(host), port(port), tile_length(0), fd(-1), subscribed(true), resync(false), retry(0), client(0), sequence(0)
+{
+	memset(&info, 0, sizeof(map_info_t));
+	identify();
+	connect(subscribed);
+}
+
+ServerMapBackend::ServerMapBackend(const std::string &host, uint16_t port, bool subscribe) : MapBackend(), host(host), port(port), tile_length(0), fd(-1), subscribed(subscribe), resync(false), retry(0), client(0), sequence(0)
+{
+	memset(&info, 0, sizeof(map_info_t));
+	identify();
+	connect(subscribed);
+}
+
+ServerMapBackend::~ServerMapBackend()
+{
+	// one last go at getting lost changes to the server
+	if (!unresolved.empty())
+	{
+		retry = 0;
+		if (!reconnect())
+			fprintf(stderr, "servermap: error: changes to a tile may not have reached %s:%u\n", host.c_str(), port);
+	}
+	close();
+}
+
+void ServerMapBackend::identify()
+{
+	struct timeval now;
+	int random = -1;
+
+	// every backend is a client of its own, clones included
+	random = ::open("/dev/urandom", O_RDONLY);
+	if (random < 0 || ::read(random, &client, sizeof(client)) != sizeof(client))
+	{
+		gettimeofday(&now, 0);
+		client = ((uint64_t)getpid() << 32) ^ ((uint64_t)now.tv_sec << 20) ^ (uint64_t)now.tv_usec ^ (uint64_t)(uintptr_t)this;
+	}
+	if (random >= 0) ::close(random);
+}
+
+MapBackend* ServerMapBackend::clone() const
+{
+	return new ServerMapBackend(host, port, false);
+}
+
+bool ServerMapBackend::connect(bool subscribe)
+{
+	struct addrinfo hints, *addresses = 0;
+	char service[16];
+	int flag = 1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	snprintf(service, sizeof(service), "%u", port);
+	if (getaddrinfo(host.c_str(), service, &hints, &addresses) || !addresses)
+	{
+		fprintf(stderr, "servermap: error: unable to resolve %s\n", host.c_str());
+		goto error;
+	}
+
+	for (struct addrinfo *i = addresses; i && fd < 0; i = i->ai_next)
+	{
+		fd = socket(i->ai_family, i->ai_socktype, i->ai_protocol);
+		if (fd < 0) continue;
+		if (::connect(fd, i->ai_addr, i->ai_addrlen) == 0) break;
+		::close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(addresses);
+	addresses = 0;
+	if (fd < 0)
+	{
+		fprintf(stderr, "servermap: error: unable to connect to %s:%u: %s\n", host.c_str(), port, strerror(errno));
+		goto error;
+	}
+
+	// requests are small and every one of them waits for its reply
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+
+	// now find out what map the server has
+	if (!send(MAPSERVER_INFO, 0, 0) || !receive(MAPSERVER_INFO))
+		goto error;
+	if (reply.size() != sizeof(map_info_t))
+		goto error;
+	memcpy(&info, &reply[0], sizeof(map_info_t));
+
+	// a little sanity check
+	if (info.scale <= 0.0)
+		goto error;
+
+	tile_length = info.tile_width * info.tile_height * info.tile_depth;
+
+	if (subscribe && !send(MAPSERVER_SUBSCRIBE, 0, 0))
+		goto error;
+	return true;
+
+error:
+	if (addresses)
+	{
+		freeaddrinfo(addresses);
+		addresses = 0;
+	}
+	close();
+	return false;
+}
+
+bool ServerMapBackend::reconnect()
+{
+	if (fd >= 0) return true;
+
+	// do not hammer a server that is down with a connect for every request
+	if (time(0) < retry) return false;
+	retry = time(0) + SERVERMAP_RECONNECT_DELAY;
+	if (!connect(subscribed))
+		return false;
+
+	// whatever the server told about while we were gone is lost, so nothing cached can be trusted
+	fprintf(stderr, "servermap: reconnected to %s:%u\n", host.c_str(), port);
+	changed.clear();
+	resynced.clear();
+	resync = subscribed;
+	return resend();
+}
+
+bool ServerMapBackend::resend()
+{
+	// the server knows the changes by their sequence and only applies them if it has not already,
+	// the tile in the reply is of no use, it is loaded again anyway since its revision has moved on
+	if (unresolved.empty()) return true;
+	if (!send(0, &unresolved[0], unresolved.size()) || !receive(MAPSERVER_APPLY))
+		return false;
+	unresolved.clear();
+	return true;
+}
+
+void ServerMapBackend::close()
+{
+	if (fd >= 0)
+	{
+		::close(fd);
+		fd = -1;
+	}
+}
+
+bool ServerMapBackend::load(const map_tile_id_t &id, map_data_t *data, uint32_t *revision)
+{
+	mapserver_tile_t request = { id, *revision };
+
+	if (!reconnect()) return false;
+
+	if (!send(MAPSERVER_LOAD, &request, sizeof(request)) || !receive(MAPSERVER_LOAD))
+		return false;
+	return unpack(id, data, revision);
+}
+
+void ServerMapBackend::fetch(const std::vector<map_tile_t*> &tiles)
+{
+	std::vector<map_tile_t*> pending;
+	std::vector<uint8_t> requests;
+
+	if (!reconnect()) return;
+
+	// a cached tile the server has not told us about since we loaded it is up to date,
+	// unless the connection was lost since, then it is asked about once more,
+	// the server only sends data if its revision has moved on
+	drain();
+	for (std::vector<map_tile_t*>::const_iterator i = tiles.begin(); i != tiles.end(); ++i)
+	{
+		std::map<map_tile_id_t, uint32_t>::const_iterator change = changed.find((*i)->id);
+		if (resync && !resynced.count((*i)->id))
+		{
+			pending.push_back(*i);
+			continue;
+		}
+		if ((*i)->revision && (change == changed.end() || change->second <= (*i)->revision))
+		{
+			(*i)->stale = false;
+			continue;
+		}
+		pending.push_back(*i);
+	}
+	if (pending.empty()) return;
+
+	// ask for all of them in one go, then take the replies in order
+	for (std::vector<map_tile_t*>::const_iterator i = pending.begin(); i != pending.end(); ++i)
+	{
+		const mapserver_header_t header = { MAPSERVER_LOAD, sizeof(mapserver_tile_t) };
+		const mapserver_tile_t request = { (*i)->id, (*i)->revision };
+		requests.insert(requests.end(), (const uint8_t*)&header, (const uint8_t*)&header + sizeof(header));
+		requests.insert(requests.end(), (const uint8_t*)&request, (const uint8_t*)&request + sizeof(request));
+	}
+	if (!send(0, &requests[0], requests.size()))
+		return;
+
+	for (std::vector<map_tile_t*>::const_iterator i = pending.begin(); i != pending.end(); ++i)
+	{
+		if (!receive(MAPSERVER_LOAD)) return;
+		if (unpack((*i)->id, (*i)->buffer, &(*i)->revision))
+			(*i)->data = (*i)->buffer;
+		(*i)->stale = false;
+	}
+}
+
+bool ServerMapBackend::checkout(const map_tile_id_t &id, map_data_t *data, uint32_t *revision, uint64_t *cas)
+{
+	mapserver_tile_t request = { id, *revision };
+	bool loaded = false;
+
+	*cas = 0;
+	if (!reconnect()) return false;
+
+	if (!send(MAPSERVER_LOAD, &request, sizeof(request)) || !receive(MAPSERVER_LOAD))
+		return false;
+	loaded = unpack(id, data, revision);
+
+	// revisions only ever go up, so the stored one does as a cas token
+	*cas = ((const mapserver_tile_t*)&reply[0])->revision;
+	return loaded;
+}
+
+int ServerMapBackend::save(const map_tile_id_t &id, const map_data_t *data, uint32_t *revision, uint64_t cas)
+{
+	return patch(id, data, 0, tile_length * map_channel_width(id.channel), revision, cas);
+}
+
+int ServerMapBackend::patch(const map_tile_id_t &id, const map_data_t *data, uint32_t begin, uint32_t end, uint32_t *revision, uint64_t cas)
+{
+	const mapserver_save_t request = { id, begin, end, cas };
+	mapserver_result_t result;
+
+	if (!reconnect()) return -1;
+	if (begin > end) begin = end = 0;
+
+	if (!send(MAPSERVER_SAVE, &request, sizeof(request), data + begin, sizeof(map_data_t) * (end - begin)))
+		return -1;
+	if (!receive(MAPSERVER_SAVE) || reply.size() != sizeof(mapserver_result_t))
+		return -1;
+	bytes_saved += sizeof(map_data_t) * (end - begin);
+
+	memcpy(&result, &reply[0], sizeof(result));
+	if (result.status == 0) *revision = result.revision;
+	return result.status;
+}
+
+int ServerMapBackend::apply(const map_tile_id_t &id, const map_data_t *multiplication, const map_data_t *addition, uint32_t begin, uint32_t end, map_data_t *data, uint32_t *revision)
+{
+	const uint32_t length = tile_length * map_channel_width(id.channel);
+	std::vector<map_data_t> unset;
+	mapserver_result_t result;
+
+	if (!reconnect()) return -1;
+	if (begin > end) begin = end = 0;
+	const mapserver_apply_t request = { id, *revision, begin, end, ++sequence, client };
+	const mapserver_header_t header = { MAPSERVER_APPLY, (uint32_t)(sizeof(request) + 2 * sizeof(map_data_t) * (end - begin)) };
+
+	// changes that are not there are no change at all
+	if (!multiplication || !addition)
+	{
+		unset.resize(2 * (end - begin) + 1, 0.0f);
+		std::fill(unset.begin(), unset.begin() + (end - begin), 1.0f);
+	}
+
+	const map_data_t *m = multiplication ? multiplication + begin : &unset[0];
+	const map_data_t *a = addition ? addition + begin : &unset[end - begin];
+	if (!send(MAPSERVER_APPLY, &request, sizeof(request), m, sizeof(map_data_t) * (end - begin), a, sizeof(map_data_t) * (end - begin)) ||
+		!receive(MAPSERVER_APPLY))
+	{
+		// the server may have applied them before the connection went, sending them again as new
+		// changes could apply them twice, so they are kept and sent as they are once it is back,
+		// as far as the map is concerned they are in
+		unresolved.clear();
+		unresolved.insert(unresolved.end(), (const uint8_t*)&header, (const uint8_t*)&header + sizeof(header));
+		unresolved.insert(unresolved.end(), (const uint8_t*)&request, (const uint8_t*)&request + sizeof(request));
+		unresolved.insert(unresolved.end(), (const uint8_t*)m, (const uint8_t*)(m + (end - begin)));
+		unresolved.insert(unresolved.end(), (const uint8_t*)a, (const uint8_t*)(a + (end - begin)));
+		bytes_saved += 2 * sizeof(map_data_t) * (end - begin);
+		return 0;
+	}
+	if (reply.size() < sizeof(mapserver_result_t))
+		return -1;
+	bytes_saved += 2 * sizeof(map_data_t) * (end - begin);
+
+	memcpy(&result, &reply[0], sizeof(result));
+	if (result.status) return result.status < 0 ? -1 : result.status;
+
+	// someone else got there first, the tile we have is missing their changes
+	if (reply.size() == sizeof(mapserver_result_t) + sizeof(map_data_t) * length)
+	{
+		memcpy(data, &reply[sizeof(mapserver_result_t)], sizeof(map_data_t) * length);
+		bytes_loaded += sizeof(map_data_t) * length;
+	}
+	else if (reply.size() != sizeof(mapserver_result_t))
+	{
+		return -1;
+	}
+
+	*revision = result.revision;
+	forget(id, result.revision);
+	return 0;
+}
+
+void ServerMapBackend::list(uint64_t *cursor, std::vector<map_tile_id_t> &list)
+{
+	if (!reconnect()) return;
+
+	if (!send(MAPSERVER_LIST, cursor, sizeof(uint64_t)) || !receive(MAPSERVER_LIST))
+		return;
+	if (reply.size() < sizeof(uint64_t) || (reply.size() - sizeof(uint64_t)) % sizeof(map_tile_id_t))
+		return;
+
+	memcpy(cursor, &reply[0], sizeof(uint64_t));
+	const map_tile_id_t *ids = (const map_tile_id_t*)&reply[sizeof(uint64_t)];
+	list.insert(list.end(), ids, ids + (reply.size() - sizeof(uint64_t)) / sizeof(map_tile_id_t));
+}
+
+bool ServerMapBackend::send(uint32_t type, const void *head, uint32_t head_size, const void *body, uint32_t body_size, const void *tail, uint32_t tail_size)
+{
+	const mapserver_header_t header = { type, head_size + body_size + tail_size };
+	struct iovec parts[4] = {
+		{ (void*)&header, sizeof(header) },
+		{ (void*)head, head_size },
+		{ (void*)body, body_size },
+		{ (void*)tail, tail_size },
+	};
+	struct msghdr message;
+
+	// a type of 0 sends head as it is, it already holds whole messages
+	memset(&message, 0, sizeof(message));
+	message.msg_iov = type ? parts : parts + 1;
+	message.msg_iovlen = type ? 4 : 1;
+
+	while (message.msg_iovlen)
+	{
+		ssize_t sent = sendmsg(fd, &message, MSG_NOSIGNAL);
+		if (sent < 0)
+		{
+			if (errno == EINTR) continue;
+			fprintf(stderr, "servermap: error: unable to send: %s\n", strerror(errno));
+			close();
+			return false;
+		}
+
+		// move past whatever went out
+		while (message.msg_iovlen && (size_t)sent >= message.msg_iov->iov_len)
+		{
+			sent -= message.msg_iov->iov_len;
+			message.msg_iov++;
+			message.msg_iovlen--;
+		}
+		if (message.msg_iovlen)
+		{
+			message.msg_iov->iov_base = (uint8_t*)message.msg_iov->iov_base + sent;
+			message.msg_iov->iov_len -= sent;
+		}
+	}
+	return true;
+}
+
+bool ServerMapBackend::receive(uint32_t type)
+{
+	mapserver_header_t header;
+
+	// notifications may come in ahead of the reply at any time
+	for (;;)
+	{
+		if (!read(&header, sizeof(header)))
+			return false;
+		if (header.length > MAPSERVER_MESSAGE_MAX)
+		{
+			fprintf(stderr, "servermap: error: message of %u bytes from the server\n", header.length);
+			close();
+			return false;
+		}
+
+		reply.resize(header.length);
+		if (header.length && !read(&reply[0], header.length))
+			return false;
+
+		if (header.type == MAPSERVER_NOTIFY && header.length == sizeof(mapserver_tile_t))
+		{
+			const mapserver_tile_t *notification = (const mapserver_tile_t*)&reply[0];
+			uint32_t &revision = changed[notification->id];
+			if (notification->revision > revision) revision = notification->revision;
+		}
+		else if (header.type != type)
+		{
+			fprintf(stderr, "servermap: error: unexpected message from the server\n");
+			close();
+			return false;
+		}
+
+		if (header.type == type)
+			return true;
+	}
+}
+
+bool ServerMapBackend::read(void *buffer, size_t size)
+{
+	uint8_t *output = (uint8_t*)buffer;
+
+	while (size)
+	{
+		ssize_t received = recv(fd, output, size, 0);
+		if (received < 0 && errno == EINTR) continue;
+		if (received <= 0)
+		{
+			fprintf(stderr, "servermap: error: connection to the server lost\n");
+			close();
+			return false;
+		}
+		output += received;
+		size -= received;
+	}
+	return true;
+}
+
+void ServerMapBackend::drain()
+{
+	struct pollfd event = { fd, POLLIN, 0 };
+
+	// only notifications can be waiting, there is no request out
+	while (fd >= 0 && poll(&event, 1, 0) > 0 && (event.revents & POLLIN))
+		if (!receive(MAPSERVER_NOTIFY)) return;
+}
+
+bool ServerMapBackend::unpack(const map_tile_id_t &id, map_data_t *data, uint32_t *revision)
+{
+	const uint32_t length = tile_length * map_channel_width(id.channel);
+	mapserver_tile_t tile;
+
+	if (reply.size() < sizeof(mapserver_tile_t))
+		return false;
+	memcpy(&tile, &reply[0], sizeof(tile));
+
+	forget(id, tile.revision);
+
+	// no data if we already have that revision
+	if (reply.size() == sizeof(mapserver_tile_t))
+		return false;
+	if (reply.size() != sizeof(mapserver_tile_t) + sizeof(map_data_t) * length)
+	{
+		fprintf(stderr, "servermap: load: tile (%i, %i, %i, %i) has the wrong size\n", id.channel, id.x, id.y, id.z);
+		return false;
+	}
+
+	memcpy(data, &reply[sizeof(mapserver_tile_t)], sizeof(map_data_t) * length);
+	*revision = tile.revision;
+	bytes_loaded += sizeof(map_data_t) * length;
+	return true;
+}
+
+void ServerMapBackend::forget(const map_tile_id_t &id, uint32_t revision)
+{
+	// whatever the server told about this tile before is covered by what we have now
+	if (resync) resynced.insert(id);
+	std::map<map_tile_id_t, uint32_t>::iterator change = changed.find(id);
+	if (change != changed.end() && change->second <= revision)
+		changed.erase(change);
+}
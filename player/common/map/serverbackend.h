@@ -0,0 +1,74 @@
+#ifndef AMOS_COMMON_MAP_SERVERBACKEND_H
+#define AMOS_COMMON_MAP_SERVERBACKEND_H
+
+#include <string>
+#include <map>
+#include <set>
+#include <vector>
+#include <time.h>
+
+#include "backend.h"
+#include "server.h"
+
+namespace amos
+{
+	// tiles are owned by amosmapserver, see server.h for the protocol, pending changes are sent
+	// as they are and applied by the server, so committing never has to load a tile first,
+	// the server tells about every tile that changes, so refreshing only loads those,
+	// changes whose reply is lost count as applied, they are sent again once the server is back
+	// and it makes sure they go in only once
+	class ServerMapBackend : public MapBackend
+	{
+	public:
+		ServerMapBackend(const std::string &host, uint16_t port = MAPSERVER_PORT);
+		virtual ~ServerMapBackend();
+
+		virtual bool isOpen() const { return fd >= 0; }
+		virtual map_info_t getInfo() const { return info; }
+		virtual MapBackend* clone() const;
+
+		virtual bool load(const map_tile_id_t &id, map_data_t *data, uint32_t *revision);
+		virtual void fetch(const std::vector<map_tile_t*> &tiles);
+		virtual bool checkout(const map_tile_id_t &id, map_data_t *data, uint32_t *revision, uint64_t *cas);
+		virtual int save(const map_tile_id_t &id, const map_data_t *data, uint32_t *revision, uint64_t cas);
+		virtual int patch(const map_tile_id_t &id, const map_data_t *data, uint32_t begin, uint32_t end, uint32_t *revision, uint64_t cas);
+		virtual int apply(const map_tile_id_t &id, const map_data_t *multiplication, const map_data_t *addition, uint32_t begin, uint32_t end, map_data_t *data, uint32_t *revision);
+		virtual void list(uint64_t *cursor, std::vector<map_tile_id_t> &list);
+
+	protected:
+		// clones only commit, so they do not ask for notifications
+		ServerMapBackend(const std::string &host, uint16_t port, bool subscribe);
+
+		virtual bool connect(bool subscribe);
+		virtual void identify();
+		virtual bool reconnect();
+		virtual bool resend();
+		virtual void close();
+
+		virtual bool send(uint32_t type, const void *head, uint32_t head_size, const void *body = 0, uint32_t body_size = 0, const void *tail = 0, uint32_t tail_size = 0);
+		virtual bool receive(uint32_t type);
+		virtual bool read(void *buffer, size_t size);
+		virtual void drain();
+		virtual bool unpack(const map_tile_id_t &id, map_data_t *data, uint32_t *revision);
+		virtual void forget(const map_tile_id_t &id, uint32_t revision);
+
+		std::string host;
+		uint16_t port;
+
+		map_info_t info;
+		uint32_t tile_length;
+
+		int fd;
+		bool subscribed;
+		bool resync; // notifications were lost while the connection was down, so cached tiles have to be asked about
+		time_t retry; // when to try reaching the server again after losing it
+		uint64_t client; // tells the server who the changes are from
+		uint32_t sequence; // of the last changes sent
+		std::vector<uint8_t> unresolved; // changes the server may not have got, sent again before anything else
+		std::vector<uint8_t> reply; // payload of the last reply
+		std::map<map_tile_id_t, uint32_t> changed; // newest revision the server has told about, by tile
+		std::set<map_tile_id_t> resynced; // tiles the server has told about since the connection came back
+	};
+}
+
+#endif // AMOS_COMMON_MAP_SERVERBACKEND_H
@@ -0,0 +1,551 @@
+#include "shmbackend.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "define.h"
+#include "memcachedbackend.h"
+
+#define SHMMAP_MAGIC 0x534f4d41 // "AMOS"
+#define SHMMAP_ALIGNMENT 64 // keep tiles on their own cache lines
+#define SHMMAP_OPEN_ATTEMPTS 100 // how long to wait for the creator to initialize the segment, in 10ms steps
+#define SHMMAP_SPIN_LIMIT 1000 // spins on a locked tile before checking that its writer is still alive
+#define SHMMAP_SPIN_DELAY 1000 // microseconds to sleep between spins after that
+
+#define SHMMAP_ALIGN(size) (((size) + SHMMAP_ALIGNMENT - 1) & ~((size_t)SHMMAP_ALIGNMENT - 1))
+
+// the segment starts with this header, followed by the tile index and the tile slots
+typedef struct shmmap_header
+{
+	volatile uint32_t magic; // set last, once the segment is initialized
+	map_info_t info;
+	uint32_t capacity; // number of tile slots
+	uint32_t index_size; // number of index entries, a power of two
+	volatile uint32_t count; // number of tile slots in use
+	volatile uint32_t users; // backends attached, the last one to leave removes the segment
+	pthread_mutex_t mutex; // serializes slot allocation, nothing else, robust against its owner dying
+} shmmap_header_t;
+
+// entries are never removed, so readers can probe the index without locking
+typedef struct shmmap_entry
+{
+	map_tile_id_t id;
+	volatile uint32_t slot; // tile slot plus one, 0 while the entry is empty
+} shmmap_entry_t;
+
+// every tile slot starts with its seqlock, tile data follows at SHMMAP_SLOT_DATA_OFFSET
+typedef struct shmmap_slot
+{
+	volatile uint32_t sequence; // odd while the tile is being written
+	volatile uint32_t revision; // 0 until the tile is saved for the first time
+	map_tile_id_t id; // slots are allocated in order, so they double as the list of tiles
+	volatile pid_t writer; // process holding the write side, claimed before the sequence goes odd, 0 if none
+} shmmap_slot_t;
+
+#define SHMMAP_INDEX_OFFSET SHMMAP_ALIGN(sizeof(shmmap_header_t))
+#define SHMMAP_SLOTS_OFFSET(index_size) (SHMMAP_INDEX_OFFSET + SHMMAP_ALIGN((size_t)(index_size) * sizeof(shmmap_entry_t)))
+#define SHMMAP_SLOT_DATA_OFFSET SHMMAP_ALIGN(sizeof(shmmap_slot_t))
+// every slot has room for the widest channel group, the segment is sparse,
+// so the unused tail of a narrower tile is never backed by memory
+#define SHMMAP_SLOT_SIZE(tile_size) (SHMMAP_SLOT_DATA_OFFSET + SHMMAP_ALIGN((size_t)(tile_size) * MAP_CHANNEL_WIDTH_MAX))
+
+using namespace amos;
+
+ShmMapBackend::ShmMapBackend(const std::string &name, const map_info_t &info, uint32_t capacity) : MapBackend(), name(name), tile_size(0), segment(0), segment_size(0), attached(false), pid(getpid()), full(false)
+{
+	memset(&this->info, 0, sizeof(map_info_t));
+
+	// somebody else might create the segment at the same time, in which case we open theirs
+	if (!open(name) && !create(name, info, capacity) && !open(name))
+	{
+		fprintf(stderr, "shmmap: error: unable to open %s\n", name.c_str());
+		return;
+	}
+
+	// all maps sharing a segment have to agree on the tile layout
+	if (this->info.scale != info.scale ||
+		this->info.tile_width != info.tile_width ||
+		this->info.tile_height != info.tile_height ||
+		this->info.tile_depth != info.tile_depth)
+	{
+		fprintf(stderr, "shmmap: error: %s holds a different map\n", name.c_str());
+		close();
+	}
+}
+
+ShmMapBackend::ShmMapBackend(const std::string &name, const std::vector< std::pair<std::string, uint16_t> > &servers, uint32_t capacity) : MapBackend(), name(name), tile_size(0), segment(0), segment_size(0), attached(false), pid(getpid()), full(false)
+{
+	memset(&info, 0, sizeof(map_info_t));
+
+	if (open(name)) return;
+
+	// only the first one needs to know what the map looks like
+	MemcachedMapBackend seed(servers);
+	if (seed.isOpen() && !create(name, seed.getInfo(), capacity))
+		open(name);
+
+	if (!segment)
+		fprintf(stderr, "shmmap: error: unable to open %s\n", name.c_str());
+}
+
+ShmMapBackend::~ShmMapBackend()
+{
+	close();
+}
+
+MapBackend* ShmMapBackend::clone() const
+{
+	// seqlocks make the segment safe to share, another mapping is all it takes
+	return new ShmMapBackend(name, info, segment ? ((shmmap_header_t*)segment)->capacity : 0);
+}
+
+bool ShmMapBackend::open(const std::string &name)
+{
+	shmmap_header_t *header = 0;
+	struct stat st;
+	uint32_t users = 0;
+	int fd = -1;
+	int attempt = 0;
+
+	fd = shm_open(name.c_str(), O_RDWR, 0);
+	if (fd < 0)
+	{
+		// not created yet
+		if (errno == ENOENT) return false;
+		goto error;
+	}
+
+	// the creator sizes the segment before initializing it
+	for (attempt = 0; attempt < SHMMAP_OPEN_ATTEMPTS; attempt++)
+	{
+		if (fstat(fd, &st) < 0)
+			goto error;
+		if ((size_t)st.st_size >= sizeof(shmmap_header_t))
+			break;
+		usleep(10000);
+	}
+	if ((size_t)st.st_size < sizeof(shmmap_header_t))
+		goto error;
+
+	segment = (uint8_t*)mmap(0, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (segment == MAP_FAILED)
+	{
+		segment = 0;
+		goto error;
+	}
+	segment_size = st.st_size;
+	::close(fd);
+	fd = -1;
+
+	header = (shmmap_header_t*)segment;
+	for (attempt = 0; attempt < SHMMAP_OPEN_ATTEMPTS && header->magic != SHMMAP_MAGIC; attempt++)
+		usleep(10000);
+	if (header->magic != SHMMAP_MAGIC)
+	{
+		fprintf(stderr, "shmmap: open: %s is not initialized\n", name.c_str());
+		close();
+		return false;
+	}
+	__sync_synchronize();
+
+	info = header->info;
+	tile_size = sizeof(map_data_t) * info.tile_width * info.tile_height * info.tile_depth;
+	if (segment_size < SHMMAP_SLOTS_OFFSET(header->index_size) + (size_t)header->capacity * SHMMAP_SLOT_SIZE(tile_size))
+	{
+		fprintf(stderr, "shmmap: open: %s is truncated\n", name.c_str());
+		close();
+		return false;
+	}
+
+	// a segment nobody is attached to any more is on its way out, the map it held is gone with it
+	do
+	{
+		users = header->users;
+	}
+	while (users && !__sync_bool_compare_and_swap(&header->users, users, users + 1));
+	if (!users)
+	{
+		fprintf(stderr, "shmmap: open: %s is being removed\n", name.c_str());
+		close();
+		return false;
+	}
+	attached = true;
+	return true;
+
+error:
+	fprintf(stderr, "shmmap: open: error: %s\n", strerror(errno));
+
+	if (fd >= 0)
+	{
+		::close(fd);
+		fd = -1;
+	}
+	close();
+	return false;
+}
+
+bool ShmMapBackend::create(const std::string &name, const map_info_t &info, uint32_t capacity)
+{
+	shmmap_header_t *header = 0;
+	pthread_mutexattr_t attr;
+	uint32_t index_size = 16;
+	size_t size = 0;
+	int fd = -1;
+
+	if (info.scale <= 0.0 || !capacity) return false;
+
+	// size the index so that the load factor stays below one half
+	while (index_size < capacity + capacity) index_size <<= 1;
+	tile_size = sizeof(map_data_t) * info.tile_width * info.tile_height * info.tile_depth;
+	size = SHMMAP_SLOTS_OFFSET(index_size) + (size_t)capacity * SHMMAP_SLOT_SIZE(tile_size);
+
+	fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0666);
+	if (fd < 0)
+	{
+		// somebody else was faster
+		if (errno == EEXIST) return false;
+		goto error;
+	}
+
+	// pages are only backed by memory once tiles are written to them
+	if (ftruncate(fd, size) < 0)
+		goto error;
+
+	segment = (uint8_t*)mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (segment == MAP_FAILED)
+	{
+		segment = 0;
+		goto error;
+	}
+	segment_size = size;
+	::close(fd);
+	fd = -1;
+
+	// the segment comes zeroed, so all index entries and slots are empty already
+	header = (shmmap_header_t*)segment;
+	header->info = info;
+	header->capacity = capacity;
+	header->index_size = index_size;
+	header->count = 0;
+	header->users = 1;
+	attached = true;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	pthread_mutex_init(&header->mutex, &attr);
+	pthread_mutexattr_destroy(&attr);
+
+	// now let others in
+	__sync_synchronize();
+	header->magic = SHMMAP_MAGIC;
+
+	this->info = info;
+	return true;
+
+error:
+	fprintf(stderr, "shmmap: create: error: %s\n", strerror(errno));
+
+	if (fd >= 0)
+	{
+		::close(fd);
+		fd = -1;
+		shm_unlink(name.c_str());
+	}
+	close();
+	return false;
+}
+
+void ShmMapBackend::close()
+{
+	if (segment)
+	{
+		// the map only lives as long as someone uses it, a run that crashed leaves it behind though
+		if (attached && __sync_sub_and_fetch(&((shmmap_header_t*)segment)->users, 1) == 0)
+			shm_unlink(name.c_str());
+		munmap(segment, segment_size);
+		segment = 0;
+	}
+	segment_size = 0;
+	attached = false;
+}
+
+uint8_t* ShmMapBackend::find(const map_tile_id_t &id) const
+{
+	const shmmap_header_t *header = (const shmmap_header_t*)segment;
+	const shmmap_entry_t *index = (const shmmap_entry_t*)(segment + SHMMAP_INDEX_OFFSET);
+	const uint32_t mask = header->index_size - 1;
+
+	// linear probing, an empty entry ends the search
+	for (uint32_t i = map_tile_id_hash(id), n = 0; n <= mask; i++, n++)
+	{
+		const shmmap_entry_t *entry = &index[i & mask];
+		const uint32_t slot = entry->slot;
+		if (!slot) return 0;
+
+		// the id is written before the slot is published
+		__sync_synchronize();
+		if (entry->id == id)
+			return segment + SHMMAP_SLOTS_OFFSET(header->index_size) + (size_t)(slot - 1) * SHMMAP_SLOT_SIZE(tile_size);
+	}
+	return 0;
+}
+
+uint8_t* ShmMapBackend::allocate(const map_tile_id_t &id)
+{
+	shmmap_header_t *header = (shmmap_header_t*)segment;
+	shmmap_entry_t *index = (shmmap_entry_t*)(segment + SHMMAP_INDEX_OFFSET);
+	const uint32_t mask = header->index_size - 1;
+	uint8_t *slot = 0;
+	int rc = 0;
+
+	// a process that died while allocating leaves nothing half done, at worst a slot that is
+	// counted but never indexed, so the lock is simply taken over
+	rc = pthread_mutex_lock(&header->mutex);
+	if (rc == EOWNERDEAD)
+	{
+		fprintf(stderr, "shmmap: allocate: a process died while allocating a tile in %s, recovering\n", name.c_str());
+		pthread_mutex_consistent(&header->mutex);
+	}
+	else if (rc)
+	{
+		fprintf(stderr, "shmmap: allocate: error: %s\n", strerror(rc));
+		return 0;
+	}
+
+	// somebody else might have allocated it in the mean time
+	slot = find(id);
+	if (!slot && header->count < header->capacity)
+	{
+		uint32_t i = map_tile_id_hash(id);
+		while (index[i & mask].slot) i++;
+
+		shmmap_entry_t *entry = &index[i & mask];
+		slot = segment + SHMMAP_SLOTS_OFFSET(header->index_size) + (size_t)header->count * SHMMAP_SLOT_SIZE(tile_size);
+		((shmmap_slot_t*)slot)->id = id;
+		entry->id = id;
+		__sync_synchronize();
+		entry->slot = ++header->count;
+	}
+
+	pthread_mutex_unlock(&header->mutex);
+	return slot;
+}
+
+bool ShmMapBackend::read(uint8_t *slot, map_data_t *data, uint32_t *revision, uint32_t *stored)
+{
+	const shmmap_slot_t *lock = (const shmmap_slot_t*)slot;
+	uint32_t held = 0, spun = 0;
+	bool loaded = false;
+
+	for(;;)
+	{
+		const uint32_t sequence = lock->sequence;
+		__sync_synchronize();
+
+		// a writer is busy with this tile
+		if (sequence & 1)
+		{
+			spins++;
+			wait(slot, sequence, &held, &spun);
+			continue;
+		}
+
+		// only copy the tile if there is something new, revisions never go back,
+		// so once we have started copying, a retry copies again
+		*stored = lock->revision;
+		loaded = *stored > *revision;
+		if (loaded)
+			memcpy(data, slot + SHMMAP_SLOT_DATA_OFFSET, tile_size * map_channel_width(lock->id.channel));
+
+		// if nobody has written in the mean time, what we have is consistent
+		__sync_synchronize();
+		if (lock->sequence == sequence)
+			break;
+		spins++;
+	}
+
+	if (loaded)
+	{
+		*revision = *stored;
+		bytes_loaded += tile_size * map_channel_width(lock->id.channel);
+	}
+	return loaded;
+}
+
+void ShmMapBackend::wait(uint8_t *slot, uint32_t sequence, uint32_t *held, uint32_t *spun)
+{
+	shmmap_slot_t *lock = (shmmap_slot_t*)slot;
+
+	// count how long the tile has been held without anything happening
+	if (sequence != *held)
+	{
+		*held = sequence;
+		*spun = 0;
+	}
+	if (++*spun < SHMMAP_SPIN_LIMIT)
+	{
+		sched_yield();
+		return;
+	}
+	usleep(SHMMAP_SPIN_DELAY);
+
+	// a writer that died never lets go, so take the tile over from it, whoever gets there first
+	const pid_t writer = lock->writer;
+	if (!writer || writer == pid || kill(writer, 0) == 0 || errno != ESRCH)
+		return;
+	if (!__sync_bool_compare_and_swap(&lock->writer, writer, pid))
+		return;
+	fprintf(stderr, "shmmap: tile (%i, %i, %i, %i) was left locked by process %i, taking it over\n",
+		lock->id.channel, lock->id.x, lock->id.y, lock->id.z, writer);
+
+	// if it died half way through writing, whatever it got done is kept, a new revision makes others
+	// load it and committers merge again, a tile that was never saved stays that way and is written
+	// in full next time
+	const uint32_t current = lock->sequence;
+	if (current & 1)
+	{
+		if (lock->revision) lock->revision++;
+		__sync_synchronize();
+		lock->sequence = current + 1;
+	}
+	__sync_synchronize();
+	lock->writer = 0;
+}
+
+bool ShmMapBackend::load(const map_tile_id_t &id, map_data_t *data, uint32_t *revision)
+{
+	uint32_t stored = 0;
+
+	if (!segment) return false;
+
+	uint8_t *slot = find(id);
+	if (!slot) return false;
+	return read(slot, data, revision, &stored);
+}
+
+bool ShmMapBackend::checkout(const map_tile_id_t &id, map_data_t *data, uint32_t *revision, uint64_t *cas)
+{
+	uint32_t stored = 0;
+	bool loaded = false;
+
+	*cas = 0;
+	if (!segment) return false;
+
+	uint8_t *slot = find(id);
+	if (!slot) return false;
+
+	// the revision we have seen is all we need to detect others committing
+	loaded = read(slot, data, revision, &stored);
+	*cas = stored;
+	return loaded;
+}
+
+int ShmMapBackend::save(const map_tile_id_t &id, const map_data_t *data, uint32_t *revision, uint64_t cas)
+{
+	return patch(id, data, 0, tile_size * map_channel_width(id.channel) / sizeof(map_data_t), revision, cas);
+}
+
+int ShmMapBackend::patch(const map_tile_id_t &id, const map_data_t *data, uint32_t begin, uint32_t end, uint32_t *revision, uint64_t cas)
+{
+	if (!segment) return -1;
+
+	uint8_t *slot = find(id);
+	if (!slot) slot = allocate(id);
+	if (!slot)
+	{
+		// slots are never given back, so this is for good, say so once
+		if (!full)
+			fprintf(stderr, "shmmap: patch: %s is full with %u tiles, new tiles like (%i, %i, %i, %i) cannot be saved\n",
+				name.c_str(), ((shmmap_header_t*)segment)->capacity, id.channel, id.x, id.y, id.z);
+		full = true;
+		return -1;
+	}
+
+	// writers exclude each other by claiming the slot before they touch the seqlock,
+	// so whoever holds it is known the whole time, should it die
+	shmmap_slot_t *lock = (shmmap_slot_t*)slot;
+	uint32_t sequence = 0, held = 0, spun = 0;
+	while (!__sync_bool_compare_and_swap(&lock->writer, 0, pid))
+	{
+		spins++;
+		wait(slot, lock->sequence, &held, &spun);
+	}
+
+	// someone else was faster, nothing has changed so readers need not retry
+	if (lock->revision != cas)
+	{
+		__sync_synchronize();
+		lock->writer = 0;
+		return 1;
+	}
+
+	// take the write side of the seqlock
+	sequence = lock->sequence;
+	lock->sequence = sequence + 1;
+	__sync_synchronize();
+
+	// the slot holds exactly what data was merged on, so only the changed values need to go in,
+	// unless the tile is new
+	if (!cas)
+	{
+		memcpy(slot + SHMMAP_SLOT_DATA_OFFSET, data, tile_size * map_channel_width(id.channel));
+		bytes_saved += tile_size * map_channel_width(id.channel);
+	}
+	else if (begin < end)
+	{
+		memcpy(slot + SHMMAP_SLOT_DATA_OFFSET + sizeof(map_data_t) * begin, data + begin, sizeof(map_data_t) * (end - begin));
+		bytes_saved += sizeof(map_data_t) * (end - begin);
+	}
+	lock->revision = *revision + 1;
+	__sync_synchronize();
+	lock->sequence = sequence + 2;
+	__sync_synchronize();
+	lock->writer = 0;
+
+	*revision = *revision + 1;
+	return 0;
+}
+
+void ShmMapBackend::list(uint64_t *cursor, std::vector<map_tile_id_t> &output)
+{
+	if (!segment) return;
+
+	const shmmap_header_t *header = (const shmmap_header_t*)segment;
+	const uint32_t count = header->count;
+	__sync_synchronize();
+
+	const uint8_t *slots = segment + SHMMAP_SLOTS_OFFSET(header->index_size);
+	if (!*cursor) unsaved.clear();
+
+	// tiles that were still being saved for the first time are listed once they have been,
+	// a writer that died on one holds up that tile only
+	for (std::vector<uint32_t>::iterator i = unsaved.begin(); i != unsaved.end();)
+	{
+		const shmmap_slot_t *lock = (const shmmap_slot_t*)(slots + (size_t)*i * SHMMAP_SLOT_SIZE(tile_size));
+		if (!lock->revision)
+		{
+			++i;
+			continue;
+		}
+		output.push_back(lock->id);
+		i = unsaved.erase(i);
+	}
+
+	// the cursor is the next slot to look at
+	for (; *cursor < count; (*cursor)++)
+	{
+		const shmmap_slot_t *lock = (const shmmap_slot_t*)(slots + (size_t)*cursor * SHMMAP_SLOT_SIZE(tile_size));
+		if (!lock->revision)
+			unsaved.push_back(*cursor);
+		else
+			output.push_back(lock->id);
+	}
+}
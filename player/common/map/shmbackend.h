@@ -0,0 +1,61 @@
+#ifndef AMOS_COMMON_MAP_SHMBACKEND_H
+#define AMOS_COMMON_MAP_SHMBACKEND_H
+
+#include <string>
+#include <vector>
+#include <sys/types.h>
+
+#include "backend.h"
+
+namespace amos
+{
+	// tiles live in a POSIX shared memory segment, so that maps on the same host
+	// exchange tiles without going through a server, every tile is guarded by a seqlock
+	// and readers never block writers nor make a system call
+	//
+	// the segment goes away with the last backend attached to it, so a map lasts as long as the run,
+	// it holds at most capacity tiles and never drops one, saving new tiles fails once it is full
+	class ShmMapBackend : public MapBackend
+	{
+	public:
+		// opens the segment, or creates it with room for capacity tiles if it does not exist yet
+		ShmMapBackend(const std::string &name, const map_info_t &info, uint32_t capacity = 1024);
+		// same, but takes the map info from the memcached servers when creating the segment
+		ShmMapBackend(const std::string &name, const std::vector< std::pair<std::string, uint16_t> > &servers, uint32_t capacity = 1024);
+		virtual ~ShmMapBackend();
+
+		virtual bool isOpen() const { return segment; }
+		virtual map_info_t getInfo() const { return info; }
+		virtual MapBackend* clone() const;
+
+		virtual bool load(const map_tile_id_t &id, map_data_t *data, uint32_t *revision);
+		virtual bool checkout(const map_tile_id_t &id, map_data_t *data, uint32_t *revision, uint64_t *cas);
+		virtual int save(const map_tile_id_t &id, const map_data_t *data, uint32_t *revision, uint64_t cas);
+		virtual int patch(const map_tile_id_t &id, const map_data_t *data, uint32_t begin, uint32_t end, uint32_t *revision, uint64_t cas);
+		virtual void list(uint64_t *cursor, std::vector<map_tile_id_t> &list);
+
+	protected:
+		virtual bool open(const std::string &name);
+		virtual bool create(const std::string &name, const map_info_t &info, uint32_t capacity);
+		virtual void close();
+
+		virtual uint8_t* find(const map_tile_id_t &id) const;
+		virtual uint8_t* allocate(const map_tile_id_t &id);
+		virtual bool read(uint8_t *slot, map_data_t *data, uint32_t *revision, uint32_t *stored);
+		// back off while the tile is being written, and take it over from a writer that has died
+		virtual void wait(uint8_t *slot, uint32_t sequence, uint32_t *held, uint32_t *spun);
+
+		std::string name;
+		map_info_t info;
+		uint32_t tile_size;
+
+		uint8_t *segment;
+		size_t segment_size;
+		bool attached; // counted among the users of the segment
+		pid_t pid; // written into tiles we lock
+		bool full; // told about running out of slots already
+		std::vector<uint32_t> unsaved; // slots the list went past before their tile was first saved
+	};
+}
+
+#endif // AMOS_COMMON_MAP_SHMBACKEND_H
@@ -2,6 +2,12 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <math.h>
+
+#include "define.h"
+
+// log-odds of a cell that is certainly free or occupied, all other cells stay strictly within
+#define MAP_LOGODDS_CERTAIN 32767
 
 void map_tile_id_to_hex(const map_tile_id_t &id, uint8_t hex[sizeof(map_tile_id_t) + sizeof(map_tile_id_t)])
 {
@@ -12,6 +18,154 @@ void map_tile_id_to_hex(const map_tile_id_t &id, uint8_t hex[sizeof(map_tile_id_
 	memcpy(hex, buffer, sizeof(map_tile_id_t) + sizeof(map_tile_id_t));
 }
 
+uint32_t map_tile_id_hash(const map_tile_id_t &id)
+{
+	// mix each component with a large odd constant, tiles are clustered around the origin
+	uint32_t hash = id.channel * 0x9e3779b1u;
+	hash = (hash ^ (uint32_t)id.x) * 0x85ebca6bu;
+	hash = (hash ^ (uint32_t)id.y) * 0xc2b2ae35u;
+	hash = (hash ^ (uint32_t)id.z) * 0x27d4eb2fu;
+	return hash ^ (hash >> 16);
+}
+
+uint32_t map_channel_width(uint32_t channel)
+{
+	return ((uint8_t[])MAP_CHANNEL_WIDTHS)[MAP_CHANNEL_BASE(channel)];
+}
+
+uint32_t map_tile_wire_size(uint32_t channel, uint32_t length)
+{
+	switch (((uint8_t[])MAP_CHANNEL_TYPES)[MAP_CHANNEL_BASE(channel)])
+	{
+	case MAP_TYPE_UINT8: return sizeof(uint8_t) * length;
+	case MAP_TYPE_LOGODDS16: return sizeof(int16_t) * length;
+	default: return sizeof(map_data_t) * length;
+	}
+}
+
+void map_tile_encode(uint32_t channel, const map_data_t *data, uint32_t length, uint8_t *wire)
+{
+	int16_t logodds = 0;
+
+	switch (((uint8_t[])MAP_CHANNEL_TYPES)[MAP_CHANNEL_BASE(channel)])
+	{
+	case MAP_TYPE_UINT8:
+		for (uint32_t i = 0; i < length; i++)
+		{
+			// nan ends up as 0
+			const map_data_t value = data[i] * 255.0f + 0.5f;
+			wire[i] = value >= 255.0f ? 255 : value >= 1.0f ? (uint8_t)value : 0;
+		}
+		break;
+
+	case MAP_TYPE_LOGODDS16:
+		for (uint32_t i = 0; i < length; i++)
+		{
+			// certainty takes the end points, which are decoded as exactly 0 and 1
+			const double value = MAP_LOGODDS_SCALE * log(data[i] / (1.0 - data[i]));
+			if (data[i] >= 1.0f) logodds = MAP_LOGODDS_CERTAIN;
+			else if (!(data[i] > 0.0f)) logodds = -MAP_LOGODDS_CERTAIN;
+			else if (value >= MAP_LOGODDS_CERTAIN - 1) logodds = MAP_LOGODDS_CERTAIN - 1;
+			else if (value <= 1 - MAP_LOGODDS_CERTAIN) logodds = 1 - MAP_LOGODDS_CERTAIN;
+			else logodds = (int16_t)floor(value + 0.5);
+			memcpy(wire + sizeof(int16_t) * i, &logodds, sizeof(int16_t));
+		}
+		break;
+
+	default:
+		memcpy(wire, data, sizeof(map_data_t) * length);
+		break;
+	}
+}
+
+void map_tile_decode(uint32_t channel, const uint8_t *wire, uint32_t length, map_data_t *data)
+{
+	int16_t logodds = 0;
+
+	switch (((uint8_t[])MAP_CHANNEL_TYPES)[MAP_CHANNEL_BASE(channel)])
+	{
+	case MAP_TYPE_UINT8:
+		for (uint32_t i = 0; i < length; i++)
+			data[i] = wire[i] / 255.0f;
+		break;
+
+	case MAP_TYPE_LOGODDS16:
+		for (uint32_t i = 0; i < length; i++)
+		{
+			memcpy(&logodds, wire + sizeof(int16_t) * i, sizeof(int16_t));
+			if (logodds >= MAP_LOGODDS_CERTAIN) data[i] = 1.0f;
+			else if (logodds <= -MAP_LOGODDS_CERTAIN) data[i] = 0.0f;
+			else data[i] = 1.0 / (1.0 + exp(-logodds / (double)MAP_LOGODDS_SCALE));
+		}
+		break;
+
+	default:
+		memcpy(data, wire, sizeof(map_data_t) * length);
+		break;
+	}
+}
+
+void map_histogram_add(map_histogram_t *histogram, uint64_t value)
+{
+	uint32_t bucket = 0;
+
+	// bucket of the highest bit set, everything too large goes into the last one
+	while (bucket + 1 < MAP_HISTOGRAM_BUCKETS && value >> bucket)
+		bucket++;
+
+	histogram->buckets[bucket]++;
+	histogram->count++;
+	histogram->total += value;
+	if (value > histogram->max) histogram->max = value;
+}
+
+uint64_t map_histogram_percentile(const map_histogram_t &histogram, double fraction)
+{
+	uint64_t seen = 0;
+
+	if (!histogram.count) return 0;
+
+	for (uint32_t i = 0; i + 1 < MAP_HISTOGRAM_BUCKETS; i++)
+	{
+		seen += histogram.buckets[i];
+		if (seen >= fraction * histogram.count) return (uint64_t)1 << i;
+	}
+	return histogram.max;
+}
+
+static int map_histogram_format(const char *name, const map_histogram_t &histogram, char *buffer, size_t size)
+{
+	return snprintf(buffer, size, ", %s %llu avg %llu p50 <%llu p99 <%llu max %llu us", name,
+		(unsigned long long)histogram.count,
+		(unsigned long long)(histogram.count ? histogram.total / histogram.count : 0),
+		(unsigned long long)map_histogram_percentile(histogram, 0.5),
+		(unsigned long long)map_histogram_percentile(histogram, 0.99),
+		(unsigned long long)histogram.max);
+}
+
+void map_stats_format(const map_stats_t &stats, char *buffer, size_t size)
+{
+	int length = 0;
+
+	length = snprintf(buffer, size,
+		"hits %llu misses %llu stale %llu fetched %llu evicted %llu (%llu dirty) "
+		"commits %llu conflicts %llu retries %llu spins %llu loaded %llu kB saved %llu kB",
+		(unsigned long long)stats.hits, (unsigned long long)stats.misses,
+		(unsigned long long)stats.stale_reloads, (unsigned long long)stats.fetched,
+		(unsigned long long)stats.evictions, (unsigned long long)stats.dirty_evictions,
+		(unsigned long long)stats.commits, (unsigned long long)stats.conflicts,
+		(unsigned long long)stats.retries, (unsigned long long)stats.spins,
+		(unsigned long long)(stats.bytes_loaded >> 10), (unsigned long long)(stats.bytes_saved >> 10));
+
+	// the rest is cut off if it does not fit
+	if (length > 0 && (size_t)length < size)
+		length += map_histogram_format("load", stats.load_time, buffer + length, size - length);
+	if (length > 0 && (size_t)length < size)
+		length += map_histogram_format("commit", stats.commit_time, buffer + length, size - length);
+	if (length > 0 && (size_t)length < size)
+		length += map_histogram_format("wait", stats.wait_time, buffer + length, size - length);
+}
+
 bool operator<(const map_tile_id_t &a, const map_tile_id_t &b)
 {
 	if (a.channel != b.channel) return a.channel < b.channel;
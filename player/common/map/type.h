@@ -1,6 +1,7 @@
 #ifndef AMOS_COMMON_MAP_MAPTYPE_H
 #define AMOS_COMMON_MAP_MAPTYPE_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 typedef struct map_tile_id {
@@ -15,7 +16,77 @@ typedef struct map_info {
 
 typedef float map_data_t;
 
+// a cached tile, tile data, pending changes and revision are kept in one record
+// so that a cache hit costs a single hash lookup
+typedef struct map_tile
+{
+	map_tile_id_t id;
+	map_data_t *buffer; // tile data buffer from the pool, owned by this record
+	map_data_t *data; // tile data, points to buffer once the tile exists, null otherwise
+	map_data_t *multiplication; // pending changes, null if the tile is clean
+	map_data_t *addition;
+	uint32_t dirty_begin, dirty_end; // values with pending changes, the rest of the changes is unset
+	uint32_t revision; // revision of the tile data
+	bool stale; // tile data needs to be checked against the server
+	bool hot; // has been used again after it was first cached
+	struct map_tile *prev, *next; // 2Q list, see Map
+	struct map_tile *chain; // next tile in the same hash bucket, or next free record
+} map_tile_t;
+
+// the cells a ray crosses within one tile, see Map::trace()
+typedef struct map_ray_span
+{
+	map_tile_id_t id;
+	const uint32_t *cells; // value indices into the tile, in the order the ray crosses the cells
+	uint32_t count;
+	uint32_t first; // how many cells the ray has crossed before this tile
+	bool last; // the span ends with the last cell of the ray
+	map_data_t *data; // tile data, null if the tile does not exist and the ray only reads
+	map_data_t *multiplication, *addition; // pending changes, only set up if the ray writes
+} map_ray_span_t;
+
+// called for every tile along a ray, pointers are only valid during the call
+typedef void (*map_ray_callback_t)(void *context, const map_ray_span_t &span);
+
+// latencies in microseconds, bucket i counts samples below 2^i that do not fit in bucket i - 1
+#define MAP_HISTOGRAM_BUCKETS 32
+
+typedef struct map_histogram
+{
+	uint64_t count, total, max; // number of samples, their sum and the largest one
+	uint64_t buckets[MAP_HISTOGRAM_BUCKETS];
+} map_histogram_t;
+
+// what a map has been up to since it was created, see Map::stats()
+typedef struct map_stats
+{
+	uint64_t hits, misses; // tile accesses served from the cache, and those that had to load the tile
+	uint64_t stale_reloads; // cached tiles checked against the backend again after a refresh
+	uint64_t fetched; // tiles checked in batches by refresh and prefetch
+	uint64_t evictions, dirty_evictions; // tiles pushed out of the cache, and those committed on the way out
+	uint64_t commits, conflicts, retries; // tiles committed, and how often someone else committed them first
+	uint64_t spins; // times the backend found a tile locked by someone else and tried again
+	uint64_t bytes_loaded, bytes_saved; // tile data moved, in the size the backend stores it in
+	map_histogram_t load_time; // backend round trips that load tiles, one sample per batch
+	map_histogram_t commit_time; // committing a tile, all attempts included
+	map_histogram_t wait_time; // held up by the committer, its queue being full or our own changes still on the way
+} map_stats_t;
+
 void map_tile_id_to_hex(const map_tile_id_t &id, uint8_t hex[sizeof(map_tile_id_t) + sizeof(map_tile_id_t)]);
+uint32_t map_tile_id_hash(const map_tile_id_t &id);
+// values per cell, more than one for channel groups, see MAP_CHANNEL_WIDTHS
+uint32_t map_channel_width(uint32_t channel);
+// tiles are stored and sent in the compact type of their channel, see MAP_CHANNEL_TYPES
+uint32_t map_tile_wire_size(uint32_t channel, uint32_t length);
+void map_tile_encode(uint32_t channel, const map_data_t *data, uint32_t length, uint8_t *wire);
+void map_tile_decode(uint32_t channel, const uint8_t *wire, uint32_t length, map_data_t *data);
+
+void map_histogram_add(map_histogram_t *histogram, uint64_t value);
+// power of two that at least that fraction of the samples is below, 0 without samples
+uint64_t map_histogram_percentile(const map_histogram_t &histogram, double fraction);
+// statistics on a single line, for logging
+void map_stats_format(const map_stats_t &stats, char *buffer, size_t size);
+
 bool operator<(const map_tile_id_t &a, const map_tile_id_t &b);
 bool operator==(const map_tile_id_t &a, const map_tile_id_t &b);
 
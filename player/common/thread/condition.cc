@@ -0,0 +1,62 @@
+#include "condition.h"
+
+#include <errno.h>
+#include <time.h>
+
+using namespace amos;
+
+Condition::Condition()
+{
+	int rc;
+	rc = pthread_cond_init(&condition, 0);
+	assert(!rc);
+}
+
+Condition::~Condition()
+{
+	int rc;
+	rc = pthread_cond_destroy(&condition);
+	assert(!rc);
+}
+
+void Condition::wait(Mutex *mutex)
+{
+	int rc;
+	assert(mutex);
+	rc = pthread_cond_wait(&condition, &mutex->mutex);
+	assert(!rc);
+}
+
+bool Condition::wait(Mutex *mutex, double seconds)
+{
+	int rc;
+	struct timespec deadline;
+	assert(mutex);
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += (time_t)seconds;
+	deadline.tv_nsec += (long)((seconds - (time_t)seconds) * 1e9);
+	if (deadline.tv_nsec >= 1000000000L)
+	{
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	rc = pthread_cond_timedwait(&condition, &mutex->mutex, &deadline);
+	assert(!rc || rc == ETIMEDOUT);
+	return !rc;
+}
+
+void Condition::signal()
+{
+	int rc;
+	rc = pthread_cond_signal(&condition);
+	assert(!rc);
+}
+
+void Condition::broadcast()
+{
+	int rc;
+	rc = pthread_cond_broadcast(&condition);
+	assert(!rc);
+}
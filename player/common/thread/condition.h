@@ -0,0 +1,28 @@
+#ifndef CONDITION_H
+#define CONDITION_H
+
+#include <pthread.h>
+#include <assert.h>
+
+#include "mutex.h"
+
+namespace amos
+{
+	class Condition
+	{
+	public:
+		Condition();
+		virtual ~Condition();
+
+		// mutex has to be locked by the caller
+		virtual void wait(Mutex *mutex);
+		virtual bool wait(Mutex *mutex, double seconds); // false if nothing signaled in time
+		virtual void signal();
+		virtual void broadcast();
+
+	protected:
+		pthread_cond_t condition;
+	};
+}
+
+#endif
@@ -17,6 +17,8 @@ namespace amos
 
 	protected:
 		pthread_mutex_t mutex;
+
+		friend class Condition;
 	};
 	
 	class MutexLock
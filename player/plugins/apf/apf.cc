@@ -162,13 +162,13 @@ int APFDriver::ProcessMessage(QueuePointer &resp_queue, player_msghdr *hdr, void
 		if (!data) return -1;
 		if (!active) return 0;
 		player_laser_data_t *d = (player_laser_data_t*)data;
-		if (d->ranges_count != 361 || d->max_range != 8.0f)
+		if (!d->ranges_count || d->resolution <= 0.0f || d->max_range != 8.0f)
 		{
 			PLAYER_ERROR("apf: laser data format not supported.");
 			return -1;
 		}
 		
-		this->APF(d->ranges);
+		this->APF(beam_table(d->min_angle, d->resolution, d->ranges_count), d->ranges);
 		return 0;
 	}
 	else if(Message::MatchMessage(hdr, PLAYER_MSGTYPE_CMD, PLAYER_POSITION2D_CMD_POS, interface_position2d_addr))
@@ -221,41 +221,30 @@ int APFDriver::ProcessMessage(QueuePointer &resp_queue, player_msghdr *hdr, void
 	return -1;
 }
 
-void APFDriver::APF(const float *ranges)
+void APFDriver::APF(const beam_table_t *beams, const float *ranges)
 {
 	// static constants section
 	static const double speed_turn_e = exp(-SPEED_TURN_WEIGHT);
 	static const double speed_turn_d = 1.0 - speed_turn_e;
 	static const double speed_dist_d = exp(SPEED_DIST_WEIGHT) - 1.0;
 
-	static double laser_angle[361];
-	static bool init = false;
-	if (!init)
-	{
-		// build a table of laser tilt angle
-		for(int i = 0; i < 361; i++)
-		{
-			laser_angle[i] = DTOR((double)i * 0.5 - 90.0);
-		}
-		init = true;
-	}
-	
 	// laser force
-	uint16_t laser_force_count = 0;
+	uint32_t laser_force_count = 0;
 	double laser_force_x = 0.0, laser_force_y = 0.0;
 	float min_dist = std::numeric_limits<float>::infinity();
 
-	for(uint16_t i = 0; i < 361; i++)
+	// beam angles, cos and sin come from the table of the scan
+	for(uint32_t i = 0; i < beams->count; i++)
 	{
-		if (ranges[i] < LASER_RANGE && fabs(laser_angle[i]) < M_PI / 3.0)
+		if (ranges[i] < LASER_RANGE && fabs(beams->angles[i]) < M_PI / 3.0)
 		{
 			// calculate laser force
-			if (fabs(laser_angle[i]) < M_PI / 12.0 && ranges[i] < min_dist)
+			if (fabs(beams->angles[i]) < M_PI / 12.0 && ranges[i] < min_dist)
 				min_dist = ranges[i];
 
 			double force = 1.0 / ((ranges[i] + 0.00000001) / LASER_RANGE);
-			laser_force_y += sin(laser_angle[i]) * force;
-			laser_force_x += cos(laser_angle[i]) * force;
+			laser_force_y += beams->y[i] * force;
+			laser_force_x += beams->x[i] * force;
 			laser_force_count ++;
 		}
 	}
@@ -3,6 +3,8 @@
 
 #include <libplayercore/playercore.h>
 
+#include "beam/beam.h"
+
 namespace amos
 {
 	class APFDriver : public ThreadedDriver
@@ -16,7 +18,7 @@ namespace amos
 
 	protected:
 		virtual void Main();
-		virtual void APF(const float ranges[361]);
+		virtual void APF(const beam_table_t *beams, const float *ranges);
 
 		player_devaddr_t interface_position2d_addr;
 		player_pose2d_t goal;
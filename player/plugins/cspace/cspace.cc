@@ -2,6 +2,8 @@
 #include <unistd.h>
 #include <cmath>
 #include <cassert>
+#include "map/shmbackend.h"
+#include "map/serverbackend.h"
 
 using namespace amos;
 
@@ -29,6 +31,25 @@ CSpaceDriver::CSpaceDriver(ConfigFile* cf, int section) : ThreadedDriver(cf, sec
 		map_servers.push_back(make_pair(std::string("localhost"), (uint16_t)11211));
 	}
 
+	// drivers on the same host can share tiles through shared memory instead, it goes away once the last
+	// of them stops, whoever starts first sets mapshmtiles, the most tiles it will ever hold
+	map_shm = cf->ReadString(section, "mapshm", "");
+	map_shm_tiles = cf->ReadInt(section, "mapshmtiles", 1024);
+
+	// or go through a map server that applies changes itself, see amosmapserver
+	map_server = cf->ReadString(section, "mapserver", "");
+	map_server_port = cf->ReadInt(section, "mapserverport", MAPSERVER_PORT);
+
+	// memory for cached tiles in megabytes, including pending changes, 0 keeps the default
+	map_budget = cf->ReadInt(section, "mapbudget", 0);
+
+	// seconds between dumps of the map cache and backend statistics, 0 for none
+	map_stats = cf->ReadInt(section, "mapstats", 0);
+	map_stats_timestamp = time(NULL);
+
+	// number of coarser levels to keep up to date for planning and display, 0 keeps none
+	map_levels = cf->ReadInt(section, "maplevels", 0);
+
 	// set up the dummy opaque device
 	player_devaddr_t dummy_opaque_addr;
 	if (cf->ReadDeviceAddr(&dummy_opaque_addr, section, "provides", PLAYER_OPAQUE_CODE, -1, "dummy"))
@@ -55,7 +76,12 @@ int CSpaceDriver::MainSetup()
 {
 	PLAYER_MSG0(3, "cspace: setup started");
 
-	map = new Map(map_servers);
+	if (!map_server.empty())
+		map = new Map(new ServerMapBackend(map_server, map_server_port));
+	else if (map_shm.empty())
+		map = new Map(map_servers);
+	else
+		map = new Map(new ShmMapBackend(map_shm, map_servers, map_shm_tiles));
 	if (!map->isOpen())
 	{
 		delete map;
@@ -63,6 +89,8 @@ int CSpaceDriver::MainSetup()
 		PLAYER_ERROR("cspace: unable to create map");
 		return -1;
 	}
+	if (map_budget) map->setBudget((size_t)map_budget << 20);
+	map->setLevels(map_levels);
 
 	PLAYER_MSG0(3, "cspace: setup complete");
 
@@ -91,14 +119,27 @@ void CSpaceDriver::Main()
 		this->ProcessMessages();
 
 		map->refresh();
-		std::set<map_tile_id_t> tiles = map->list(true);
-		for (std::set<map_tile_id_t>::const_iterator i = tiles.begin(); i != tiles.end(); i++)
+
+		// only look at what has been added to the list since last time
+		std::vector<map_tile_id_t> added = map->listNew();
+		for (std::vector<map_tile_id_t>::const_iterator i = added.begin(); i != added.end(); i++)
 		{
-			if (i->channel != MAP_CHANNEL_P) continue;
-			this->ProcessTile(*i);
+			if (i->channel == MAP_CHANNEL_P) tiles.insert(*i);
 		}
+
+		for (std::set<map_tile_id_t>::const_iterator i = tiles.begin(); i != tiles.end(); i++)
+			this->ProcessTile(*i);
 		map->commit();
 
+		// dump what the map cache and its backend have been up to
+		if (map_stats && time(NULL) >= map_stats_timestamp + (time_t)map_stats)
+		{
+			char line[512];
+			map_stats_format(map->stats(), line, sizeof(line));
+			PLAYER_MSG1(1, "cspace: map %s", line);
+			map_stats_timestamp = time(NULL);
+		}
+
 		usleep(250000);
 	}
 }
@@ -113,37 +154,22 @@ int CSpaceDriver::ProcessTile(const map_tile_id_t &id)
 {
 	assert(id.channel == MAP_CHANNEL_P);
 
-	uint32_t revision_lt = 0, revision_mt = 0, revision_rt = 0,
-			 revision_lm = 0, revision_mm = 0, revision_rm = 0,
-			 revision_lb = 0, revision_mb = 0, revision_rb = 0;
-
-	// retrieve relevant tiles
-	const map_data_t *tile_lt = map->get((map_tile_id_t) { MAP_CHANNEL_P, id.x - 1,	id.y + 1,	id.z }, &revision_lt);
-	const map_data_t *tile_mt = map->get((map_tile_id_t) { MAP_CHANNEL_P, id.x,		id.y + 1,	id.z }, &revision_mt);
-	const map_data_t *tile_rt = map->get((map_tile_id_t) { MAP_CHANNEL_P, id.x + 1,	id.y + 1,	id.z }, &revision_rt);
-	const map_data_t *tile_lm = map->get((map_tile_id_t) { MAP_CHANNEL_P, id.x - 1,	id.y,		id.z }, &revision_lm);
-	const map_data_t *tile_mm = map->get((map_tile_id_t) { MAP_CHANNEL_P, id.x,		id.y,		id.z }, &revision_mm);
-	const map_data_t *tile_rm = map->get((map_tile_id_t) { MAP_CHANNEL_P, id.x + 1,	id.y,		id.z }, &revision_rm);
-	const map_data_t *tile_lb = map->get((map_tile_id_t) { MAP_CHANNEL_P, id.x - 1,	id.y - 1,	id.z }, &revision_lb);
-	const map_data_t *tile_mb = map->get((map_tile_id_t) { MAP_CHANNEL_P, id.x,		id.y - 1,	id.z }, &revision_mb);
-	const map_data_t *tile_rb = map->get((map_tile_id_t) { MAP_CHANNEL_P, id.x + 1,	id.y - 1,	id.z }, &revision_rb);
-
-	// just a sanity check
-	assert(!((revision_lt && !tile_lt) ||
-			(revision_mt && !tile_mt) ||
-			(revision_rt && !tile_rt) ||
-			(revision_lm && !tile_lm) ||
-			(revision_mm && !tile_mm) ||
-			(revision_rm && !tile_rm) ||
-			(revision_lb && !tile_lb) ||
-			(revision_mb && !tile_mb) ||
-			(revision_rb && !tile_rb)));
+	// warm up the whole neighbourhood in one round trip
+	std::vector<map_tile_id_t> neighbours;
+	for (int32_t y = id.y - 1; y <= id.y + 1; ++y)
+		for (int32_t x = id.x - 1; x <= id.x + 1; ++x)
+			neighbours.push_back((map_tile_id_t) { MAP_CHANNEL_P, x, y, id.z });
+	map->prefetch(neighbours);
 
 	// a sum of tile revisions will guarantee that if any of the tile changes, the cspace
 	// for the center tile will be stale
-	uint32_t revision = revision_lt + revision_mt + revision_rt +
-				   revision_lm + revision_mm + revision_rm +
-				   revision_lb + revision_mb + revision_rb;
+	uint32_t revision = 0;
+	for (std::vector<map_tile_id_t>::const_iterator i = neighbours.begin(); i != neighbours.end(); ++i)
+	{
+		uint32_t tile_revision = 0;
+		map->get(*i, &tile_revision);
+		revision += tile_revision;
+	}
 
 	map_tile_id_t cspace_id = { MAP_CHANNEL_P_CSPACE, id.x, id.y, id.z };
 
@@ -161,87 +187,13 @@ int CSpaceDriver::ProcessTile(const map_tile_id_t &id)
 	const uint32_t copy_width = total_in_pixel + map->getInfo().tile_width + total_in_pixel;
 	const uint32_t copy_height = total_in_pixel + map->getInfo().tile_height + total_in_pixel;
 	map_data_t *original = new map_data_t[copy_width * copy_height];
-	memset(original, 0, sizeof(map_data_t) * copy_width * copy_height);
-
-
-	// copy data over, row by row, faster than regular double loop
-	for (uint32_t y = 0; y < total_in_pixel; ++y)
-	{
-		// left-top
-		if (tile_lt)
-		{
-			memcpy(original + (copy_width * (copy_height - total_in_pixel + y)),
-					tile_lt + (tile_width * y + (tile_width - total_in_pixel)),
-			sizeof(map_data_t) * total_in_pixel);
-		}
-
-		// middle-top
-		if (tile_mt)
-		{
-			memcpy(original + (copy_width * (copy_height - total_in_pixel + y) + total_in_pixel),
-					tile_mt + (tile_width * y),
-			sizeof(map_data_t) * tile_width);
-		}
 
-		// right-top
-		if (tile_rt)
-		{
-			memcpy(original + (copy_width * (copy_height - total_in_pixel + y) + (copy_width - total_in_pixel)),
-					tile_rt + (tile_width * y),
-			sizeof(map_data_t) * total_in_pixel);
-		}
-
-		// left-bottom
-		if (tile_lb)
-		{
-			memcpy(original + (copy_width * y),
-					tile_lb + (tile_width * (tile_height - total_in_pixel + y) + (tile_width - total_in_pixel)),
-			sizeof(map_data_t) * total_in_pixel);
-		}
-
-		// middle-bottom
-		if (tile_mb)
-		{
-			memcpy(original + (copy_width * y + total_in_pixel),
-					tile_mb + (tile_width * (tile_height - total_in_pixel + y)),
-			sizeof(map_data_t) * tile_width);
-		}
-
-		// right-bottom
-		if (tile_rb)
-		{
-			memcpy(original + (copy_width * y + (copy_width - total_in_pixel)),
-					tile_rb + (tile_width * (tile_height - total_in_pixel + y)),
-			sizeof(map_data_t) * total_in_pixel);
-		}
-	}
-
-	for (uint32_t y = 0; y < tile_height; ++y)
-	{
-		// left-middle
-		if (tile_lm)
-		{
-			memcpy(original + (copy_width * (y + total_in_pixel)),
-					tile_lm + (tile_width * y + (tile_width - total_in_pixel)),
-			sizeof(map_data_t) * total_in_pixel);
-		}
-
-		// middle-middle
-		if (tile_mm)
-		{
-			memcpy(original + (copy_width * (y + total_in_pixel) + total_in_pixel),
-					tile_mm + (tile_width * y),
-			sizeof(map_data_t) * tile_width);
-		}
-
-		// right-middle
-		if (tile_rm)
-		{
-			memcpy(original + (copy_width * (y + total_in_pixel) + (copy_width - total_in_pixel)),
-					tile_rm + (tile_width * y),
-			sizeof(map_data_t) * total_in_pixel);
-		}
-	}
+	// the tile and as much around it as obstacles can reach into it, in one raster
+	map->getRegion(MAP_CHANNEL_P,
+		id.x * (int32_t)tile_width - (int32_t)total_in_pixel,
+		id.y * (int32_t)tile_height - (int32_t)total_in_pixel,
+		id.z * (int32_t)map->getInfo().tile_depth,
+		copy_width, copy_height, original);
 
 	// make a copy
 	map_data_t *working = new map_data_t[copy_width * copy_height];
@@ -3,6 +3,7 @@
 
 #include <libplayercore/playercore.h>
 #include <vector>
+#include <ctime>
 #include <map>
 
 #include "map/map.h"
@@ -23,10 +24,19 @@ namespace amos
 		virtual int ProcessTile(const map_tile_id_t &id);
 
 		std::vector< std::pair<std::string, uint16_t> > map_servers;
+		std::string map_shm;
+		uint32_t map_shm_tiles;
+		std::string map_server;
+		uint16_t map_server_port;
+		uint32_t map_budget;
+		uint32_t map_stats; // seconds between statistics dumps, 0 for none
+		time_t map_stats_timestamp;
+		uint32_t map_levels;
 		Map *map;
 
 		double radius, buffer;
 		std::map<map_tile_id_t, uint32_t> revisions;
+		std::set<map_tile_id_t> tiles; // probability tiles known so far
 	};
 }
 
@@ -2,6 +2,7 @@
 
 #include <cmath>
 #include <limits>
+#include <algorithm>
 #include <unistd.h>
 
 #define DEAD_ZONE 30
@@ -156,13 +157,13 @@ int GapFinderDriver::ProcessMessage(QueuePointer &resp_queue, player_msghdr *hdr
 		if (!data) return -1;
 		if (!active) return 0;
 		player_laser_data_t *d = (player_laser_data_t*)data;
-		if (d->ranges_count != 361 || d->max_range != 8.0f)
+		if (!d->ranges_count || d->resolution <= 0.0f || d->max_range != 8.0f)
 		{
 			PLAYER_ERROR("gf: laser data format not supported.");
 			return -1;
 		}
 		
-		this->FindGap(d->ranges, d->max_range);
+		this->FindGap(beam_table(d->min_angle, d->resolution, d->ranges_count), d->ranges, d->max_range);
 		return 0;
 	}
 	else if(Message::MatchMessage(hdr, PLAYER_MSGTYPE_CMD, PLAYER_POSITION2D_CMD_POS, interface_position2d_addr))
@@ -215,29 +216,22 @@ int GapFinderDriver::ProcessMessage(QueuePointer &resp_queue, player_msghdr *hdr
 	return -1;
 }
 
-void GapFinderDriver::FindGap(const float *ranges, const float max_range)
+void GapFinderDriver::FindGap(const beam_table_t *beams, const float *ranges, const float max_range)
 {
 	// static constants section
 	static const double speed_turn_e = exp(-SPEED_TURN_WEIGHT);
 	static const double speed_turn_d = 1.0 - speed_turn_e;
 	static const double speed_dist_d = exp(SPEED_DIST_WEIGHT) - 1.0;
 
-	static double laser_angle[361];
-	static bool init = false;
-	if (!init)
-	{
-		// build a table of laser tilt angle
-		for(int i = 0; i < 361; i++)
-		{
-			laser_angle[i] = DTOR((double)i * 0.5 - 90.0);
-		}
-		init = true;
-	}
-	
+	const float *laser_angle = &beams->angles[0];
+
+	// beams outside of the dead zone, from the left to the right
+	const int first = std::min((int)beams->count - 1, (int)floor((DTOR(90 - DEAD_ZONE) - beams->min_angle) / beams->resolution + 0.001));
+	const int last = std::max(0, (int)ceil((DTOR(DEAD_ZONE - 90) - beams->min_angle) / beams->resolution - 0.001));
 
 	// find min range
 	float min_range = max_range;
-	for(uint16_t i = 0; i < 361; i++)
+	for(uint32_t i = 0; i < beams->count; i++)
 	{
 		if (ranges[i] < max_range && fabs(laser_angle[i]) < DTOR(90 - DEAD_ZONE))
 		{			
@@ -261,7 +255,7 @@ void GapFinderDriver::FindGap(const float *ranges, const float max_range)
 	double gap_start_angle = 0.0, gap_stop_angle = 0.0;
 	const double buffer_angle = fabs(asin((ROBOT_WIDTH + GAP_BUFFER) / 2.0 / gap_range) * 2.0);
 
-	for(int i = 361 - DEAD_ZONE * 2; i >= DEAD_ZONE * 2; i--)
+	for(int i = first; i >= last; i--)
 	{
 		if(ranges[i] >= gap_range && !gap_started)
 		{
@@ -269,7 +263,7 @@ void GapFinderDriver::FindGap(const float *ranges, const float max_range)
 			gap_start_angle = laser_angle[i];
 			gap_started = true;
 		}
-		else if((ranges[i] < gap_range || i == DEAD_ZONE * 2) && gap_started)
+		else if((ranges[i] < gap_range || i == last) && gap_started)
 		{
 			//stop angle
 			gap_stop_angle = laser_angle[i];
@@ -12,14 +12,10 @@ LaserFusionDriver::LaserFusionDriver(ConfigFile* cf, int section) :
 	
 	lasers_addr = new player_devaddr_t[lasers_count];
 	lasers_dev = new Device*[lasers_count];
-	lasers_ranges = new float[lasers_count * 361];
+	lasers_ranges = new std::vector<float>[lasers_count];
 
 	memset(lasers_addr, 0, lasers_count * sizeof(player_devaddr_t));
 	memset(lasers_dev, 0, lasers_count * sizeof(Device*));
-	memset(lasers_ranges, 0, lasers_count * 361 * sizeof(float));
-	
-	memset(laser_ranges, 0, 361 * sizeof(float));
-	memset(laser_intensity, 0, 361 * sizeof(uint8_t));
 
 	// set up a laser interface
 	if (cf->ReadDeviceAddr(&laser_addr, section, "provides", PLAYER_LASER_CODE, -1, NULL))
@@ -45,15 +41,9 @@ LaserFusionDriver::LaserFusionDriver(ConfigFile* cf, int section) :
 		}
 	}
 	
-	laser_data.min_angle = DTOR(-90.0);
-	laser_data.max_angle = DTOR(90.0);
-	laser_data.resolution = DTOR(0.5);
+	// the beams are taken from the first scan
+	memset(&laser_data, 0, sizeof(laser_data));
 	laser_data.max_range = 8.0f;
-	laser_data.ranges_count = 361;
-	laser_data.ranges = &laser_ranges[0];
-	laser_data.intensity_count = 361;
-	laser_data.intensity = &laser_intensity[0];
-	laser_data.id = 0;
 	PLAYER_MSG0(8,"laserfusion: initialized");
 }
 
@@ -127,12 +117,29 @@ int LaserFusionDriver::ProcessMessage(QueuePointer &resp_queue, player_msghdr *h
 		if (Message::MatchMessage(hdr, PLAYER_MSGTYPE_DATA, PLAYER_LASER_DATA_SCAN, lasers_addr[i]) && data)
 		{
 			player_laser_data_t *d = (player_laser_data_t*)data;
-			if (d->ranges_count != 361)
+			if (!laser_data.ranges_count && d->ranges_count)
+			{
+				// lasers not heard from yet see an obstacle on every beam
+				for (int j = 0; j < lasers_count; j++)
+					lasers_ranges[j].assign(d->ranges_count, 0.0f);
+				laser_ranges.assign(d->ranges_count, 0.0f);
+				laser_intensity.assign(d->ranges_count, 0);
+				laser_data.min_angle = d->min_angle;
+				laser_data.max_angle = d->max_angle;
+				laser_data.resolution = d->resolution;
+				laser_data.ranges_count = d->ranges_count;
+				laser_data.ranges = &laser_ranges[0];
+				laser_data.intensity_count = d->ranges_count;
+				laser_data.intensity = &laser_intensity[0];
+			}
+			if (d->ranges_count != laser_data.ranges_count ||
+				d->min_angle != laser_data.min_angle ||
+				d->resolution != laser_data.resolution)
 			{
-				PLAYER_WARN("mapper: laser data format not supported.");
+				PLAYER_WARN("laserfusion: laser data format not supported, all lasers need the same beams.");
 				return -1;
 			}
-			memcpy(lasers_ranges + i * 361, d->ranges, 361 * sizeof(float));
+			lasers_ranges[i].assign(d->ranges, d->ranges + d->ranges_count);
 			this->Fuse();
 			return 0;
 		}
@@ -143,7 +150,7 @@ int LaserFusionDriver::ProcessMessage(QueuePointer &resp_queue, player_msghdr *h
 void LaserFusionDriver::Fuse()
 {
 	// reset laser to max range first
-	for (int j = 0; j < 361; j++)
+	for (uint32_t j = 0; j < laser_data.ranges_count; j++)
 	{
 		laser_ranges[j] = laser_data.max_range;
 	}
@@ -151,10 +158,10 @@ void LaserFusionDriver::Fuse()
 	// take smallest laser range from each angle
 	for (int i = 0; i < lasers_count; i++)
 	{
-		for (int j = 0; j < 361; j++)
+		for (uint32_t j = 0; j < laser_data.ranges_count; j++)
 		{
-			if (laser_ranges[j] > lasers_ranges[i * 361 + j])
-				laser_ranges[j] = lasers_ranges[i * 361 + j];
+			if (laser_ranges[j] > lasers_ranges[i][j])
+				laser_ranges[j] = lasers_ranges[i][j];
 		}
 	}
 	laser_data.id ++;
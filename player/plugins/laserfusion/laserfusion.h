@@ -2,6 +2,7 @@
 #define AMOS_PLUGINS_LASERFUSION_H
 
 #include <libplayercore/playercore.h>
+#include <vector>
 
 namespace amos
 {
@@ -20,13 +21,13 @@ namespace amos
 		
 		player_devaddr_t laser_addr;
 		player_laser_data_t laser_data;
-		float laser_ranges[361];
-		uint8_t laser_intensity[361];
+		std::vector<float> laser_ranges; // beams of the first scan, all lasers have to have the same
+		std::vector<uint8_t> laser_intensity;
 
 		int lasers_count;
 		player_devaddr_t *lasers_addr;
 		Device **lasers_dev;
-		float *lasers_ranges;
+		std::vector<float> *lasers_ranges;
 	};
 }
 #endif
@@ -480,7 +480,7 @@ void LineDetectDriver::processImage(){
 
 
 	//Clear old lidar scan
-	for(unsigned int i=0; i<=line_laser.ranges_count; i++){
+	for(unsigned int i=0; i<line_laser.ranges_count; i++){
 		laser_ranges[i]=line_laser.max_range;
 	}
 
@@ -506,7 +506,8 @@ void LineDetectDriver::processImage(){
 						cLine.getIntercept(tan(DegToRad(((double)angle/2.0))), current);
 						double dist=hypot(current.x, current.y);
 						//int i=(180-(int)(RadToDeg(angle)))*2;
-						laser_ranges[angle]=fminf(laser_ranges[angle], (float)dist);
+						if(angle >= 0 && angle < (int)line_laser.ranges_count)
+							laser_ranges[angle]=fminf(laser_ranges[angle], (float)dist);
 					}
 				}
 				else{
@@ -514,7 +515,8 @@ void LineDetectDriver::processImage(){
 						cLine.getIntercept(tan(DegToRad(((double)angle/2.0))), current);
 						double dist=hypot(current.x, current.y);
 						//int i=(180-(int)(RadToDeg(angle)))*2;
-						laser_ranges[angle]=fminf(laser_ranges[angle], (float)dist);
+						if(angle >= 0 && angle < (int)line_laser.ranges_count)
+							laser_ranges[angle]=fminf(laser_ranges[angle], (float)dist);
 					}
 				}
 
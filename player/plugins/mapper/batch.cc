@@ -0,0 +1,112 @@
+#include "batch.h"
+
+#include <algorithm>
+#include <cassert>
+#include <limits>
+#include <cmath>
+
+// values in between touched ones that are cheaper to update along than to start another update
+#define BATCH_GAP 32
+
+using namespace amos;
+
+//
+// Elevation and visual mapping change the same few tiles over and over during a scan,
+// so instead of going through the map for every change, the changes are composed per tile
+// the same way the map composes pending changes, and go to the map once the scan is done.
+// The buffers are kept from scan to scan and only the cells touched are set back afterwards,
+// so a scan costs what it touches and not what the tiles hold, touched cells close to each
+// other go in the same update.
+//
+
+MapperBatch::MapperBatch(Map *map) : map(map), used(0)
+{
+	assert(map);
+}
+
+MapperBatch::~MapperBatch()
+{
+}
+
+mapper_batch_t* MapperBatch::find(uint32_t channel, int32_t x, int32_t y, uint32_t *index)
+{
+	const map_tile_id_t id = map->locate(channel, x, y, 0, index);
+	mapper_batch_t *batch = 0;
+
+	// a scan only touches a handful of tiles, most often the one of the cell before
+	for (uint32_t i = used; i > 0 && !batch; i--)
+	{
+		if (batches[i - 1].id == id) batch = &batches[i - 1];
+	}
+
+	if (!batch)
+	{
+		if (used == batches.size())
+			batches.push_back(mapper_batch_t());
+		batch = &batches[used++];
+		batch->id = id;
+
+		// buffers of a wider channel grow, the rest of them is already as it should be
+		const uint32_t length = map->getTileLength(channel);
+		if (batch->multiplication.size() < length)
+		{
+			batch->multiplication.resize(length, 1.0f);
+			batch->addition.resize(length, 0.0f);
+		}
+	}
+	return batch;
+}
+
+void MapperBatch::get(uint32_t channel, int32_t x, int32_t y, map_data_t *values)
+{
+	uint32_t index = 0;
+	const mapper_batch_t *batch = find(channel, x, y, &index);
+
+	// what is in the map, with what this scan has done to it so far
+	for (uint32_t i = 0; i < map_channel_width(channel); i++)
+	{
+		const map_data_t value = map->get(batch->id, index + i);
+		const map_data_t m = batch->multiplication[index + i];
+		values[i] = (m == 0.0f && std::fabs(value) == std::numeric_limits<float>::infinity() ? 0.0f : value * m) + batch->addition[index + i];
+	}
+}
+
+void MapperBatch::update(uint32_t channel, int32_t x, int32_t y, const map_data_t *multiplication, const map_data_t *addition)
+{
+	uint32_t index = 0;
+	mapper_batch_t *batch = find(channel, x, y, &index);
+
+	// same as map_cell_update, without the data
+	for (uint32_t i = 0; i < map_channel_width(channel); i++)
+	{
+		map_data_t &m = batch->multiplication[index + i];
+		map_data_t &a = batch->addition[index + i];
+		if (m == 1.0f && a == 0.0f) batch->cells.push_back(index + i);
+		m *= multiplication[i];
+		a = (multiplication[i] == 0.0f && std::fabs(a) == std::numeric_limits<float>::infinity() ? 0.0f : a * multiplication[i]) + addition[i];
+	}
+}
+
+void MapperBatch::commit()
+{
+	for (uint32_t i = 0; i < used; i++)
+	{
+		mapper_batch_t &batch = batches[i];
+		std::sort(batch.cells.begin(), batch.cells.end());
+
+		// cells in between that were not touched are multiplied by one and added zero, which leaves them as they are
+		for (size_t j = 0, k = 0; j < batch.cells.size(); j = k)
+		{
+			for (k = j + 1; k < batch.cells.size() && batch.cells[k] - batch.cells[k - 1] <= BATCH_GAP; k++);
+			map->update(batch.id, &batch.multiplication[0], &batch.addition[0], batch.cells[j], batch.cells[k - 1] + 1);
+		}
+
+		for (std::vector<uint32_t>::const_iterator j = batch.cells.begin(); j != batch.cells.end(); ++j)
+		{
+			batch.multiplication[*j] = 1.0f;
+			batch.addition[*j] = 0.0f;
+		}
+		batch.cells.clear();
+	}
+	used = 0;
+}
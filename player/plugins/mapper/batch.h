@@ -0,0 +1,37 @@
+#ifndef AMOS_PLUGINS_MAPPER_BATCH_H
+#define AMOS_PLUGINS_MAPPER_BATCH_H
+
+#include <vector>
+#include "map/map.h"
+
+namespace amos
+{
+	// what a scan does to a tile, applied to the map once the scan is done
+	typedef struct mapper_batch
+	{
+		map_tile_id_t id;
+		std::vector<map_data_t> multiplication, addition; // one and zero for cells not touched
+		std::vector<uint32_t> cells; // touched, to set back once applied
+	} mapper_batch_t;
+
+	// changes of a scan gathered per tile, used by one thread at a time like the map itself
+	class MapperBatch
+	{
+	public:
+		MapperBatch(Map *map);
+		virtual ~MapperBatch();
+
+		virtual void get(uint32_t channel, int32_t x, int32_t y, map_data_t *values); // with the changes so far
+		virtual void update(uint32_t channel, int32_t x, int32_t y, const map_data_t *multiplication, const map_data_t *addition);
+		virtual void commit(); // hands all changes to the map
+
+	protected:
+		virtual mapper_batch_t* find(uint32_t channel, int32_t x, int32_t y, uint32_t *index);
+
+		Map *map;
+		std::vector<mapper_batch_t> batches; // tiles touched by the current scan first, kept around for their buffers
+		uint32_t used;
+	};
+}
+
+#endif // AMOS_PLUGINS_MAPPER_BATCH_H
@@ -7,97 +7,119 @@
 
 using namespace amos;
 
-void MapperDriver::MapElevation(const float *ranges, const float max)
+void MapperDriver::MapElevation(Map *map, const player_pose2d_t &pose2d, const beam_table_t *beams, const float *ranges, const float max)
 {
-	// static constants section
-	static double laser_angle[361], laser_angle_cos[361], laser_angle_sin[361];
-	static double laser_tilt[361], laser_tilt_cos[361], laser_tilt_sin[361];
-	static map_data_t laser_last_var[361] = {0};
-
-	static bool init = false;
-	if (!init)
-	{
-		// build a table of laser tilt angle
-		for(int i = 0; i < 361; i++)
-		{
-			laser_angle[i] = DTOR((double)i * 0.5 - 90.0);
-			laser_angle_cos[i] = cos(laser_angle[i]);
-			laser_angle_sin[i] = sin(laser_angle[i]);
-			
-			// negative tilt due to negative pitch
-			laser_tilt[i] = atan(tan(elevation_laser_pose.ppitch) * cos(laser_angle[i]));
-			laser_tilt_cos[i] = cos(laser_tilt[i]);
-			laser_tilt_sin[i] = sin(laser_tilt[i]);
-		}
-		init = true;
-	}
-	
 	const double scale = map->getInfo().scale;
-	const player_pose2d_t pose2d = this->position2d_data.pos;
+	const uint32_t count = beams->count;
 	
-	double lx, ly, lz;
-	double l, a;
 	double gx, gy;
+	float lz;
 	int32_t x, y;
-	int i, j;
+	uint32_t i, j;
 	map_data_t avg, var;
+	map_data_t values[2];
+	const map_data_t weights[2] = { 1.0f - ELEVATION_RUNNING_WEIGHT, 1.0f - ELEVATION_RUNNING_WEIGHT };
+	const map_data_t zeros[2] = { 0.0f, 0.0f };
+
+	// the variances left by the last scan only go with the same beams
+	if (elevation_laser_var.size() != count)
+		elevation_laser_var.assign(count, 0.0f);
+	elevation_laser_points.resize(count);
+	elevation_laser_x.resize(count);
+	elevation_laser_y.resize(count);
+	elevation_laser_z.resize(count);
+	virtual_laser_ranges.resize(count);
+
+	// convert to 3d space, robot local coordinates turned to the map all at once
+	beam_project(beams, ranges, pose2d.pa, &elevation_laser_x[0], &elevation_laser_y[0], &elevation_laser_z[0]);
 
-	// convert to 3d space
-	for(j = 0; j < 361; j++)
+	for(j = 0; j < count; j++)
 	{
 		// start from center and work the way around
-		i = 180 + ((j % 2) ? -j/2 : j/2);
+		i = count / 2 + ((j % 2) ? -(int32_t)(j + 1) / 2 : (int32_t)j / 2);
+		player_pose3d_t &point = elevation_laser_points[i];
 		
 		if (ranges[i] >= max)
 		{
 			virtual_laser_ranges[i] = max;
-			elevation_laser_previous[i].px = 0.0f;
-			elevation_laser_previous[i].py = 0.0f;
-			elevation_laser_previous[i].pz = 0.0f;
+			point.px = 0.0f;
+			point.py = 0.0f;
+			point.pz = 0.0f;
 			continue;
 		}
 	
-		// robot local coordinates
-		lx = ranges[i] * laser_tilt_cos[i] * laser_angle_cos[i];
-		ly = ranges[i] * laser_tilt_cos[i] * laser_angle_sin[i];
-		lz = ranges[i] * laser_tilt_sin[i] + elevation_laser_pose.pz;
+		lz = elevation_laser_z[i] + elevation_laser_pose.pz;
 		
 		// virtual laser
-		virtual_laser_ranges[i] = (fabs(lz) < ELEVATION_OBSTACLE_HEIGHT) ? max : ranges[i] * laser_tilt_cos[i];
+		virtual_laser_ranges[i] = (fabs(lz) < ELEVATION_OBSTACLE_HEIGHT) ? max : ranges[i] * beams->planar[i];
 
 		// global coordinates
-		l = sqrt(lx*lx + ly*ly);
-		a = atan2(ly, lx);
-		gx = pose2d.px + l * cos(a + pose2d.pa);
-		gy = pose2d.py + l * sin(a + pose2d.pa);
+		gx = pose2d.px + elevation_laser_x[i];
+		gy = pose2d.py + elevation_laser_y[i];
 		
 		// record latest scan
-		elevation_laser_previous[i].px = gx;
-		elevation_laser_previous[i].py = gy;
-		elevation_laser_previous[i].pz = lz;
+		point.px = gx;
+		point.py = gy;
+		point.pz = lz;
 		
 		// map to pixel
 		x = gx / scale;
 		y = gy / scale;
 		
 
-		// update current cell
-		avg = map->get(MAP_CHANNEL_E_AVG, x, y, 0);
-		var = map->get(MAP_CHANNEL_E_VAR, x, y, 0);
+		// update current cell, with what this scan has done to it so far
+		if (map_groups)
+		{
+			elevation_batch->get(MAP_CHANNEL_E, x, y, values);
+			avg = values[MAP_CHANNEL_E_MEMBER_AVG];
+			var = values[MAP_CHANNEL_E_MEMBER_VAR];
+		}
+		else
+		{
+			elevation_batch->get(MAP_CHANNEL_E_AVG, x, y, &avg);
+			elevation_batch->get(MAP_CHANNEL_E_VAR, x, y, &var);
+		}
 	
 		if (avg == 0.0f && var == 0.0f)
 		{
-			map->set(MAP_CHANNEL_E_AVG, x, y, 0, lz);
-			map->set(MAP_CHANNEL_E_VAR, x, y, 0, laser_last_var[i]);
+			// multiplying by zero sets the value
+			values[MAP_CHANNEL_E_MEMBER_AVG] = lz;
+			values[MAP_CHANNEL_E_MEMBER_VAR] = elevation_laser_var[i];
+			if (map_groups)
+			{
+				elevation_batch->update(MAP_CHANNEL_E, x, y, zeros, values);
+			}
+			else
+			{
+				elevation_batch->update(MAP_CHANNEL_E_AVG, x, y, zeros, &values[MAP_CHANNEL_E_MEMBER_AVG]);
+				elevation_batch->update(MAP_CHANNEL_E_VAR, x, y, zeros, &values[MAP_CHANNEL_E_MEMBER_VAR]);
+			}
 		}
 		else
 		{
 			avg = ELEVATION_RUNNING_WEIGHT * lz + (1.0f - ELEVATION_RUNNING_WEIGHT) * avg;
 			var = ELEVATION_RUNNING_WEIGHT * (lz - avg) * (lz - avg) + (1.0f - ELEVATION_RUNNING_WEIGHT) * var;
-			map->update(MAP_CHANNEL_E_AVG, x, y, 0, 1.0f - ELEVATION_RUNNING_WEIGHT, ELEVATION_RUNNING_WEIGHT * lz);
-			map->update(MAP_CHANNEL_E_VAR, x, y, 0, 1.0f - ELEVATION_RUNNING_WEIGHT, ELEVATION_RUNNING_WEIGHT * (lz - avg) * (lz - avg));
-			laser_last_var[i] = var;
+			values[MAP_CHANNEL_E_MEMBER_AVG] = ELEVATION_RUNNING_WEIGHT * lz;
+			values[MAP_CHANNEL_E_MEMBER_VAR] = ELEVATION_RUNNING_WEIGHT * (lz - avg) * (lz - avg);
+			if (map_groups)
+			{
+				elevation_batch->update(MAP_CHANNEL_E, x, y, weights, values);
+			}
+			else
+			{
+				elevation_batch->update(MAP_CHANNEL_E_AVG, x, y, weights, &values[MAP_CHANNEL_E_MEMBER_AVG]);
+				elevation_batch->update(MAP_CHANNEL_E_VAR, x, y, weights, &values[MAP_CHANNEL_E_MEMBER_VAR]);
+			}
+			elevation_laser_var[i] = var;
 		}
 	}
+
+	// all changes of this scan go to the map at once
+	elevation_batch->commit();
+
+	// for the visual stage, which runs on its own thread
+	elevation_mutex.lock();
+	elevation_laser_previous.swap(elevation_laser_points);
+	elevation_mutex.unlock();
 }
 
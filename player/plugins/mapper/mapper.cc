@@ -4,28 +4,33 @@
 #include <unistd.h>
 #include <cassert>
 
+#include "map/shmbackend.h"
+#include "map/serverbackend.h"
+
+#define MAPPER_COMMIT_QUEUE 16 // tiles, the stages should not wait for the backend by default
+
 using namespace amos;
 
 MapperDriver::MapperDriver(ConfigFile* cf, int section) :
 	ThreadedDriver(cf, section),
-	map(0),
 	position2d_dev(0),
 	elevation_laser_dev(0),
+	elevation_stage(0),
+	elevation_batch(0),
 	visual_camera_dev(0),
-	probability_laser_dev(0)
+	visual_stage(0),
+	visual_batch(0),
+	probability_laser_dev(0),
+	probability_stage(0),
+	probability_scan(0),
+	probability_table_scale(0.0),
+	probability_table_max(0.0f),
+	probability_table_resolution(0.0f),
+	probability_table_radius(0)
 {
-	// initialize data
-	memset(&elevation_laser_previous, 0, sizeof(player_pose3d_t) * 361);
-
-	virtual_laser.min_angle = DTOR(-90.0);
-	virtual_laser.max_angle = DTOR(90.0);
-	virtual_laser.resolution = DTOR(0.5);
+	// initialize data, the virtual laser takes the beams of the elevation laser
+	memset(&virtual_laser, 0, sizeof(virtual_laser));
 	virtual_laser.max_range = 8.0f;
-	virtual_laser.ranges_count = 361;
-	virtual_laser.ranges = &virtual_laser_ranges[0];
-	virtual_laser.intensity_count = 361;
-	virtual_laser.intensity = &virtual_laser_intensity[0];
-	virtual_laser.id = 0;
 
 	// read settings
 	int map_servers_count = cf->GetTupleCount(section, "maphosts");
@@ -45,6 +50,31 @@ MapperDriver::MapperDriver(ConfigFile* cf, int section) :
 		// default map server
 		map_servers.push_back(make_pair(std::string("localhost"), (uint16_t)11211));
 	}
+
+	// drivers on the same host can share tiles through shared memory instead, it goes away once the last
+	// of them stops, whoever starts first sets mapshmtiles, the most tiles it will ever hold
+	map_shm = cf->ReadString(section, "mapshm", "");
+	map_shm_tiles = cf->ReadInt(section, "mapshmtiles", 1024);
+
+	// or go through a map server that applies changes itself, see amosmapserver
+	map_server = cf->ReadString(section, "mapserver", "");
+	map_server_port = cf->ReadInt(section, "mapserverport", MAPSERVER_PORT);
+
+	// memory for cached tiles in megabytes, including pending changes, 0 keeps the default,
+	// every sensor is mapped on its own thread into a map of its own, each gets this much
+	map_budget = cf->ReadInt(section, "mapbudget", 0);
+
+	// seconds between dumps of the map cache and backend statistics, 0 for none
+	map_stats = cf->ReadInt(section, "mapstats", 0);
+
+	// number of tiles that can be waiting to be committed in the background, 0 commits on the mapping thread
+	map_commit_queue = cf->ReadInt(section, "commitqueue", MAPPER_COMMIT_QUEUE);
+
+	// number of coarser levels to keep up to date for planning and display, 0 keeps none
+	map_levels = cf->ReadInt(section, "maplevels", 0);
+
+	// keep elevation in MAP_CHANNEL_E and colour in MAP_CHANNEL_RGB instead of one channel each
+	map_groups = cf->ReadBool(section, "mapgroups", false);
 	
 	elevation_laser_pose.px = cf->ReadTupleFloat(section, "elevationlaserpose", 0, 0.0f);
 	elevation_laser_pose.py = cf->ReadTupleFloat(section, "elevationlaserpose", 1, 0.0f);
@@ -62,6 +92,9 @@ MapperDriver::MapperDriver(ConfigFile* cf, int section) :
 	visual_camera_hfov = cf->ReadTupleAngle(section, "camerafov", 0, 45.0f);
 	visual_camera_vfov = cf->ReadTupleAngle(section, "camerafov", 1, 45.0);;
 
+	// "box" checks every cell within range of the robot, "rays" only the cells the beams cross
+	probability_rays = std::string(cf->ReadString(section, "probabilitymode", "box")) == "rays";
+
 
 	if (cf->ReadDeviceAddr(&position2d_addr, section, "requires", PLAYER_POSITION2D_CODE, -1, NULL))
 	{
@@ -136,31 +169,45 @@ MapperDriver::~MapperDriver()
 {
 }
 
-int MapperDriver::MainSetup() {
-	PLAYER_MSG0(3,"mapper: setup started");
-	
-	// first create the map client
-	map = new Map(map_servers);
+Map* MapperDriver::CreateMap()
+{
+	Map *map = 0;
+
+	if (!map_server.empty())
+		map = new Map(new ServerMapBackend(map_server, map_server_port));
+	else if (map_shm.empty())
+		map = new Map(map_servers);
+	else
+		map = new Map(new ShmMapBackend(map_shm, map_servers, map_shm_tiles));
 	if (!map->isOpen())
 	{
 		delete map;
-		map = 0;
 		PLAYER_ERROR("mapper: unable to create map");
-		return -1;
+		return 0;
 	}
+	if (map_budget) map->setBudget((size_t)map_budget << 20);
+	map->setCommitter(map_commit_queue);
+	map->setLevels(map_levels);
+	return map;
+}
+
+int MapperDriver::MainSetup() {
+	PLAYER_MSG0(3,"mapper: setup started");
+	
+	Map *map = 0;
 	ready = false;
 	
 	// subscribe to position2d
 	if (!(position2d_dev = deviceTable->GetDevice(position2d_addr)))
 	{
 		PLAYER_ERROR("mapper: unable to locate suitable position2d device");
-		return -1;
+		goto error;
 	}
 	else if (position2d_dev->Subscribe(this->InQueue))
 	{
 		PLAYER_ERROR("mapper: position2d device cannot be subscribed");
 		position2d_dev = 0;
-		return -1;
+		goto error;
 	}
 
 	// optional elevation laser
@@ -169,13 +216,13 @@ int MapperDriver::MainSetup() {
 		if (!(elevation_laser_dev = deviceTable->GetDevice(elevation_laser_addr)))
 		{
 			PLAYER_ERROR("mapper: unable to locate suitable elevation laser device");
-			return -1;
+			goto error;
 		}
 		else if (elevation_laser_dev->Subscribe(this->InQueue))
 		{
 			PLAYER_ERROR("mapper: elevation laser device not subscribed");
 			elevation_laser_dev = 0;
-			return -1;
+			goto error;
 		}
 	}
 	
@@ -185,13 +232,13 @@ int MapperDriver::MainSetup() {
 		if (!(visual_camera_dev = deviceTable->GetDevice(visual_camera_addr)))
 		{
 			PLAYER_ERROR("mapper: unable to locate suitable visual camera device");
-			return -1;
+			goto error;
 		}
 		else if (visual_camera_dev->Subscribe(this->InQueue))
 		{
 			PLAYER_ERROR("mapper: visual camera device not subscribed");
 			visual_camera_dev = 0;
-			return -1;
+			goto error;
 		}
 	}
 	
@@ -201,28 +248,80 @@ int MapperDriver::MainSetup() {
 		if (!(probability_laser_dev = deviceTable->GetDevice(probability_laser_addr)))
 		{
 			PLAYER_ERROR("mapper: unable to locate suitable probability laser device");
-			return -1;
+			goto error;
 		}
 		else if (probability_laser_dev->Subscribe(this->InQueue))
 		{
 			PLAYER_ERROR("mapper: probability laser device not subscribed");
 			probability_laser_dev = 0;
-			return -1;
+			goto error;
 		}
 	}
 
+	// every sensor gets a stage and a map of its own, so that a slow one does not hold up the others
+	if (elevation_laser_dev)
+	{
+		if (!(map = CreateMap())) goto error;
+		elevation_batch = new MapperBatch(map);
+		elevation_stage = new MapperStage(this, MAPPER_STAGE_ELEVATION, "elevation", map, map_stats);
+		elevation_stage->start();
+	}
+	if (visual_camera_dev)
+	{
+		if (!(map = CreateMap())) goto error;
+		visual_batch = new MapperBatch(map);
+		visual_stage = new MapperStage(this, MAPPER_STAGE_VISUAL, "visual", map, map_stats);
+		visual_stage->start();
+	}
+	if (probability_laser_dev)
+	{
+		if (!(map = CreateMap())) goto error;
+		probability_stage = new MapperStage(this, MAPPER_STAGE_PROBABILITY, "probability", map, map_stats);
+		probability_stage->start();
+	}
+
 	PLAYER_MSG0(3,"mapper: setup complete");
 	return 0;
+
+error:
+	// player does not call MainQuit after a failed setup, stages already running have to be stopped
+	this->MainQuit();
+	return -1;
 }
 
 void MapperDriver::MainQuit()
 {
 	PLAYER_MSG0(3,"mapper: shutting down");
 	
-	if (map)
+	// the stages push out whatever is still pending and delete their maps
+	if (elevation_stage)
 	{
-		delete map;
-		map = 0;
+		delete elevation_stage;
+		elevation_stage = 0;
+	}
+
+	if (visual_stage)
+	{
+		delete visual_stage;
+		visual_stage = 0;
+	}
+
+	if (probability_stage)
+	{
+		delete probability_stage;
+		probability_stage = 0;
+	}
+
+	if (elevation_batch)
+	{
+		delete elevation_batch;
+		elevation_batch = 0;
+	}
+
+	if (visual_batch)
+	{
+		delete visual_batch;
+		visual_batch = 0;
 	}
 
 	if (position2d_dev)
@@ -257,23 +356,12 @@ void MapperDriver::Main()
 {
 	PLAYER_MSG0(3,"mapper: thread started");
 
-	time_t timestamp = time(NULL);
-
+	// all this thread does is hand the data to the stages, mapping and committing is up to them
 	for(;;)
 	{
 		this->TestCancel();
+		this->Wait();
 		this->ProcessMessages();
-
-		// see if we need to commit the map changes
-		// commiting every second
-		if (time(NULL) > timestamp)
-		{
-			map->commit();
-			timestamp = time(NULL);
-			PLAYER_MSG0(9, "mapper: map committed");
-		}
-		//map->refresh();
-		//usleep(5000);
 	}
 }
 
@@ -291,22 +379,12 @@ int MapperDriver::ProcessMessage(QueuePointer &resp_queue, player_msghdr *hdr, v
 	{
 		if (!ready) return 0;
 		player_laser_data_t *d = (player_laser_data_t*)data;
-		if (d->ranges_count != 361)
+		if (!d->ranges_count || d->resolution <= 0.0f)
 		{
 			PLAYER_WARN("mapper: elevation laser data format not supported.");
 			return -1;
 		}
-		PLAYER_MSG0(9, "mapper: map elevation laser begin");
-		this->MapElevation(d->ranges, d->max_range);
-		PLAYER_MSG0(9, "mapper: map elevation laser end");
-		
-		// publish virtual laser data?
-		if (virtual_laser_addr.interf == PLAYER_LASER_CODE)
-		{
-			virtual_laser.max_range = d->max_range;
-			virtual_laser.id ++;
-			this->Publish(virtual_laser_addr, PLAYER_MSGTYPE_DATA, PLAYER_LASER_DATA_SCAN, &virtual_laser);
-		}
+		this->Post(elevation_stage, d);
 		return 0;
 	}
 	// received visual camera frame
@@ -322,9 +400,12 @@ int MapperDriver::ProcessMessage(QueuePointer &resp_queue, player_msghdr *hdr, v
 			PLAYER_WARN("mapper: visual camera image format not supported.");
 			return -1;
 		}
-		PLAYER_MSG0(9, "mapper: map visual camera begin");
-		this->MapVisual(d->image, d->width, d->height);
-		PLAYER_MSG0(9, "mapper: map visual camera end");
+		mapper_input_t *input = visual_stage->reserve();
+		input->pose = position2d_data.pos;
+		input->image.assign(d->image, d->image + d->image_count);
+		input->width = d->width;
+		input->height = d->height;
+		visual_stage->post();
 		return 0;
 	}
 	// received probability laser scan
@@ -332,19 +413,68 @@ int MapperDriver::ProcessMessage(QueuePointer &resp_queue, player_msghdr *hdr, v
 	{
 		if (!ready) return 0;
 		player_laser_data_t *d = (player_laser_data_t*)data;
-		if (d->ranges_count != 361)
+		if (!d->ranges_count || d->resolution <= 0.0f)
 		{
 			PLAYER_WARN("mapper: probability laser data format not supported.");
 			return -1;
 		}
-		PLAYER_MSG0(9, "mapper: map probability laser begin");
-		this->MapProbability(d->ranges, d->max_range);
-		PLAYER_MSG0(9, "mapper: map probability laser end");
+		this->Post(probability_stage, d);
 		return 0;
 	}
 	return -1;
 }
 
+void MapperDriver::Post(MapperStage *stage, const player_laser_data_t *data)
+{
+	// the message goes away once it has been processed, so the stage gets a copy
+	mapper_input_t *input = stage->reserve();
+	input->pose = position2d_data.pos;
+	input->ranges.assign(data->ranges, data->ranges + data->ranges_count);
+	input->min_angle = data->min_angle;
+	input->resolution = data->resolution;
+	input->max_range = data->max_range;
+	stage->post();
+}
+
+void MapperDriver::MapInput(uint32_t stage, Map *map, const mapper_input_t &input)
+{
+	// tables for every geometry are made once and shared by the stages, the elevation laser is pitched
+	const beam_table_t *beams = 0;
+
+	switch (stage)
+	{
+	case MAPPER_STAGE_ELEVATION:
+		beams = beam_table(input.min_angle, input.resolution, input.ranges.size(), elevation_laser_pose.ppitch);
+		this->MapElevation(map, input.pose, beams, &input.ranges[0], input.max_range);
+
+		// publish virtual laser data?
+		if (virtual_laser_addr.interf == PLAYER_LASER_CODE)
+		{
+			virtual_laser_intensity.resize(beams->count, 0);
+			virtual_laser.min_angle = beams->min_angle;
+			virtual_laser.max_angle = beams->min_angle + beams->resolution * (beams->count - 1);
+			virtual_laser.resolution = beams->resolution;
+			virtual_laser.max_range = input.max_range;
+			virtual_laser.ranges_count = beams->count;
+			virtual_laser.ranges = &virtual_laser_ranges[0];
+			virtual_laser.intensity_count = beams->count;
+			virtual_laser.intensity = &virtual_laser_intensity[0];
+			virtual_laser.id ++;
+			this->Publish(virtual_laser_addr, PLAYER_MSGTYPE_DATA, PLAYER_LASER_DATA_SCAN, &virtual_laser);
+		}
+		break;
+
+	case MAPPER_STAGE_VISUAL:
+		this->MapVisual(map, input.pose, &input.image[0], input.width, input.height);
+		break;
+
+	case MAPPER_STAGE_PROBABILITY:
+		beams = beam_table(input.min_angle, input.resolution, input.ranges.size());
+		this->MapProbability(map, input.pose, beams, &input.ranges[0], input.max_range);
+		break;
+	}
+}
+
 
 Driver* driver_init(ConfigFile* cf, int section) {
 	return new MapperDriver(cf, section);
@@ -3,11 +3,24 @@
 
 #include <libplayercore/playercore.h>
 #include <vector>
+#include <ctime>
 
 #include "map/map.h"
+#include "beam/beam.h"
+#include "thread/mutex.h"
+#include "batch.h"
+#include "stage.h"
 
 namespace amos
 {
+	// a cell as seen from the robot, angles in beams from the x axis
+	typedef struct probability_offset
+	{
+		float distance; // to the center of the cell
+		float center; // angle of the center
+		float spread; // how far the corners go past the center, counter clockwise
+	} probability_offset_t;
+
 	class MapperDriver : public ThreadedDriver
 	{
 	public:
@@ -17,17 +30,32 @@ namespace amos
 		virtual void MainQuit();
 		virtual int ProcessMessage(QueuePointer&, player_msghdr*, void*);
 
+		// called by the stages, each on its own thread with its own map
+		virtual void MapInput(uint32_t stage, Map *map, const mapper_input_t &input);
+
 	protected:
 		virtual void Main();
 
-		virtual void MapElevation(const float *ranges, const float max);
-		virtual void MapVisual(const uint8_t *image, const uint32_t &width, const uint32_t &height);
-		virtual void MapProbability(const float *ranges, const float max);
+		virtual Map* CreateMap();
+		virtual void Post(MapperStage *stage, const player_laser_data_t *data);
+		virtual void MapElevation(Map *map, const player_pose2d_t &pose2d, const beam_table_t *beams, const float *ranges, const float max);
+		virtual void MapVisual(Map *map, const player_pose2d_t &pose2d, const uint8_t *image, const uint32_t &width, const uint32_t &height);
+		virtual void MapProbability(Map *map, const player_pose2d_t &pose2d, const beam_table_t *beams, const float *ranges, const float max);
+		virtual void MapProbabilityRays(Map *map, const player_pose2d_t &pose2d, const beam_table_t *beams, const float *ranges, const float max);
+		virtual const std::vector<probability_offset_t>& ProbabilityTable(double scale, float max, float resolution, uint32_t qx, uint32_t qy);
 
 		std::vector< std::pair<std::string, uint16_t> > map_servers;
-		Map *map;
+		std::string map_shm;
+		uint32_t map_shm_tiles;
+		std::string map_server;
+		uint16_t map_server_port;
+		uint32_t map_budget;
+		uint32_t map_stats; // seconds between statistics dumps, 0 for none
+		uint32_t map_commit_queue;
+		uint32_t map_levels;
+		bool map_groups;
 
-		// current position
+		// current position, goes along with every input posted to a stage
 		player_devaddr_t position2d_addr;
 		Device *position2d_dev;
 		player_position2d_data_t position2d_data;
@@ -36,25 +64,45 @@ namespace amos
 		player_devaddr_t elevation_laser_addr;
 		player_pose3d_t elevation_laser_pose;
 		Device *elevation_laser_dev;
-		player_pose3d_t elevation_laser_previous[361];
+		MapperStage *elevation_stage;
+		MapperBatch *elevation_batch;
+		std::vector<player_pose3d_t> elevation_laser_previous; // latest points for the visual stage
+		Mutex elevation_mutex;
+		std::vector<player_pose3d_t> elevation_laser_points; // the rest are only used by the elevation stage
+		std::vector<float> elevation_laser_x, elevation_laser_y, elevation_laser_z;
+		std::vector<map_data_t> elevation_laser_var; // per beam, from the last time it was mapped
 
 		// camera used for visual mapping
 		player_devaddr_t visual_camera_addr;
 		player_pose3d_t visual_camera_pose;
 		Device *visual_camera_dev;
 		double visual_camera_hfov, visual_camera_vfov;
+		MapperStage *visual_stage;
+		MapperBatch *visual_batch;
+		std::vector<player_pose3d_t> visual_points;
 		
 		// laser used for probability mapping
 		player_devaddr_t probability_laser_addr;
 		player_pose3d_t probability_laser_pose;
 		Device *probability_laser_dev;
+		MapperStage *probability_stage;
+		bool probability_rays; // trace every beam instead of checking every cell around the robot
+		std::vector<float> probability_ranges; // per cell of the window around the robot, see MapProbabilityRays
+		std::vector<uint32_t> probability_stamps;
+		uint32_t probability_scan;
+		std::vector<float> probability_lengths, probability_x, probability_y; // per beam
+		std::vector< std::vector<probability_offset_t> > probability_tables; // cells around the robot by where it is in its cell, see ProbabilityTable
+		double probability_table_scale;
+		float probability_table_max;
+		float probability_table_resolution;
+		int32_t probability_table_radius;
 		
 		// virtual horizontal laser
 		player_devaddr_t virtual_laser_addr;
 		Device *virtual_laser_dev;
 		player_laser_data_t virtual_laser;
-		float virtual_laser_ranges[361];
-		uint8_t virtual_laser_intensity[361];
+		std::vector<float> virtual_laser_ranges; // same beams as the elevation laser
+		std::vector<uint8_t> virtual_laser_intensity;
 
 		bool ready;
 	};
@@ -1,8 +1,12 @@
 #include "mapper.h"
 #include <limits>
+#include <algorithm>
+
+#include "map/merge.h"
 
 #define PROBABILITY_CHANGE_RATE 0.5f
 #define PROBABILITY_RUNNING_WEIGHT 0.5f
+#define PROBABILITY_TABLE_STEPS 2 // robot positions within a cell per axis that the cell geometry is worked out for
 
 using namespace amos;
 
@@ -13,6 +17,19 @@ double normalize_angle(double a)
 	return a;
 }
 
+// one scan traced along its beams, cells are keyed by where they are in a window around the robot
+typedef struct probability_rays
+{
+	map_info_t info;
+	int32_t x, y; // cell in the lower left corner of the window
+	uint32_t size; // cells on each side of the window
+	float *ranges; // shortest beam through each cell
+	uint32_t *stamps; // scan that last touched each cell, plus one once it is updated
+	uint32_t scan;
+	float range; // of the beam being traced
+	double px, py, max;
+} probability_rays_t;
+
 double laser_probability_model(double range, double d)
 {
 	#define D1 0.2
@@ -27,76 +44,118 @@ double laser_probability_model(double range, double d)
 	return 0.5;
 }
 
-void MapperDriver::MapProbability(const float *ranges, const float max)
+// global cell of a traced cell and where it is in the window, false if it is outside
+static inline bool probability_cell(const probability_rays_t &rays, const map_ray_span_t &span, uint32_t index, int32_t *x, int32_t *y, uint32_t *cell)
+{
+	*x = span.id.x * (int32_t)rays.info.tile_width + (int32_t)(index % rays.info.tile_width);
+	*y = span.id.y * (int32_t)rays.info.tile_height + (int32_t)(index / rays.info.tile_width % rays.info.tile_height);
+	const uint32_t wx = *x - rays.x, wy = *y - rays.y;
+	if (wx >= rays.size || wy >= rays.size) return false;
+	*cell = wy * rays.size + wx;
+	return true;
+}
+
+// first pass, every cell keeps the shortest beam through it
+static void probability_collect(void *context, const map_ray_span_t &span)
 {
-	// static constants section
-	static double laser_angle[361];
-	
-	static bool init = false;
-	if (!init)
+	probability_rays_t &rays = *(probability_rays_t*)context;
+	int32_t x = 0, y = 0;
+	uint32_t cell = 0;
+
+	for (uint32_t k = 0; k < span.count; k++)
 	{
-		// build a table of laser tilt angle
-		for(int i = 0; i < 361; i++)
+		if (!probability_cell(rays, span, span.cells[k], &x, &y, &cell)) continue;
+		if (rays.stamps[cell] != rays.scan)
 		{
-			laser_angle[i] = DTOR((double)i * 0.5 - 90.0);
+			rays.stamps[cell] = rays.scan;
+			rays.ranges[cell] = rays.range;
+		}
+		else if (rays.range < rays.ranges[cell])
+		{
+			rays.ranges[cell] = rays.range;
 		}
-		init = true;
+	}
+}
+
+// second pass, every cell is updated once, no matter how many beams cross it
+static void probability_apply(void *context, const map_ray_span_t &span)
+{
+	probability_rays_t &rays = *(probability_rays_t*)context;
+	int32_t x = 0, y = 0;
+	uint32_t cell = 0;
+
+	for (uint32_t k = 0; k < span.count; k++)
+	{
+		const uint32_t index = span.cells[k];
+		if (!probability_cell(rays, span, index, &x, &y, &cell)) continue;
+		if (rays.stamps[cell] != rays.scan) continue;
+		rays.stamps[cell] = rays.scan + 1;
+
+		const double cx = rays.info.scale * x + rays.info.scale * 0.5;
+		const double cy = rays.info.scale * y + rays.info.scale * 0.5;
+		const double d = sqrt((cx - rays.px) * (cx - rays.px) + (cy - rays.py) * (cy - rays.py));
+		if (d > rays.max) continue;
+
+		// cells past the occupied band are left alone, like the box does
+		const double dp = laser_probability_model(rays.ranges[cell], d) - 0.5;
+		if (dp == 0.0) continue;
+
+		map_data_t prob = span.data[index];
+		prob += PROBABILITY_CHANGE_RATE * dp;
+		if (prob > 1.0f) prob = 1.0f;
+		if (prob < 0.0f) prob = 0.0f;
+		map_cell_update(span.data, span.multiplication, span.addition, index, 1.0f - PROBABILITY_RUNNING_WEIGHT, PROBABILITY_RUNNING_WEIGHT * prob);
+	}
+}
+
+void MapperDriver::MapProbability(Map *map, const player_pose2d_t &pose2d, const beam_table_t *beams, const float *ranges, const float max)
+{
+	if (probability_rays)
+	{
+		MapProbabilityRays(map, pose2d, beams, ranges, max);
+		return;
 	}
 
 	const double scale = map->getInfo().scale;
-	const player_pose2d_t pose2d = this->position2d_data.pos;
-	
-	// first, find a bounding box
-	const int32_t x_min = (int32_t)floor((pose2d.px - max) / scale);
-	const int32_t x_max = (int32_t)ceil((pose2d.px + max) / scale);
-	const int32_t y_min = (int32_t)floor((pose2d.py - max) / scale);
-	const int32_t y_max = (int32_t)ceil((pose2d.py + max) / scale);
-	
-	// check each cell inside that box
-	for (int32_t y = y_min; y <= y_max; y++)
+
+	// the robot cell, and where the robot is within it
+	const int32_t rx = (int32_t)floor(pose2d.px / scale);
+	const int32_t ry = (int32_t)floor(pose2d.py / scale);
+	const uint32_t qx = std::min((uint32_t)((pose2d.px / scale - rx) * PROBABILITY_TABLE_STEPS), (uint32_t)PROBABILITY_TABLE_STEPS - 1);
+	const uint32_t qy = std::min((uint32_t)((pose2d.py / scale - ry) * PROBABILITY_TABLE_STEPS), (uint32_t)PROBABILITY_TABLE_STEPS - 1);
+	const std::vector<probability_offset_t> &table = ProbabilityTable(scale, max, beams->resolution, qx, qy);
+	const int32_t n = probability_table_radius;
+	const double heading = normalize_angle(pose2d.pa) / beams->resolution;
+
+	// in beams, a whole turn and the beam along the x axis of the laser
+	const double turn = 2.0 * M_PI / beams->resolution;
+	const double origin = -beams->min_angle / beams->resolution;
+	const int last = beams->count - 1;
+
+	// check each cell within range, all geometry comes out of the table
+	const probability_offset_t *offset = &table[0];
+	for (int32_t y = ry - n; y <= ry + n; y++)
 	{
-		for (int32_t x = x_min; x <= x_max; x++)
+		for (int32_t x = rx - n; x <= rx + n; x++, offset++)
 		{
-			// find center of such cell
-			const double cx = scale * x + scale * 0.5;
-			const double cy = scale * y + scale * 0.5;
-			
-			// distance from center
-			const double d = sqrt((cx - pose2d.px) * (cx - pose2d.px) + (cy - pose2d.py) * (cy - pose2d.py));
-			if (d > max) continue;
-			
-			// angle
-			const double a = normalize_angle(atan2(cy - pose2d.py, cx - pose2d.px) - pose2d.pa);
-			const int i = 180 + (int)floor(a / DTOR(0.5) + 0.5);
-			if (i < 0 || i >= 361) continue;
-			
+			if (offset->distance > max) continue;
+
+			// angle in beams, the table has it from the x axis
+			double a = offset->center - heading;
+			if (a < -turn * 0.5) a += turn;
+			else if (a >= turn * 0.5) a -= turn;
+			const int i = (int)floor(origin + a + 0.5);
+			if (i < 0 || i > last) continue;
+
 			// need to take all laser beams landed in this cell into account
-			const double x0 = scale * x;
-			const double y0 = scale * y;
-			const double x1 = scale * x + scale;
-			const double y1 = scale * y + scale;
-			const double a0 = normalize_angle(atan2(y0 - pose2d.py, x0 - pose2d.px) - pose2d.pa);
-			const double a1 = normalize_angle(atan2(y0 - pose2d.py, x1 - pose2d.px) - pose2d.pa);
-			const double a2 = normalize_angle(atan2(y1 - pose2d.py, x0 - pose2d.px) - pose2d.pa);
-			const double a3 = normalize_angle(atan2(y1 - pose2d.py, x1 - pose2d.px) - pose2d.pa);
-			
-			double a_max = a0;
-			if (a1 > a_max) a_max = a1;
-			if (a2 > a_max) a_max = a2;
-			if (a3 > a_max) a_max = a3;
-			
-			double a_min = a0;
-			if (a1 < a_min) a_min = a1;
-			if (a2 < a_min) a_min = a2;
-			if (a3 < a_min) a_min = a3;
-			
-			int i_max = 180 + (int)ceil(a_max / DTOR(0.5));
-			if (i_max > 360) i_max = 360;
-			if (i_max < 0) i_max = 0; 
-			int i_min = 180 + (int)floor(a_max / DTOR(0.5));
-			if (i_min > 360) i_min = 360;
+			const double a_max = a + offset->spread;
+			int i_max = (int)ceil(origin + a_max);
+			if (i_max > last) i_max = last;
+			if (i_max < 0) i_max = 0;
+			int i_min = (int)floor(origin + a_max);
+			if (i_min > last) i_min = last;
 			if (i_min < 0) i_min = 0;
-			
+
 			// laser model
 			double r = ranges[i];
 			for (int j = i_min; j <= i_max; j++)
@@ -104,8 +163,11 @@ void MapperDriver::MapProbability(const float *ranges, const float max)
 				if (ranges[j] < r) r = ranges[j];
 			}
 			if (ranges[i] >= max) r = std::numeric_limits<double>::infinity();
-			
-			double dp = laser_probability_model(r, d) - 0.5;
+
+			// cells past the occupied band would only be blended with themselves
+			double dp = laser_probability_model(r, offset->distance) - 0.5;
+			if (dp == 0.0) continue;
+
 			map_data_t prob = map->get(MAP_CHANNEL_P, x, y, 0);
 			prob += PROBABILITY_CHANGE_RATE * dp;
 			if (prob > 1.0f) prob = 1.0f;
@@ -115,3 +177,99 @@ void MapperDriver::MapProbability(const float *ranges, const float max)
 	}
 }
 
+const std::vector<probability_offset_t>& MapperDriver::ProbabilityTable(double scale, float max, float resolution, uint32_t qx, uint32_t qy)
+{
+	// tables only hold for the scale, range and beams they were made for
+	if (scale != probability_table_scale || max != probability_table_max || resolution != probability_table_resolution)
+	{
+		probability_tables.clear();
+		probability_tables.resize(PROBABILITY_TABLE_STEPS * PROBABILITY_TABLE_STEPS);
+		probability_table_scale = scale;
+		probability_table_max = max;
+		probability_table_resolution = resolution;
+		probability_table_radius = (int32_t)ceil(max / scale) + 1;
+	}
+
+	std::vector<probability_offset_t> &table = probability_tables[qy * PROBABILITY_TABLE_STEPS + qx];
+	if (!table.empty()) return table;
+
+	// the robot is taken to be in the middle of its step
+	const int32_t n = probability_table_radius;
+	const double fx = ((double)qx + 0.5) / PROBABILITY_TABLE_STEPS;
+	const double fy = ((double)qy + 0.5) / PROBABILITY_TABLE_STEPS;
+	table.resize((2 * n + 1) * (2 * n + 1));
+
+	probability_offset_t *offset = &table[0];
+	for (int32_t y = -n; y <= n; y++)
+	{
+		for (int32_t x = -n; x <= n; x++, offset++)
+		{
+			// center and corners of the cell as seen from the robot
+			const double x0 = scale * (x - fx), y0 = scale * (y - fy);
+			const double x1 = x0 + scale, y1 = y0 + scale;
+			const double cx = x0 + scale * 0.5, cy = y0 + scale * 0.5;
+			const double center = atan2(cy, cx);
+
+			// corners are kept relative to the center, so that they do not wrap around apart from it
+			double spread = normalize_angle(atan2(y0, x0) - center);
+			spread = std::max(spread, normalize_angle(atan2(y0, x1) - center));
+			spread = std::max(spread, normalize_angle(atan2(y1, x0) - center));
+			spread = std::max(spread, normalize_angle(atan2(y1, x1) - center));
+
+			offset->distance = sqrt(cx * cx + cy * cy);
+			offset->center = center / resolution;
+			offset->spread = spread / resolution;
+		}
+	}
+	return table;
+}
+
+void MapperDriver::MapProbabilityRays(Map *map, const player_pose2d_t &pose2d, const beam_table_t *beams, const float *ranges, const float max)
+{
+	const map_info_t info = map->getInfo();
+	const double inf = std::numeric_limits<double>::infinity();
+	probability_rays_t rays;
+
+	// the window covers every cell a beam can reach, it only grows
+	rays.info = info;
+	rays.size = (uint32_t)ceil(2.0 * max / info.scale) + 2;
+	rays.x = (int32_t)floor((pose2d.px - max) / info.scale);
+	rays.y = (int32_t)floor((pose2d.py - max) / info.scale);
+	if (probability_ranges.size() < rays.size * rays.size)
+	{
+		probability_ranges.assign(rays.size * rays.size, 0.0f);
+		probability_stamps.assign(rays.size * rays.size, 0);
+	}
+
+	// every scan takes two stamps, touched and updated, so nothing has to be cleared in between
+	probability_scan += 2;
+	if (probability_scan < 2)
+	{
+		std::fill(probability_stamps.begin(), probability_stamps.end(), 0);
+		probability_scan = 2;
+	}
+	rays.ranges = &probability_ranges[0];
+	rays.stamps = &probability_stamps[0];
+	rays.scan = probability_scan;
+	rays.px = pose2d.px;
+	rays.py = pose2d.py;
+	rays.max = max;
+
+	// beams that see nothing clear all the way, the others end past the occupied band
+	const uint32_t count = beams->count;
+	probability_lengths.resize(count);
+	probability_x.resize(count);
+	probability_y.resize(count);
+	for (uint32_t i = 0; i < count; i++)
+		probability_lengths[i] = ranges[i] >= max ? max : std::min((double)max, ranges[i] + D1);
+	beam_project(beams, &probability_lengths[0], pose2d.pa, &probability_x[0], &probability_y[0], 0);
+
+	for (uint32_t i = 0; i < count; i++)
+	{
+		rays.range = ranges[i] >= max ? inf : ranges[i];
+		map->trace(MAP_CHANNEL_P, pose2d.px, pose2d.py, pose2d.px + probability_x[i], pose2d.py + probability_y[i], 0.0, false, &probability_collect, &rays);
+	}
+
+	for (uint32_t i = 0; i < count; i++)
+		map->trace(MAP_CHANNEL_P, pose2d.px, pose2d.py, pose2d.px + probability_x[i], pose2d.py + probability_y[i], 0.0, true, &probability_apply, &rays);
+}
@@ -0,0 +1,93 @@
+#include "stage.h"
+#include "mapper.h"
+
+#include <cassert>
+
+using namespace amos;
+
+MapperStage::MapperStage(MapperDriver *driver, uint32_t stage, const std::string &name, Map *map, uint32_t stats) :
+	Thread(), driver(driver), stage(stage), name(name), map(map), stats(stats), pending(false), quit(false), dropped(0)
+{
+	assert(driver && map);
+}
+
+MapperStage::~MapperStage()
+{
+	// whatever is in the mailbox is not waited for
+	mutex.lock();
+	quit = true;
+	condition.broadcast();
+	mutex.unlock();
+	stop();
+
+	// push out whatever is still pending
+	map->commit();
+	map->flush();
+	delete map;
+	map = 0;
+}
+
+mapper_input_t* MapperStage::reserve()
+{
+	mutex.lock();
+	return &mailbox;
+}
+
+void MapperStage::post()
+{
+	if (pending) dropped++;
+	pending = true;
+	condition.signal();
+	mutex.unlock();
+}
+
+void MapperStage::run()
+{
+	time_t timestamp = time(NULL), stats_timestamp = time(NULL);
+
+	for(;;)
+	{
+		// wait for the next input, but not past the next commit
+		mutex.lock();
+		if (!pending && !quit)
+			condition.wait(&mutex, 1.0);
+		if (quit)
+		{
+			mutex.unlock();
+			break;
+		}
+		const bool ready = pending;
+		const uint32_t lost = dropped;
+		if (pending)
+		{
+			// swapping keeps the buffers of both, so nothing is allocated once they are large enough
+			std::swap(mailbox, input);
+			pending = false;
+		}
+		mutex.unlock();
+
+		if (ready)
+		{
+			PLAYER_MSG1(9, "mapper: map %s begin", name.c_str());
+			driver->MapInput(stage, map, input);
+			PLAYER_MSG1(9, "mapper: map %s end", name.c_str());
+		}
+
+		// commiting every second
+		if (time(NULL) > timestamp)
+		{
+			map->commit();
+			timestamp = time(NULL);
+			PLAYER_MSG4(9, "mapper: %s map committed (%u conflicts, %u retries, %u inputs dropped so far)", name.c_str(), map->getConflicts(), map->getRetries(), lost);
+		}
+
+		// dump what the map cache and its backend have been up to
+		if (stats && time(NULL) >= stats_timestamp + (time_t)stats)
+		{
+			char line[512];
+			map_stats_format(map->stats(), line, sizeof(line));
+			PLAYER_MSG2(1, "mapper: %s map %s", name.c_str(), line);
+			stats_timestamp = time(NULL);
+		}
+	}
+}
@@ -0,0 +1,61 @@
+#ifndef AMOS_PLUGINS_MAPPER_STAGE_H
+#define AMOS_PLUGINS_MAPPER_STAGE_H
+
+#include <libplayercore/playercore.h>
+#include <vector>
+#include <string>
+#include <ctime>
+
+#include "map/map.h"
+#include "thread/thread.h"
+#include "thread/mutex.h"
+#include "thread/condition.h"
+
+#define MAPPER_STAGE_ELEVATION 0
+#define MAPPER_STAGE_VISUAL 1
+#define MAPPER_STAGE_PROBABILITY 2
+
+namespace amos
+{
+	class MapperDriver;
+
+	// a laser scan or a camera frame, with where the robot was when it came in
+	typedef struct mapper_input
+	{
+		player_pose2d_t pose;
+		std::vector<float> ranges;
+		float min_angle, resolution, max_range;
+		std::vector<uint8_t> image;
+		uint32_t width, height;
+	} mapper_input_t;
+
+	// maps one sensor on its own thread into its own map, the mailbox only keeps the latest
+	// input, so a stage that falls behind skips what it could not get to instead of lagging,
+	// the map is committed once a second, the backend work is done by its committer if it has one
+	class MapperStage : public Thread
+	{
+	public:
+		MapperStage(MapperDriver *driver, uint32_t stage, const std::string &name, Map *map, uint32_t stats);
+		virtual ~MapperStage(); // commits what is left and deletes the map
+
+		virtual mapper_input_t* reserve(); // locks the mailbox, the input has to be posted right after
+		virtual void post();
+
+	protected:
+		virtual void run();
+
+		MapperDriver *driver;
+		const uint32_t stage;
+		const std::string name;
+		Map *map;
+		uint32_t stats; // seconds between statistics dumps, 0 for none
+
+		mapper_input_t mailbox, input;
+		bool pending, quit;
+		uint32_t dropped; // inputs replaced before they were mapped
+		Mutex mutex;
+		Condition condition;
+	};
+}
+
+#endif // AMOS_PLUGINS_MAPPER_STAGE_H
@@ -6,25 +6,29 @@
 
 using namespace amos;
 
-void MapperDriver::MapVisual(const uint8_t *image, const uint32_t &width, const uint32_t &height)
+void MapperDriver::MapVisual(Map *map, const player_pose2d_t &pose2d, const uint8_t *image, const uint32_t &width, const uint32_t &height)
 {
-	// copy current location
-	const player_pose2d_t pose2d = this->position2d_data.pos;
 	const double scale = map->getInfo().scale;
+
+	// latest points of the elevation stage, which runs on its own thread
+	elevation_mutex.lock();
+	visual_points = elevation_laser_previous;
+	elevation_mutex.unlock();
+	const std::vector<player_pose3d_t> &points = visual_points;
 	
-	for(int i = 0; i < 361; i++)
+	for(uint32_t i = 0; i < points.size(); i++)
 	{
-		if (elevation_laser_previous[i].px == 0.0f &&
-			elevation_laser_previous[i].py == 0.0f &&
-			elevation_laser_previous[i].pz == 0.0f) continue;
+		if (points[i].px == 0.0f &&
+			points[i].py == 0.0f &&
+			points[i].pz == 0.0f) continue;
 		
-		const int32_t x = elevation_laser_previous[i].px / scale;
-		const int32_t y = elevation_laser_previous[i].py / scale;
+		const int32_t x = points[i].px / scale;
+		const int32_t y = points[i].py / scale;
 
 		// find center of the cell
 		const double cx = scale * x + scale * 0.5;
 		const double cy = scale * y + scale * 0.5;
-		const double e = elevation_laser_previous[i].pz;
+		const double e = points[i].pz;
 
 		const double t = sqrt((cx - pose2d.px) * (cx - pose2d.px) + (cy - pose2d.py) * (cy - pose2d.py));
 		const double a = atan2(cy - pose2d.py, cx - pose2d.px) - pose2d.pa;
@@ -72,6 +76,9 @@ void MapperDriver::MapVisual(const uint8_t *image, const uint32_t &width, const
 		const int fymin = fy1 < fy2 ? (fy1 < 0 ? 0 : fy1) : (fy2 < 0 ? 0 : fy2);
 		const int fymax = fy1 > fy2 ? (fy1 >= (int)height ? height - 1 : fy1) : (fy2 >= (int)height ? height - 1 : fy2);
 
+		// the pixels of a cell are composed first, the same as if they were applied one after another
+		map_data_t weights[4] = { 1.0f, 1.0f, 1.0f, 1.0f };
+		map_data_t values[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
 		for (int fx = fxmin; fx <= fxmax; ++fx)
 		{
 			for (int fy = fymin; fy <= fymax; ++fy)
@@ -81,12 +88,32 @@ void MapperDriver::MapVisual(const uint8_t *image, const uint32_t &width, const
 				const float b = (float)image[fy * width * 3 + fx * 3 + 2] / 255.0f;
 
 				// TODO: configurable weight
-				map->update(MAP_CHANNEL_R, x, y, 0, 1.0f - VISUAL_RUNNING_WEIGHT, VISUAL_RUNNING_WEIGHT * r);
-				map->update(MAP_CHANNEL_G, x, y, 0, 1.0f - VISUAL_RUNNING_WEIGHT, VISUAL_RUNNING_WEIGHT * g);
-				map->update(MAP_CHANNEL_B, x, y, 0, 1.0f - VISUAL_RUNNING_WEIGHT, VISUAL_RUNNING_WEIGHT * b);
+				for (int k = 0; k < 3; k++)
+				{
+					weights[k] *= 1.0f - VISUAL_RUNNING_WEIGHT;
+					values[k] *= 1.0f - VISUAL_RUNNING_WEIGHT;
+				}
+				values[MAP_CHANNEL_RGB_MEMBER_R] += VISUAL_RUNNING_WEIGHT * r;
+				values[MAP_CHANNEL_RGB_MEMBER_G] += VISUAL_RUNNING_WEIGHT * g;
+				values[MAP_CHANNEL_RGB_MEMBER_B] += VISUAL_RUNNING_WEIGHT * b;
 			}
 		}
+		if (fxmin > fxmax || fymin > fymax) continue;
+
+		if (map_groups)
+		{
+			visual_batch->update(MAP_CHANNEL_RGB, x, y, weights, values);
+		}
+		else
+		{
+			visual_batch->update(MAP_CHANNEL_R, x, y, &weights[MAP_CHANNEL_RGB_MEMBER_R], &values[MAP_CHANNEL_RGB_MEMBER_R]);
+			visual_batch->update(MAP_CHANNEL_G, x, y, &weights[MAP_CHANNEL_RGB_MEMBER_G], &values[MAP_CHANNEL_RGB_MEMBER_G]);
+			visual_batch->update(MAP_CHANNEL_B, x, y, &weights[MAP_CHANNEL_RGB_MEMBER_B], &values[MAP_CHANNEL_RGB_MEMBER_B]);
+		}
 #endif
 	}
+
+	// all changes of this scan go to the map at once
+	visual_batch->commit();
 }
 
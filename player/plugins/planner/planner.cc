@@ -1,5 +1,7 @@
 #include "planner.h"
 #include <limits>	
+#include "map/shmbackend.h"
+#include "map/serverbackend.h"
 
 #define PLANNER_PATH_DEVIATION_LIMIT 3.0
 #define PLANNER_NEXT_WAYPOINT_DISTANCE 1.5
@@ -34,6 +36,22 @@ PlannerDriver::PlannerDriver(ConfigFile* cf, int section) :
 		map_servers.push_back(make_pair(std::string("localhost"), (uint16_t)11211));
 	}
 
+	// drivers on the same host can share tiles through shared memory instead, it goes away once the last
+	// of them stops, whoever starts first sets mapshmtiles, the most tiles it will ever hold
+	map_shm = cf->ReadString(section, "mapshm", "");
+	map_shm_tiles = cf->ReadInt(section, "mapshmtiles", 1024);
+
+	// or go through a map server that applies changes itself, see amosmapserver
+	map_server = cf->ReadString(section, "mapserver", "");
+	map_server_port = cf->ReadInt(section, "mapserverport", MAPSERVER_PORT);
+
+	// memory for cached tiles in megabytes, including pending changes, 0 keeps the default
+	map_budget = cf->ReadInt(section, "mapbudget", 0);
+
+	// seconds between dumps of the map cache and backend statistics, 0 for none
+	map_stats = cf->ReadInt(section, "mapstats", 0);
+	map_stats_timestamp = time(NULL);
+
 
     // set up the devices we provide
 	if (cf->ReadDeviceAddr(&planner_addr, section, "provides", PLAYER_PLANNER_CODE, -1, NULL))
@@ -74,7 +92,12 @@ int PlannerDriver::MainSetup()
 	PLAYER_MSG0(3, "planner: setup started");
 
 	// first create the map client
-	map = new Map(map_servers);
+	if (!map_server.empty())
+		map = new Map(new ServerMapBackend(map_server, map_server_port));
+	else if (map_shm.empty())
+		map = new Map(map_servers);
+	else
+		map = new Map(new ShmMapBackend(map_shm, map_servers, map_shm_tiles));
 	if (!map->isOpen())
 	{
 		delete map;
@@ -82,6 +105,7 @@ int PlannerDriver::MainSetup()
 		PLAYER_ERROR("planner: unable to create map");
 		return -1;
 	}
+	if (map_budget) map->setBudget((size_t)map_budget << 20);
 
 	// start up the AStar thread
 	astar = new AStarThread(map, PLANNER_NEXT_WAYPOINT_DISTANCE);
@@ -186,6 +210,16 @@ void PlannerDriver::Main()
 		}
 
 		this->Publish(planner_addr, PLAYER_MSGTYPE_DATA, PLAYER_PLANNER_DATA_STATE, &planner);
+
+		// dump what the map cache and its backend have been up to
+		if (map_stats && time(NULL) >= map_stats_timestamp + (time_t)map_stats)
+		{
+			char line[512];
+			map_stats_format(map->stats(), line, sizeof(line));
+			PLAYER_MSG1(1, "planner: map %s", line);
+			map_stats_timestamp = time(NULL);
+		}
+
 		usleep(10000);
 	}
 
@@ -3,6 +3,7 @@
 
 #include <libplayercore/playercore.h>
 #include <vector>
+#include <ctime>
 
 #include "map/map.h"
 #include "astar.h"
@@ -24,6 +25,13 @@ namespace amos
 		
 		// map
 		std::vector< std::pair<std::string, uint16_t> > map_servers;
+		std::string map_shm;
+		uint32_t map_shm_tiles;
+		std::string map_server;
+		uint16_t map_server_port;
+		uint32_t map_budget;
+		uint32_t map_stats; // seconds between statistics dumps, 0 for none
+		time_t map_stats_timestamp;
 		Map *map;
 		AStarThread *astar;
 	
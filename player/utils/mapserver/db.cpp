@@ -0,0 +1,207 @@
+// *************************************************************************************************
+// include section
+
+#include <iostream>
+
+#include "mapserver.h"
+
+using namespace std;
+
+// *************************************************************************************************
+// implementation section
+
+sqlite3 *db_open(const char* path)
+{
+	sqlite3 *db = 0;
+	if (sqlite3_open(path, &db))
+	{
+		cerr << "ERROR: Failed to open map database: " << sqlite3_errmsg(db) << endl;
+		cerr << endl;
+		sqlite3_close(db);
+		db = 0;
+		return 0;
+	}
+
+	//
+	// Same tables as amosmaptool, so that it can show and load
+	// what the server has saved.
+	//
+	if (sqlite3_exec(db, "BEGIN TRANSACTION; \
+			CREATE TABLE IF NOT EXISTS `tiles` (`channel` integer, `x` integer, `y` integer, `z` integer, `data` blob, `revision` integer, primary key (`channel`, `x`, `y`, `z`)); \
+			CREATE TABLE IF NOT EXISTS `info` (`scale` real, `tile_width` integer, `tile_height` integer, `tile_depth` integer); \
+			COMMIT;", 0, 0, 0) != SQLITE_OK)
+	{
+		cerr << "ERROR: Failed to open map database: " << sqlite3_errmsg(db) << endl;
+		sqlite3_close(db);
+		db = 0;
+		return 0;
+	}
+	return db;
+}
+
+bool db_info(sqlite3 *db, map_info_t &info)
+{
+	int rc = 0;
+	sqlite3_stmt *stmt = 0;
+
+	rc = sqlite3_prepare_v2(db, "SELECT `scale`, `tile_width`, `tile_height`, `tile_depth` FROM `info` LIMIT 1", -1, &stmt, 0);
+	if (rc != SQLITE_OK || stmt == 0)
+	{
+		cerr << "ERROR: Failed to query map information: " << sqlite3_errmsg(db) << endl << endl;
+		goto error;
+	}
+
+	rc = sqlite3_step(stmt);
+	if (rc != SQLITE_ROW)
+	{
+		cerr << "ERROR: No map information, create the database with amosmaptool first." << endl << endl;
+		goto error;
+	}
+	info.scale = sqlite3_column_double(stmt, 0);
+	info.tile_width = sqlite3_column_int(stmt, 1);
+	info.tile_height = sqlite3_column_int(stmt, 2);
+	info.tile_depth = sqlite3_column_int(stmt, 3);
+
+	sqlite3_finalize(stmt);
+	stmt = 0;
+
+	// a little sanity check
+	if (info.scale <= 0.0 || !info.tile_width || !info.tile_height || !info.tile_depth)
+	{
+		cerr << "ERROR: Invalid map information." << endl << endl;
+		goto error;
+	}
+	return true;
+
+error:
+	if (stmt)
+	{
+		sqlite3_finalize(stmt);
+		stmt = 0;
+	}
+	return false;
+}
+
+bool db_load(sqlite3 *db, mapserver_state &state)
+{
+	int rc = 0;
+	sqlite3_stmt *stmt = 0;
+
+	rc = sqlite3_prepare_v2(db, "SELECT `channel`, `x`, `y`, `z`, `data`, `revision` FROM `tiles`", -1, &stmt, 0);
+	if (rc != SQLITE_OK || stmt == 0)
+	{
+		cerr << "ERROR: Failed to query map tiles: " << sqlite3_errmsg(db) << endl << endl;
+		goto error;
+	}
+
+	while ((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+	{
+		const map_tile_id_t id = { (uint32_t)sqlite3_column_int(stmt, 0), sqlite3_column_int(stmt, 1), sqlite3_column_int(stmt, 2), sqlite3_column_int(stmt, 3) };
+		const map_data_t *data = (const map_data_t*)sqlite3_column_blob(stmt, 4);
+
+		if (MAP_CHANNEL_BASE(id.channel) >= MAP_CHANNEL_COUNT)
+		{
+			cerr << "WARNING: Skipping tile [" << id.channel << "," << id.x << "," << id.y << "," << id.z << "] of an unknown channel." << endl;
+			continue;
+		}
+
+		const uint32_t length = state.tile_length * map_channel_width(id.channel);
+		if (!data || sqlite3_column_bytes(stmt, 4) != (int)(sizeof(map_data_t) * length))
+		{
+			cerr << "WARNING: Skipping tile [" << id.channel << "," << id.x << "," << id.y << "," << id.z << "] of the wrong size." << endl;
+			continue;
+		}
+
+		mapserver_entry &entry = state.tiles[id];
+		entry.data.assign(data, data + length);
+		entry.revision = sqlite3_column_int(stmt, 5);
+		entry.dirty = false;
+		state.order.push_back(id);
+	}
+
+	if (rc != SQLITE_DONE)
+	{
+		cerr << "ERROR: Failed to query map tiles: " << sqlite3_errmsg(db) << endl << endl;
+		goto error;
+	}
+	sqlite3_finalize(stmt);
+	stmt = 0;
+	return true;
+
+error:
+	if (stmt)
+	{
+		sqlite3_finalize(stmt);
+		stmt = 0;
+	}
+	return false;
+}
+
+bool db_save(sqlite3 *db, mapserver_state &state)
+{
+	int rc = 0;
+	sqlite3_stmt *stmt = 0;
+
+	//
+	// All dirty tiles go in one transaction, so that the database
+	// never holds half of a save.
+	//
+	if (sqlite3_exec(db, "BEGIN TRANSACTION;", 0, 0, 0) != SQLITE_OK)
+	{
+		cerr << "ERROR: Failed to save map tiles: " << sqlite3_errmsg(db) << endl << endl;
+		return false;
+	}
+
+	rc = sqlite3_prepare_v2(db, "REPLACE INTO `tiles` (`channel`, `x`, `y`, `z`, `data`, `revision`) VALUES (?, ?, ?, ?, ?, ?);", -1, &stmt, 0);
+	if (rc != SQLITE_OK || stmt == 0)
+	{
+		cerr << "ERROR: Failed to save map tiles: " << sqlite3_errmsg(db) << endl << endl;
+		goto error;
+	}
+
+	for (map<map_tile_id_t, mapserver_entry>::const_iterator i = state.tiles.begin(); i != state.tiles.end(); ++i)
+	{
+		if (!i->second.dirty) continue;
+
+		if (sqlite3_bind_int(stmt, 1, i->first.channel) != SQLITE_OK ||
+			sqlite3_bind_int(stmt, 2, i->first.x) != SQLITE_OK ||
+			sqlite3_bind_int(stmt, 3, i->first.y) != SQLITE_OK ||
+			sqlite3_bind_int(stmt, 4, i->first.z) != SQLITE_OK ||
+			sqlite3_bind_blob(stmt, 5, &i->second.data[0], sizeof(map_data_t) * i->second.data.size(), SQLITE_STATIC) != SQLITE_OK ||
+			sqlite3_bind_int(stmt, 6, i->second.revision) != SQLITE_OK)
+		{
+			cerr << "ERROR: Failed to save map tiles: " << sqlite3_errmsg(db) << endl << endl;
+			goto error;
+		}
+
+		if (sqlite3_step(stmt) != SQLITE_DONE)
+		{
+			cerr << "ERROR: Failed to save map tiles: " << sqlite3_errmsg(db) << endl << endl;
+			goto error;
+		}
+		sqlite3_reset(stmt);
+	}
+
+	sqlite3_finalize(stmt);
+	stmt = 0;
+
+	if (sqlite3_exec(db, "COMMIT;", 0, 0, 0) != SQLITE_OK)
+	{
+		cerr << "ERROR: Failed to save map tiles: " << sqlite3_errmsg(db) << endl << endl;
+		goto error;
+	}
+
+	// only now that it is on disk
+	for (map<map_tile_id_t, mapserver_entry>::iterator i = state.tiles.begin(); i != state.tiles.end(); ++i)
+		i->second.dirty = false;
+	return true;
+
+error:
+	if (stmt)
+	{
+		sqlite3_finalize(stmt);
+		stmt = 0;
+	}
+	sqlite3_exec(db, "ROLLBACK;", 0, 0, 0);
+	return false;
+}
@@ -0,0 +1,91 @@
+// *************************************************************************************************
+// include section
+
+#include <cstdlib>
+#include <iostream>
+#include <signal.h>
+#include <unistd.h>
+
+#include "mapserver.h"
+
+using namespace std;
+
+// *************************************************************************************************
+// usage printing section
+
+void usage(const char *name)
+{
+	cerr << "Usage: " << name << " <db-path> [port] [save-interval]" << endl;
+	cerr << endl;
+	cerr << "<db-path>: map database made with amosmaptool create" << endl;
+	cerr << "[port]: to listen on, " << MAPSERVER_PORT << " by default" << endl;
+	cerr << "[save-interval]: seconds between saving changed tiles to the database, 10 by default" << endl;
+	cerr << endl;
+}
+
+// *************************************************************************************************
+// main
+
+static volatile bool running = true;
+
+static void stop(int)
+{
+	running = false;
+}
+
+int main(int argc, char ** argv)
+{
+	mapserver_state state;
+	sqlite3 *db = 0;
+	int listener = -1;
+	uint16_t port = MAPSERVER_PORT;
+	int interval = 10;
+
+	if (argc < 2)
+	{
+		usage(argv[0]);
+		return -1;
+	}
+	if (argc > 2) port = (uint16_t)atoi(argv[2]);
+	if (argc > 3) interval = atoi(argv[3]);
+
+	db = db_open(argv[1]);
+	if (!db) return -2;
+	if (!db_info(db, state.info))
+	{
+		sqlite3_close(db);
+		return -2;
+	}
+	state.tile_length = state.info.tile_width * state.info.tile_height * state.info.tile_depth;
+	if (!db_load(db, state))
+	{
+		sqlite3_close(db);
+		return -2;
+	}
+
+	listener = server_listen(port);
+	if (listener < 0)
+	{
+		sqlite3_close(db);
+		return -2;
+	}
+
+	cout << "Map Server:" << endl;
+	cout << "\t" << argv[1] << " (" << state.tiles.size() << " tiles) on port " << port << endl;
+	cout << endl;
+
+	signal(SIGINT, stop);
+	signal(SIGTERM, stop);
+	signal(SIGPIPE, SIG_IGN);
+
+	const bool done = server_run(state, listener, db, interval, &running);
+
+	// whatever has changed since the last save
+	const bool saved = db_save(db, state);
+
+	for (list<mapserver_connection>::iterator i = state.connections.begin(); i != state.connections.end(); ++i)
+		close(i->fd);
+	close(listener);
+	sqlite3_close(db);
+	return done && saved ? 0 : -2;
+}
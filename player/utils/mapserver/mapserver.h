@@ -0,0 +1,59 @@
+#ifndef AMOS_UTILS_MAPSERVER_H
+#define AMOS_UTILS_MAPSERVER_H
+
+#include <string>
+#include <map>
+#include <list>
+#include <vector>
+#include <stdint.h>
+#include <time.h>
+
+#include <sqlite3.h>
+
+#include "map/define.h"
+#include "map/type.h"
+#include "map/server.h"
+
+// a tile as the server keeps it, dirty until it is written to the database
+struct mapserver_entry
+{
+	std::vector<map_data_t> data;
+	uint32_t revision;
+	bool dirty;
+};
+
+struct mapserver_connection
+{
+	int fd;
+	std::vector<uint8_t> input; // what has come in and is not a whole message yet
+	std::vector<uint8_t> output; // replies waiting for the socket
+	bool subscribed;
+	std::map<map_tile_id_t, uint32_t> notifications; // newest revision of tiles changed by others, sent once output is empty
+};
+
+// what the server remembers about a client between its connections
+struct mapserver_client
+{
+	uint32_t sequence; // of the last changes applied
+	time_t seen;
+};
+
+struct mapserver_state
+{
+	map_info_t info;
+	uint32_t tile_length;
+	std::map<map_tile_id_t, mapserver_entry> tiles;
+	std::vector<map_tile_id_t> order; // tiles in the order they were added, the list cursor points into it
+	std::list<mapserver_connection> connections;
+	std::map<uint64_t, mapserver_client> clients;
+};
+
+extern sqlite3 *db_open(const char* path);
+extern bool db_info(sqlite3 *db, map_info_t &info);
+extern bool db_load(sqlite3 *db, mapserver_state &state);
+extern bool db_save(sqlite3 *db, mapserver_state &state);
+
+extern int server_listen(uint16_t port);
+extern bool server_run(mapserver_state &state, int listener, sqlite3 *db, int interval, volatile bool *running);
+
+#endif // AMOS_UTILS_MAPSERVER_H
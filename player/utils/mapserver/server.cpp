@@ -0,0 +1,353 @@
+// *************************************************************************************************
+// include section
+
+#include <iostream>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "mapserver.h"
+#include "map/merge.h"
+
+using namespace std;
+
+// *************************************************************************************************
+// implementation section
+
+#define SERVER_READ_SIZE (64 * 1024)
+#define SERVER_POLL_TIMEOUT 1000 // ms, how often the save interval is checked when idle
+#define SERVER_CLIENT_TIMEOUT 3600 // seconds a client is remembered after its last changes
+
+int server_listen(uint16_t port)
+{
+	struct sockaddr_in address;
+	int fd = -1, flag = 1;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0) goto error;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
+
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_ANY);
+	address.sin_port = htons(port);
+	if (bind(fd, (struct sockaddr*)&address, sizeof(address)) || listen(fd, 16))
+		goto error;
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	return fd;
+
+error:
+	cerr << "ERROR: Failed to listen on port " << port << ": " << strerror(errno) << endl << endl;
+	if (fd >= 0)
+	{
+		close(fd);
+		fd = -1;
+	}
+	return -1;
+}
+
+static void server_reply(mapserver_connection &connection, uint32_t type, const void *head, uint32_t head_size, const void *body = 0, uint32_t body_size = 0)
+{
+	const mapserver_header_t header = { type, head_size + body_size };
+	connection.output.insert(connection.output.end(), (const uint8_t*)&header, (const uint8_t*)&header + sizeof(header));
+	if (head_size) connection.output.insert(connection.output.end(), (const uint8_t*)head, (const uint8_t*)head + head_size);
+	if (body_size) connection.output.insert(connection.output.end(), (const uint8_t*)body, (const uint8_t*)body + body_size);
+}
+
+static void server_notify(mapserver_state &state, const mapserver_connection *origin, const map_tile_id_t &id, uint32_t revision)
+{
+	// whoever made the change already knows from the reply
+	for (list<mapserver_connection>::iterator i = state.connections.begin(); i != state.connections.end(); ++i)
+	{
+		if (&*i != origin && i->subscribed) i->notifications[id] = revision;
+	}
+}
+
+static mapserver_entry &server_tile(mapserver_state &state, const map_tile_id_t &id)
+{
+	map<map_tile_id_t, mapserver_entry>::iterator i = state.tiles.find(id);
+	if (i != state.tiles.end()) return i->second;
+
+	// new tiles start out like they do in a map
+	mapserver_entry &entry = state.tiles[id];
+	entry.data.assign(state.tile_length * map_channel_width(id.channel), ((map_data_t[])MAP_CHANNEL_DEFAULTS)[MAP_CHANNEL_BASE(id.channel)]);
+	entry.revision = 0;
+	entry.dirty = true;
+	state.order.push_back(id);
+	return entry;
+}
+
+static bool server_valid(const mapserver_state &state, const map_tile_id_t &id, uint32_t begin, uint32_t end)
+{
+	return MAP_CHANNEL_BASE(id.channel) < MAP_CHANNEL_COUNT && begin <= end && end <= state.tile_length * map_channel_width(id.channel);
+}
+
+static bool server_handle(mapserver_state &state, mapserver_connection &connection, const mapserver_header_t &header, const uint8_t *payload)
+{
+	switch (header.type)
+	{
+	case MAPSERVER_INFO:
+		server_reply(connection, MAPSERVER_INFO, &state.info, sizeof(map_info_t));
+		return true;
+
+	case MAPSERVER_SUBSCRIBE:
+		connection.subscribed = true;
+		return true;
+
+	case MAPSERVER_LOAD:
+	{
+		mapserver_tile_t request;
+		if (header.length != sizeof(request)) return false;
+		memcpy(&request, payload, sizeof(request));
+
+		// the data only goes along if the client does not have it already
+		map<map_tile_id_t, mapserver_entry>::const_iterator i = state.tiles.find(request.id);
+		const mapserver_tile_t reply = { request.id, i == state.tiles.end() ? 0 : i->second.revision };
+		if (i == state.tiles.end() || i->second.revision == request.revision)
+			server_reply(connection, MAPSERVER_LOAD, &reply, sizeof(reply));
+		else
+			server_reply(connection, MAPSERVER_LOAD, &reply, sizeof(reply), &i->second.data[0], sizeof(map_data_t) * i->second.data.size());
+		return true;
+	}
+
+	case MAPSERVER_SAVE:
+	{
+		mapserver_save_t request;
+		mapserver_result_t result = { -1, 0 };
+		if (header.length < sizeof(request)) return false;
+		memcpy(&request, payload, sizeof(request));
+
+		if (!server_valid(state, request.id, request.begin, request.end) ||
+			header.length != sizeof(request) + sizeof(map_data_t) * (request.end - request.begin))
+		{
+			server_reply(connection, MAPSERVER_SAVE, &result, sizeof(result));
+			return true;
+		}
+
+		// only if nobody else has saved it since the client checked it out
+		map<map_tile_id_t, mapserver_entry>::const_iterator i = state.tiles.find(request.id);
+		result.revision = i == state.tiles.end() ? 0 : i->second.revision;
+		if (result.revision != request.cas)
+		{
+			result.status = 1;
+			server_reply(connection, MAPSERVER_SAVE, &result, sizeof(result));
+			return true;
+		}
+
+		mapserver_entry &entry = server_tile(state, request.id);
+		memcpy(&entry.data[request.begin], payload + sizeof(request), sizeof(map_data_t) * (request.end - request.begin));
+		entry.revision++;
+		entry.dirty = true;
+
+		result.status = 0;
+		result.revision = entry.revision;
+		server_reply(connection, MAPSERVER_SAVE, &result, sizeof(result));
+		server_notify(state, &connection, request.id, entry.revision);
+		return true;
+	}
+
+	case MAPSERVER_APPLY:
+	{
+		mapserver_apply_t request;
+		mapserver_result_t result = { -1, 0 };
+		if (header.length < sizeof(request)) return false;
+		memcpy(&request, payload, sizeof(request));
+
+		if (!server_valid(state, request.id, request.begin, request.end) ||
+			header.length != sizeof(request) + 2 * sizeof(map_data_t) * (request.end - request.begin))
+		{
+			server_reply(connection, MAPSERVER_APPLY, &result, sizeof(result));
+			return true;
+		}
+
+		// a client that lost the reply sends the same changes again, they are in already if we have seen them
+		mapserver_client &client = state.clients[request.client];
+		client.seen = time(NULL);
+		if (request.sequence <= client.sequence)
+		{
+			map<map_tile_id_t, mapserver_entry>::const_iterator i = state.tiles.find(request.id);
+			if (i == state.tiles.end())
+			{
+				server_reply(connection, MAPSERVER_APPLY, &result, sizeof(result));
+				return true;
+			}
+			result.status = 0;
+			result.revision = i->second.revision;
+			server_reply(connection, MAPSERVER_APPLY, &result, sizeof(result), &i->second.data[0], sizeof(map_data_t) * i->second.data.size());
+			return true;
+		}
+		client.sequence = request.sequence;
+
+		// the changes are not aligned in the message
+		const uint32_t length = request.end - request.begin;
+		vector<map_data_t> changes(2 * length + 1);
+		memcpy(&changes[0], payload + sizeof(request), 2 * sizeof(map_data_t) * length);
+
+		// this is the only place tiles change, so there is nothing to conflict with
+		mapserver_entry &entry = server_tile(state, request.id);
+		const uint32_t previous = entry.revision;
+		map_tile_merge(&entry.data[0] + request.begin, &changes[0], &changes[length], length);
+		entry.revision++;
+		entry.dirty = true;
+
+		// the client only has to catch up if someone else got there first
+		result.status = 0;
+		result.revision = entry.revision;
+		if (previous == request.revision)
+			server_reply(connection, MAPSERVER_APPLY, &result, sizeof(result));
+		else
+			server_reply(connection, MAPSERVER_APPLY, &result, sizeof(result), &entry.data[0], sizeof(map_data_t) * entry.data.size());
+		server_notify(state, &connection, request.id, entry.revision);
+		return true;
+	}
+
+	case MAPSERVER_LIST:
+	{
+		uint64_t cursor = 0;
+		if (header.length != sizeof(cursor)) return false;
+		memcpy(&cursor, payload, sizeof(cursor));
+
+		const uint64_t next = state.order.size();
+		if (cursor > next) cursor = next;
+		server_reply(connection, MAPSERVER_LIST, &next, sizeof(next),
+			cursor < next ? &state.order[cursor] : 0, sizeof(map_tile_id_t) * (next - cursor));
+		return true;
+	}
+
+	default:
+		return false;
+	}
+}
+
+static bool server_read(mapserver_state &state, mapserver_connection &connection)
+{
+	uint8_t buffer[SERVER_READ_SIZE];
+	size_t offset = 0;
+
+	ssize_t received = recv(connection.fd, buffer, sizeof(buffer), 0);
+	if (received < 0) return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+	if (received == 0) return false;
+	connection.input.insert(connection.input.end(), buffer, buffer + received);
+
+	// handle every whole message, in order
+	while (connection.input.size() - offset >= sizeof(mapserver_header_t))
+	{
+		mapserver_header_t header;
+		memcpy(&header, &connection.input[offset], sizeof(header));
+		if (header.length > MAPSERVER_MESSAGE_MAX) return false;
+		if (connection.input.size() - offset - sizeof(header) < header.length) break;
+
+		if (!server_handle(state, connection, header, &connection.input[offset] + sizeof(header)))
+			return false;
+		offset += sizeof(header) + header.length;
+	}
+	connection.input.erase(connection.input.begin(), connection.input.begin() + offset);
+	return true;
+}
+
+static bool server_write(mapserver_connection &connection)
+{
+	// notifications wait until the replies are out, so a tile that keeps changing is only sent once
+	if (connection.output.empty())
+	{
+		for (map<map_tile_id_t, uint32_t>::const_iterator i = connection.notifications.begin(); i != connection.notifications.end(); ++i)
+		{
+			const mapserver_tile_t notification = { i->first, i->second };
+			server_reply(connection, MAPSERVER_NOTIFY, &notification, sizeof(notification));
+		}
+		connection.notifications.clear();
+	}
+
+	while (!connection.output.empty())
+	{
+		ssize_t sent = send(connection.fd, &connection.output[0], connection.output.size(), MSG_NOSIGNAL);
+		if (sent < 0) return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+		connection.output.erase(connection.output.begin(), connection.output.begin() + sent);
+	}
+	return true;
+}
+
+bool server_run(mapserver_state &state, int listener, sqlite3 *db, int interval, volatile bool *running)
+{
+	vector<struct pollfd> events;
+	time_t saved = time(NULL), pruned = time(NULL);
+
+	while (*running)
+	{
+		// the listener first, then every connection in list order
+		events.clear();
+		events.push_back((struct pollfd){ listener, POLLIN, 0 });
+		for (list<mapserver_connection>::const_iterator i = state.connections.begin(); i != state.connections.end(); ++i)
+		{
+			const bool pending = !i->output.empty() || !i->notifications.empty();
+			events.push_back((struct pollfd){ i->fd, (short)(POLLIN | (pending ? POLLOUT : 0)), 0 });
+		}
+
+		if (poll(&events[0], events.size(), SERVER_POLL_TIMEOUT) < 0 && errno != EINTR)
+		{
+			cerr << "ERROR: poll: " << strerror(errno) << endl << endl;
+			return false;
+		}
+
+		// requests of every connection are handled as they come in, one whole message at a time,
+		// so every change is applied atomically without any locking
+		list<mapserver_connection>::iterator i = state.connections.begin();
+		for (size_t j = 1; j < events.size(); j++)
+		{
+			bool open = !(events[j].revents & (POLLERR | POLLNVAL));
+			if (open && (events[j].revents & (POLLIN | POLLHUP))) open = server_read(state, *i);
+			if (open) open = server_write(*i);
+
+			if (open)
+			{
+				++i;
+				continue;
+			}
+			close(i->fd);
+			i = state.connections.erase(i);
+		}
+
+		if (events[0].revents & POLLIN)
+		{
+			int fd = accept(listener, 0, 0);
+			if (fd >= 0)
+			{
+				int flag = 1;
+				setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+				fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+				mapserver_connection connection;
+				connection.fd = fd;
+				connection.subscribed = false;
+				state.connections.push_back(connection);
+			}
+		}
+
+		if (interval > 0 && time(NULL) - saved >= interval)
+		{
+			db_save(db, state);
+			saved = time(NULL);
+		}
+
+		// clients that have been gone for long will not send anything again
+		if (time(NULL) - pruned >= SERVER_CLIENT_TIMEOUT)
+		{
+			for (map<uint64_t, mapserver_client>::iterator i = state.clients.begin(); i != state.clients.end();)
+			{
+				if (time(NULL) - i->second.seen >= SERVER_CLIENT_TIMEOUT)
+					state.clients.erase(i++);
+				else
+					++i;
+			}
+			pruned = time(NULL);
+		}
+	}
+	return true;
+}
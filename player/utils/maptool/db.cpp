@@ -311,7 +311,7 @@ bool db_load(const char* path, const vector< pair<string, uint16_t> > &servers)
 						sqlite3_column_int(stmt, 2),
 						sqlite3_column_int(stmt, 3) },
 					(const map_data_t*)sqlite3_column_blob(stmt, 4),
-					info.tile_width * info.tile_height * info.tile_depth,
+					info.tile_width * info.tile_height * info.tile_depth * map_channel_width(sqlite3_column_int(stmt, 0)),
 					sqlite3_column_int(stmt, 5)
 				)) goto error;
 			
@@ -7,6 +7,7 @@
 
 #include "maptool.h"
 #include "map/memcached.h"
+#include "map/memcachedbackend.h"
 
 using namespace std;
 
@@ -90,49 +91,20 @@ error:
 
 bool memcached_list(memcached_st *memc, set<map_tile_id_t> &tiles)
 {
-	memcached_return mr = MEMCACHED_SUCCESS;
-	memcachedmap_key_t list_key;
-	size_t list_size = 0;
-	uint32_t list_flags = 0;
-	char *list_data = 0;
-	map_tile_id_t *list_ptr = 0;
-	unsigned int i = 0;
-
-	memset(&list_key, 0, sizeof(memcachedmap_key_t));
-	list_key.ns = MEMCACHEDMAP_KEY_NAMESPACE;
-	list_key.type = MEMCACHEDMAP_KEY_TYPE_LIST;
-	list_data = memcached_get(memc, (const char*)&list_key, MEMCACHEDMAP_KEY_SIZE, &list_size, &list_flags, &mr);
-
-	// it might be the case that no tile exists yet
-	if (list_data)
-	{
-		if (list_size % sizeof(map_tile_id_t) != 0)
-			goto error;
+	vector<map_tile_id_t> list;
+	uint64_t cursor = 0, previous = 0;
 
-		list_ptr = (map_tile_id_t*)list_data;
-		for (i = 0; i < list_size / sizeof(map_tile_id_t); i++, list_ptr++)
-			tiles.insert(*list_ptr);
-		free(list_data);
-		list_data = 0;
-	}
-	else if (mr != MEMCACHED_NOTFOUND)
+	// read the whole list from the beginning, a chunk left short by a writer that failed
+	// is only given up on after a number of reads, so keep going until the cursor stays put
+	do
 	{
-		goto error;
+		previous = cursor;
+		if (!amos::MemcachedMapBackend::readList(memc, &cursor, list))
+			return false;
 	}
+	while (cursor != previous);
+	tiles.insert(list.begin(), list.end());
 	return true;
-
-error:
-	if (mr != MEMCACHED_SUCCESS)
-	{
-		cerr << "ERROR: memcached_list: " << memcached_strerror(memc, mr) << endl << endl;
-	}
-
-	if (list_data)
-	{
-		free(list_data);
-		list_data = 0;
-	}
-	return false;
 }
 
 bool memcached_show(const vector< pair<string, uint16_t> > &servers)
@@ -217,32 +189,19 @@ error:
 bool memcached_load(memcached_st *memc, const map_tile_id_t &id, const map_data_t *data, const uint32_t &length, const uint32_t &revision)
 {
 	memcached_return mr = MEMCACHED_SUCCESS;
-	memcachedmap_key_t tile_data_key, tile_revision_key, tile_lock_key, list_key;
+	memcachedmap_key_t tile_data_key, tile_revision_key;
+	vector<char> value(MEMCACHEDMAP_TILE_HEADER_SIZE + map_tile_wire_size(id.channel, length));
 	
-	// lock up the tile
-	memset(&tile_lock_key, 0, sizeof(memcachedmap_key_t));
-	tile_lock_key.ns = MEMCACHEDMAP_KEY_NAMESPACE;
-	tile_lock_key.type = MEMCACHEDMAP_KEY_TYPE_TILE_LOCK;
-	map_tile_id_to_hex(id, tile_lock_key.id);
+	// revision goes together with data, which is stored in the type of its channel
+	((memcachedmap_tile_header_t*)&value[0])->revision = revision;
+	map_tile_encode(id.channel, data, length, (uint8_t*)&value[MEMCACHEDMAP_TILE_HEADER_SIZE]);
 
-	for(;;)
-	{
-		// the lock has some bogus data in it, because we don't really care
-		mr = memcached_add(memc, (const char*)&tile_lock_key, MEMCACHEDMAP_KEY_WITH_ID_SIZE, "L", 1, (time_t)0, 0);
-		// if we see a collision, it means someone has a lock on the tile already, so we wait
-		if (mr != MEMCACHED_NOTSTORED) break;
-		usleep(100); // make sure we don't use up 100% CPU when the network is fast
-	}
-
-	if (mr != MEMCACHED_SUCCESS)
-		goto error;
-	
 	// set data
 	memset(&tile_data_key, 0, sizeof(memcachedmap_key_t));
 	tile_data_key.ns = MEMCACHEDMAP_KEY_NAMESPACE;
 	tile_data_key.type = MEMCACHEDMAP_KEY_TYPE_TILE_DATA;
-	memcpy(tile_data_key.id, tile_lock_key.id, MEMCACHEDMAP_KEY_ID_SIZE);
-	mr = memcached_set(memc, (const char*)&tile_data_key, MEMCACHEDMAP_KEY_WITH_ID_SIZE, (const char*)data, sizeof(map_data_t) * length, (time_t)0, 0);
+	map_tile_id_to_hex(id, tile_data_key.id);
+	mr = memcached_set(memc, (const char*)&tile_data_key, MEMCACHEDMAP_KEY_WITH_ID_SIZE, &value[0], value.size(), (time_t)0, 0);
 	if (mr != MEMCACHED_SUCCESS)
 		goto error;
 	
@@ -250,21 +209,13 @@ bool memcached_load(memcached_st *memc, const map_tile_id_t &id, const map_data_
 	memset(&tile_revision_key, 0, sizeof(memcachedmap_key_t));
 	tile_revision_key.ns = MEMCACHEDMAP_KEY_NAMESPACE;
 	tile_revision_key.type = MEMCACHEDMAP_KEY_TYPE_TILE_REVISION;
-	memcpy(tile_revision_key.id, tile_lock_key.id, MEMCACHEDMAP_KEY_ID_SIZE);
+	memcpy(tile_revision_key.id, tile_data_key.id, MEMCACHEDMAP_KEY_ID_SIZE);
 	mr = memcached_set(memc, (const char*)&tile_revision_key, MEMCACHEDMAP_KEY_WITH_ID_SIZE, (const char*)&revision, sizeof(uint32_t), (time_t)0, 0);
 	if (mr != MEMCACHED_SUCCESS)
 		goto error;
 
 	// add to list of tiles
-	memset(&list_key, 0, sizeof(memcachedmap_key_t));
-	list_key.ns = MEMCACHEDMAP_KEY_NAMESPACE;
-	list_key.type = MEMCACHEDMAP_KEY_TYPE_LIST;
-	mr = memcached_append(memc, (const char*)&list_key, MEMCACHEDMAP_KEY_SIZE, (const char*)&id, sizeof(map_tile_id_t), (time_t)0, 0);
-	if (mr != MEMCACHED_SUCCESS)
-		goto error;
-
-	// unlock
-	mr = memcached_delete(memc, (const char*)&tile_lock_key, MEMCACHEDMAP_KEY_WITH_ID_SIZE, (time_t)0);
+	mr = amos::MemcachedMapBackend::appendList(memc, id);
 	if (mr != MEMCACHED_SUCCESS)
 		goto error;
 
@@ -281,7 +232,7 @@ error:
 bool memcached_init(memcached_st *memc, const map_info_t &info)
 {
 	memcached_return mr = MEMCACHED_SUCCESS;
-	memcachedmap_key_t info_key, list_key;
+	memcachedmap_key_t info_key, count_key;
 	
 	memset(&info_key, 0, sizeof(memcachedmap_key_t));
 	info_key.ns = MEMCACHEDMAP_KEY_NAMESPACE;
@@ -290,10 +241,11 @@ bool memcached_init(memcached_st *memc, const map_info_t &info)
 	if (mr != MEMCACHED_SUCCESS)
 		goto error;
 
-	memset(&list_key, 0, sizeof(memcachedmap_key_t));
-	list_key.ns = MEMCACHEDMAP_KEY_NAMESPACE;
-	list_key.type = MEMCACHEDMAP_KEY_TYPE_LIST;
-	mr = memcached_set(memc, (const char*)&list_key, MEMCACHEDMAP_KEY_SIZE, "", 0, (time_t)0, 0);
+	// start with an empty list of tiles
+	memset(&count_key, 0, sizeof(memcachedmap_key_t));
+	count_key.ns = MEMCACHEDMAP_KEY_NAMESPACE;
+	count_key.type = MEMCACHEDMAP_KEY_TYPE_LIST_COUNT;
+	mr = memcached_set(memc, (const char*)&count_key, MEMCACHEDMAP_KEY_SIZE, "0", 1, (time_t)0, 0);
 	if (mr != MEMCACHED_SUCCESS)
 		goto error;
 
@@ -315,10 +267,11 @@ bool memcached_save(const char* path, const std::vector< std::pair<std::string,
 	sqlite3 *db = 0;
 	map_info_t info = {0}, info2 = {0};
 	set<map_tile_id_t> tiles;
-	memcachedmap_key_t tile_revision_key, tile_data_key;
-	size_t tile_revision_size = 0, tile_data_size = 0;
-	uint32_t tile_revision_flags = 0, tile_data_flags = 0;
-	char *tile_revision_data = 0, *tile_data_data = 0;
+	memcachedmap_key_t tile_data_key;
+	size_t tile_data_size = 0;
+	uint32_t tile_data_flags = 0;
+	char *tile_data_data = 0;
+	vector<map_data_t> tile;
 
 	memc = memcached_connect(servers);
 	if (!memc) goto error;
@@ -352,30 +305,23 @@ bool memcached_save(const char* path, const std::vector< std::pair<std::string,
 	
 	if (!memcached_list(memc, tiles)) goto error;
 
-	memset(&tile_revision_key, 0, sizeof(memcachedmap_key_t));
-	tile_revision_key.ns = MEMCACHEDMAP_KEY_NAMESPACE;
-	tile_revision_key.type = MEMCACHEDMAP_KEY_TYPE_TILE_REVISION;
 	memset(&tile_data_key, 0, sizeof(memcachedmap_key_t));
 	tile_data_key.ns = MEMCACHEDMAP_KEY_NAMESPACE;
 	tile_data_key.type = MEMCACHEDMAP_KEY_TYPE_TILE_DATA;
 
 	for (set<map_tile_id_t>::const_iterator i = tiles.begin(); i != tiles.end(); i++)
 	{
-		// get revision number
-		map_tile_id_to_hex(*i, tile_revision_key.id);
-		tile_revision_data = memcached_get(memc, (const char*)&tile_revision_key, MEMCACHEDMAP_KEY_WITH_ID_SIZE, &tile_revision_size, &tile_revision_flags, &mr);
-		if (!tile_revision_data) goto error;
-		if (tile_revision_size != sizeof(uint32_t)) goto error;
-
-		// get tile data
-		memcpy(tile_data_key.id, tile_revision_key.id, MEMCACHEDMAP_KEY_ID_SIZE);
+		// get tile data, revision is stored in front of it, channel groups have longer tiles
+		tile.resize(info.tile_width * info.tile_height * info.tile_depth * map_channel_width(i->channel));
+		map_tile_id_to_hex(*i, tile_data_key.id);
 		tile_data_data = memcached_get(memc, (const char*)&tile_data_key, MEMCACHEDMAP_KEY_WITH_ID_SIZE, &tile_data_size, &tile_data_flags, &mr);
 		if (!tile_data_data) goto error;
-		if (tile_data_size != sizeof(map_data_t) * info.tile_width * info.tile_height * info.tile_depth) goto error;
-		if (!db_save(db, *i, (const map_data_t*)tile_data_data, info.tile_width * info.tile_height * info.tile_depth, *((uint32_t*)tile_revision_data))) goto error;
+		if (tile_data_size != MEMCACHEDMAP_TILE_HEADER_SIZE + map_tile_wire_size(i->channel, tile.size())) goto error;
+
+		// the database always keeps floats
+		map_tile_decode(i->channel, (const uint8_t*)tile_data_data + MEMCACHEDMAP_TILE_HEADER_SIZE, tile.size(), &tile[0]);
+		if (!db_save(db, *i, &tile[0], tile.size(), ((memcachedmap_tile_header_t*)tile_data_data)->revision)) goto error;
 
-		free(tile_revision_data);
-		tile_revision_data = 0;
 		free(tile_data_data);
 		tile_data_data = 0;
 	}
@@ -403,11 +349,6 @@ error:
 		sqlite3_close(db);
 		db = 0;
 	}
-	if (tile_revision_data)
-	{
-		free(tile_revision_data);
-		tile_revision_data = 0;
-	}
 	if (tile_data_data)
 	{
 		free(tile_data_data);
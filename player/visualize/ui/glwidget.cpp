@@ -6,6 +6,7 @@
 #include "../model/robot.h"
 #include <libplayerc++/playerc++.h>
 #include <QDebug>
+#include <limits>
 
 #define MOUSE_MODE_NONE 0
 #define MOUSE_MODE_PITCH_YAW 1
@@ -17,6 +18,8 @@
 #define MODE_P			3
 #define MODE_P_CSPACE	4
 
+#define GLWIDGET_LEVEL_DISTANCE 20.0f // eye distance beyond which every doubling draws one level coarser
+
 using namespace amos;
 
 GLWidget::GLWidget(World *world, Robot *robot, QWidget *parent) :
@@ -54,6 +57,7 @@ GLWidget::GLWidget(World *world, Robot *robot, QWidget *parent) :
 		std::set<map_tile_id_t> tiles = world->getMap()->list(true);
 		for (std::set<map_tile_id_t>::iterator i = tiles.begin(); i != tiles.end(); ++i)
 		{
+			if (MAP_CHANNEL_LEVEL_OF(i->channel)) continue;
 			if (x_min == 0 && x_max == 0 && y_min == 0 && y_max == 0)
 			{
 				x_min = i->x; x_max = i->x;
@@ -176,6 +180,7 @@ void GLWidget::updateWorld()
 	std::vector<vertex_t> vertices;
 	std::vector<color_t> colors;
 	const map_data_t *e_avg = 0, *e_var = 0, *r = 0, *g = 0, *b = 0, *p = 0, *p_cspace = 0;
+	uint32_t e_stride = 1, rgb_stride = 1;
 	float tile_base_x = 0.0, tile_base_y = 0.0, cell_base_x = 0.0, cell_base_y = 0.0;
 	float z = 0.0;
 	uint32_t index = 0;
@@ -191,36 +196,66 @@ void GLWidget::updateWorld()
 
 	// first, get a list of tiles
 	std::set<map_tile_id_t> tiles = map->list(true);
+
+	// from far away, draw a coarser level instead if the map has one
+	uint32_t level = 0;
+	for (float distance = GLWIDGET_LEVEL_DISTANCE; vr > distance && level + 1 < MAP_LEVELS; distance *= 2.0f)
+		level++;
+	for (; level > 0; level--)
+	{
+		const int32_t min = std::numeric_limits<int32_t>::min();
+		std::set<map_tile_id_t>::iterator i = tiles.lower_bound((map_tile_id_t){MAP_CHANNEL_LEVEL(0, level), min, min, min});
+		if (i != tiles.end() && MAP_CHANNEL_LEVEL_OF(i->channel) == level) break;
+	}
+	const float scale = info.scale * (1 << level);
+
 	for (std::set<map_tile_id_t>::iterator i = tiles.begin(); i != tiles.end(); i++)
 	{
-		tile_base_x = offset_x + info.scale * (int)i->x * info.tile_width;
-		tile_base_y = offset_y + info.scale * (int)i->y * info.tile_height;
+		tile_base_x = offset_x + scale * (int)i->x * info.tile_width;
+		tile_base_y = offset_y + scale * (int)i->y * info.tile_height;
 		if (vr < 5.0 && sqrt((tile_base_x - vx) * (tile_base_x - vx) + (tile_base_y - vy) * (tile_base_y - vy)) > 100.0f) continue;
 
 		if (mode == MODE_P)
 		{
-			if (i->channel != MAP_CHANNEL_P) continue;
-			p = map->get((map_tile_id_t){MAP_CHANNEL_P, i->x, i->y, 0});
+			if (i->channel != MAP_CHANNEL_LEVEL(MAP_CHANNEL_P, level)) continue;
+			p = map->get((map_tile_id_t){MAP_CHANNEL_LEVEL(MAP_CHANNEL_P, level), i->x, i->y, 0});
 			if (!p) continue;
 		}
 		else if (mode == MODE_P_CSPACE)
 		{
-			if (i->channel != MAP_CHANNEL_P_CSPACE) continue;
-			p_cspace = map->get((map_tile_id_t){MAP_CHANNEL_P_CSPACE, i->x, i->y, 0});
+			if (i->channel != MAP_CHANNEL_LEVEL(MAP_CHANNEL_P_CSPACE, level)) continue;
+			p_cspace = map->get((map_tile_id_t){MAP_CHANNEL_LEVEL(MAP_CHANNEL_P_CSPACE, level), i->x, i->y, 0});
 			if (!p_cspace) continue;
 		}
+		else if (i->channel == MAP_CHANNEL_LEVEL(MAP_CHANNEL_E, level))
+		{
+			// channel groups, the values of a cell are next to each other
+			e_avg = map->get(*i);
+			if (!e_avg) continue;
+			e_var = e_avg + MAP_CHANNEL_E_MEMBER_VAR;
+			e_avg = e_avg + MAP_CHANNEL_E_MEMBER_AVG;
+			e_stride = map_channel_width(MAP_CHANNEL_E);
+
+			r = (mode == MODE_RGB) ? map->get((map_tile_id_t){MAP_CHANNEL_LEVEL(MAP_CHANNEL_RGB, level), i->x, i->y, 0}) : 0;
+			g = r ? r + MAP_CHANNEL_RGB_MEMBER_G : 0;
+			b = r ? r + MAP_CHANNEL_RGB_MEMBER_B : 0;
+			r = r ? r + MAP_CHANNEL_RGB_MEMBER_R : 0;
+			rgb_stride = map_channel_width(MAP_CHANNEL_RGB);
+		}
 		else
 		{
-			if (i->channel != MAP_CHANNEL_E_AVG) continue;
+			if (i->channel != MAP_CHANNEL_LEVEL(MAP_CHANNEL_E_AVG, level)) continue;
 			// if we don't have data for the tile yet, we continue
-			e_avg = map->get((map_tile_id_t){MAP_CHANNEL_E_AVG, i->x, i->y, 0});
+			e_avg = map->get((map_tile_id_t){MAP_CHANNEL_LEVEL(MAP_CHANNEL_E_AVG, level), i->x, i->y, 0});
 			if (!e_avg) continue;
-			e_var = map->get((map_tile_id_t){MAP_CHANNEL_E_VAR, i->x, i->y, 0});
+			e_var = map->get((map_tile_id_t){MAP_CHANNEL_LEVEL(MAP_CHANNEL_E_VAR, level), i->x, i->y, 0});
 			if (!e_var) continue;
+			e_stride = 1;
 
-			r = (mode == MODE_RGB) ? map->get((map_tile_id_t){MAP_CHANNEL_R, i->x, i->y, 0}) : 0;
-			g = (mode == MODE_RGB) ? map->get((map_tile_id_t){MAP_CHANNEL_G, i->x, i->y, 0}) : 0;
-			b = (mode == MODE_RGB) ? map->get((map_tile_id_t){MAP_CHANNEL_B, i->x, i->y, 0}) : 0;
+			r = (mode == MODE_RGB) ? map->get((map_tile_id_t){MAP_CHANNEL_LEVEL(MAP_CHANNEL_R, level), i->x, i->y, 0}) : 0;
+			g = (mode == MODE_RGB) ? map->get((map_tile_id_t){MAP_CHANNEL_LEVEL(MAP_CHANNEL_G, level), i->x, i->y, 0}) : 0;
+			b = (mode == MODE_RGB) ? map->get((map_tile_id_t){MAP_CHANNEL_LEVEL(MAP_CHANNEL_B, level), i->x, i->y, 0}) : 0;
+			rgb_stride = 1;
 		}
 
 
@@ -228,11 +263,11 @@ void GLWidget::updateWorld()
 		// then build elevation mapping
 		for (uint32_t y = 0; y < info.tile_height; ++y)
 		{
-			cell_base_y = tile_base_y + info.scale * y;
+			cell_base_y = tile_base_y + scale * y;
 
 			for (uint32_t x = 0; x < info.tile_width; ++x)
 			{
-				cell_base_x = tile_base_x + info.scale * x;
+				cell_base_x = tile_base_x + scale * x;
 				if (vr < 5.0 && sqrt((cell_base_x - vx) * (cell_base_x - vx) + (cell_base_y - vy) * (cell_base_y - vy)) > 15.0f) continue;
 				index = y * info.tile_width + (int)x;
 
@@ -254,43 +289,43 @@ void GLWidget::updateWorld()
 				}
 				else
 				{
-					if (e_avg[index] == 0.0f && e_var[index] == 0.0f) continue;
-					z = e_avg[index];
+					if (e_avg[index * e_stride] == 0.0f && e_var[index * e_stride] == 0.0f) continue;
+					z = e_avg[index * e_stride];
 				}
 
 				// draw a box
-				vertices.push_back((vertex_t){cell_base_x, 				cell_base_y + info.scale,	z});
-				vertices.push_back((vertex_t){cell_base_x + info.scale,	cell_base_y + info.scale,	z});
-				vertices.push_back((vertex_t){cell_base_x + info.scale,	cell_base_y,				z});
+				vertices.push_back((vertex_t){cell_base_x, 				cell_base_y + scale,	z});
+				vertices.push_back((vertex_t){cell_base_x + scale,	cell_base_y + scale,	z});
+				vertices.push_back((vertex_t){cell_base_x + scale,	cell_base_y,				z});
 				vertices.push_back((vertex_t){cell_base_x,				cell_base_y,				z});
 
 				if (vr < 5.0)
 				{
-					vertices.push_back((vertex_t){cell_base_x, 				cell_base_y + info.scale,	z});
-					vertices.push_back((vertex_t){cell_base_x + info.scale,	cell_base_y + info.scale,	z});
-					vertices.push_back((vertex_t){cell_base_x + info.scale,	cell_base_y + info.scale,	-0.5f});
-					vertices.push_back((vertex_t){cell_base_x,				cell_base_y + info.scale,	-0.5f});
+					vertices.push_back((vertex_t){cell_base_x, 				cell_base_y + scale,	z});
+					vertices.push_back((vertex_t){cell_base_x + scale,	cell_base_y + scale,	z});
+					vertices.push_back((vertex_t){cell_base_x + scale,	cell_base_y + scale,	-0.5f});
+					vertices.push_back((vertex_t){cell_base_x,				cell_base_y + scale,	-0.5f});
 
-					vertices.push_back((vertex_t){cell_base_x + info.scale, cell_base_y + info.scale,	z});
-					vertices.push_back((vertex_t){cell_base_x + info.scale,	cell_base_y,				z});
-					vertices.push_back((vertex_t){cell_base_x + info.scale,	cell_base_y,				-0.5f});
-					vertices.push_back((vertex_t){cell_base_x + info.scale,	cell_base_y + info.scale,	-0.5f});
+					vertices.push_back((vertex_t){cell_base_x + scale, cell_base_y + scale,	z});
+					vertices.push_back((vertex_t){cell_base_x + scale,	cell_base_y,				z});
+					vertices.push_back((vertex_t){cell_base_x + scale,	cell_base_y,				-0.5f});
+					vertices.push_back((vertex_t){cell_base_x + scale,	cell_base_y + scale,	-0.5f});
 
-					vertices.push_back((vertex_t){cell_base_x + info.scale,	cell_base_y,				z});
+					vertices.push_back((vertex_t){cell_base_x + scale,	cell_base_y,				z});
 					vertices.push_back((vertex_t){cell_base_x,				cell_base_y,				z});
 					vertices.push_back((vertex_t){cell_base_x,				cell_base_y,				-0.5f});
-					vertices.push_back((vertex_t){cell_base_x + info.scale,	cell_base_y,				-0.5f});
+					vertices.push_back((vertex_t){cell_base_x + scale,	cell_base_y,				-0.5f});
 
 					vertices.push_back((vertex_t){cell_base_x,				cell_base_y,				z});
-					vertices.push_back((vertex_t){cell_base_x,				cell_base_y + info.scale,	z});
-					vertices.push_back((vertex_t){cell_base_x,				cell_base_y + info.scale,	-0.5f});
+					vertices.push_back((vertex_t){cell_base_x,				cell_base_y + scale,	z});
+					vertices.push_back((vertex_t){cell_base_x,				cell_base_y + scale,	-0.5f});
 					vertices.push_back((vertex_t){cell_base_x,				cell_base_y,				-0.5f});
 				}
 
 				// determine color
 				if (mode == MODE_RGB)
 				{
-					color = (color_t){r ? r[index] : 0.0f, g ? g[index] : 0.0f, b ? b[index] : 0.0f, 1.0f};
+					color = (color_t){r ? r[index * rgb_stride] : 0.0f, g ? g[index * rgb_stride] : 0.0f, b ? b[index * rgb_stride] : 0.0f, 1.0f};
 				}
 				else if (mode == MODE_P)
 				{
@@ -308,14 +343,14 @@ void GLWidget::updateWorld()
 				}
 				else if (mode == MODE_E_VAR)
 				{
-					float var = e_var[index] * 40000.0f;
+					float var = e_var[index * e_stride] * 40000.0f;
 					if (var > 1.0f) var = 1.0f;
 					if (var < 0.0f) var = 0.0f;
 					color = (color_t){color_map[(int)(var * 200)][0], color_map[(int)(var * 200)][1], color_map[(int)(var * 200)][2], 1.0f};
 				}
 				else
 				{
-					float avg = e_avg[index] + 0.5f;
+					float avg = e_avg[index * e_stride] + 0.5f;
 					if (avg > 1.0f) avg = 1.0f;
 					if (avg < 0.0f) avg = 0.0f;
 					color = (color_t){color_map[(int)(avg * 200)][0], color_map[(int)(avg * 200)][1], color_map[(int)(avg * 200)][2], 1.0f};
@@ -11,7 +11,7 @@ UI_DIR = .ui
 INCLUDEPATH += /usr/local/include/player-3.0
 LIBS += -lplayerc++ -lboost_thread-mt -lboost_signals-mt -lplayerc -lm -lz -lplayerinterface -lplayerwkb -lplayercommon
 INCLUDEPATH += ../common
-LIBS += -lmap -L../.build/lib -lmemcached
+LIBS += -lmap -lthread -L../.build/lib -lmemcached -lpthread -lrt
 
 DEPENDPATH += ui/ model/
 